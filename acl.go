@@ -0,0 +1,87 @@
+package main
+
+import (
+	"fmt"
+	"net/netip"
+)
+
+// compiledACL is the ACL parsed once into a binary trie of the CIDR prefixes,
+// holding the parsed port ranges, so a lookup walks at most 32 nodes without
+// allocating.
+type compiledACL struct {
+	root  aclNode
+	rules int
+}
+
+type aclNode struct {
+	children [2]*aclNode
+	rules    []aclRule
+}
+
+type aclRule struct {
+	start uint16
+	end   uint16
+	deny  bool
+}
+
+func compileACL(acl []ACLConfiguration) (*compiledACL, error) {
+	c := &compiledACL{}
+	for _, a := range acl {
+		prefix, err := netip.ParsePrefix(a.CIDR)
+		if err != nil {
+			return nil, fmt.Errorf("failed to parse cidr %s: %v", a.CIDR, err)
+		}
+		prefix = prefix.Masked()
+		if !prefix.Addr().Is4() {
+			return nil, fmt.Errorf("cidr %s is not ipv4", a.CIDR)
+		}
+		start, end, err := parsePortRange(a.InternalPorts)
+		if err != nil {
+			return nil, err
+		}
+
+		node := &c.root
+		ip := prefix.Addr().As4()
+		for b := 0; b < prefix.Bits(); b++ {
+			bit := (ip[b/8] >> (7 - b%8)) & 1
+			if node.children[bit] == nil {
+				node.children[bit] = &aclNode{}
+			}
+			node = node.children[bit]
+		}
+		node.rules = append(node.rules, aclRule{start: start, end: end, deny: a.Deny})
+		c.rules++
+	}
+	return c, nil
+}
+
+// allowed matches like the ACL list is checked in order: any matching allow
+// rule allows, otherwise a matching deny rule denies, otherwise allowDefault.
+func (c *compiledACL) allowed(ip netip.Addr, port uint16, allowDefault bool) bool {
+	ip = ip.Unmap()
+	if c == nil || c.rules == 0 || !ip.Is4() {
+		return allowDefault
+	}
+
+	denied := false
+	b := ip.As4()
+	node := &c.root
+	for depth := 0; node != nil; depth++ {
+		for _, r := range node.rules {
+			if port >= r.start && port <= r.end {
+				if !r.deny {
+					return true
+				}
+				denied = true
+			}
+		}
+		if depth == 32 {
+			break
+		}
+		node = node.children[(b[depth/8]>>(7-depth%8))&1]
+	}
+	if denied {
+		return false
+	}
+	return allowDefault
+}
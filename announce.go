@@ -0,0 +1,100 @@
+package main
+
+import (
+	"go.uber.org/zap"
+	"net"
+	"time"
+)
+
+const (
+	// announceAddr is the all hosts group and the client port of RFC 6886
+	announceAddr = "224.0.0.1:5350"
+	// Announcements are sent 10 times, the first after 250ms and then with
+	// doubling intervals
+	announceCount    = 10
+	announceInterval = 250 * time.Millisecond
+)
+
+// SetExternalIP changes the external address clients are told about. The
+// epoch restarts, as the mappings clients have are no longer reachable, and
+// the new address is announced.
+func (p *DynPortServer) SetExternalIP(ip net.IP) {
+	p.setExternalResponse(ip)
+	p.epoch.Store(time.Now().Unix())
+	p.l.Infof("external ip changed to %s", ip)
+	p.announce()
+}
+
+func (p *DynPortServer) setExternalResponse(ip net.IP) {
+	p.externalResponse.Store(newExternalResponse(ip))
+}
+
+func newExternalResponse(ip net.IP) *[12]byte {
+	var res [12]byte
+	res[1] = 128 + 0 // Response op code
+	if ip4 := ip.To4(); ip4 != nil {
+		writeNetworkOrderIP(res[8:12], ip4)
+	}
+	return &res
+}
+
+// announce multicasts the external address from every listen address,
+// replacing an announcement sequence still running.
+func (p *DynPortServer) announce() {
+	p.mu.Lock()
+	defer p.mu.Unlock()
+	if p.announceStop != nil {
+		close(p.announceStop)
+		p.announceStop = nil
+	}
+	if len(p.conns) == 0 {
+		// Not started yet, Start announces
+		return
+	}
+	group, err := net.ResolveUDPAddr("udp4", announceAddr)
+	if err != nil {
+		p.l.With(zap.Error(err)).Errorf("failed to resolve announce address")
+		return
+	}
+	// The first socket of every listen address, the others share its address
+	conns := make([]net.PacketConn, 0, len(p.listenAddrs))
+	for i := 0; i < len(p.conns); i += p.receive.Sockets {
+		conns = append(conns, p.conns[i])
+	}
+	stop := make(chan struct{})
+	p.announceStop = stop
+	go p.runAnnouncements(conns, group, stop)
+}
+
+func (p *DynPortServer) runAnnouncements(conns []net.PacketConn, group *net.UDPAddr, stop chan struct{}) {
+	interval := announceInterval
+	for n := 0; n < announceCount; n++ {
+		select {
+		case <-time.After(interval):
+		case <-stop:
+			return
+		}
+		interval *= 2
+		res := p.externalResponse.Load()
+		for _, conn := range conns {
+			var b [12]byte
+			copy(b[:], res[:])
+			writeNetworkOrderUint32(b[4:8], uint32(time.Now().Unix()-p.epoch.Load())) // Seconds Since Start of Epoch
+			if _, err := conn.WriteTo(b[:], group); err != nil {
+				metricAnnouncements.with("failed").Add(1)
+				p.l.With(zap.Error(err)).Debugf("failed to announce external address on %s", conn.LocalAddr())
+				continue
+			}
+			metricAnnouncements.with("sent").Add(1)
+		}
+	}
+}
+
+func (p *DynPortServer) stopAnnouncements() {
+	p.mu.Lock()
+	defer p.mu.Unlock()
+	if p.announceStop != nil {
+		close(p.announceStop)
+		p.announceStop = nil
+	}
+}
@@ -0,0 +1,316 @@
+package main
+
+import (
+	"encoding/binary"
+	"fmt"
+	"github.com/spf13/cobra"
+	"math/rand"
+	"net"
+	"net/netip"
+	"sort"
+	"strings"
+	"sync"
+	"time"
+)
+
+const (
+	benchOpMap = iota
+	benchOpRenew
+	benchOpDelete
+	benchOpExternal
+	benchOps
+)
+
+var benchOpNames = [benchOps]string{"map", "renew", "delete", "external"}
+
+type benchOptions struct {
+	target   *net.UDPAddr
+	sources  netip.Prefix
+	clients  int
+	rate     float64
+	duration time.Duration
+	timeout  time.Duration
+	lifetime uint32
+	weights  [benchOps]int
+}
+
+type benchResult struct {
+	sent      [benchOps]int
+	received  [benchOps]int
+	failed    [benchOps]int
+	dropped   [benchOps]int
+	latencies []time.Duration
+}
+
+// NewBenchCommand returns the bench command, generating load against a running server
+func NewBenchCommand() *cobra.Command {
+	var cmd = &cobra.Command{
+		Use:   "bench",
+		Short: "generate nat-pmp load against a server and report latency",
+		PersistentPreRunE: func(cmd *cobra.Command, args []string) error {
+			// The bench does not need the server configuration
+			return nil
+		},
+		RunE: func(cmd *cobra.Command, args []string) error {
+			opts, err := parseBenchOptions(cmd)
+			if err != nil {
+				return err
+			}
+			result, err := runBench(opts)
+			if err != nil {
+				return err
+			}
+			result.print(opts)
+			return nil
+		},
+	}
+	cmd.Flags().String("target", "127.0.0.1:5351", "server to send nat-pmp requests to")
+	cmd.Flags().String("source-network", "127.1.0.0/16", "network the simulated client ips are taken from, must be local addresses")
+	cmd.Flags().Int("clients", 64, "simulated clients, each with its own source ip and port")
+	cmd.Flags().Float64("rate", 1000, "requests per second over all clients")
+	cmd.Flags().Duration("duration", 10*time.Second, "time to generate load for")
+	cmd.Flags().Duration("timeout", time.Second, "time to wait for a response before counting the request as dropped")
+	cmd.Flags().Int("lifetime", 120, "lifetime in seconds requested for mappings")
+	cmd.Flags().String("mix", "map=40,renew=40,delete=10,external=10", "relative weight of each request type")
+	return cmd
+}
+
+func parseBenchOptions(cmd *cobra.Command) (*benchOptions, error) {
+	target, _ := cmd.Flags().GetString("target")
+	sources, _ := cmd.Flags().GetString("source-network")
+	clients, _ := cmd.Flags().GetInt("clients")
+	rate, _ := cmd.Flags().GetFloat64("rate")
+	duration, _ := cmd.Flags().GetDuration("duration")
+	timeout, _ := cmd.Flags().GetDuration("timeout")
+	lifetime, _ := cmd.Flags().GetInt("lifetime")
+	mix, _ := cmd.Flags().GetString("mix")
+
+	opts := &benchOptions{clients: clients, rate: rate, duration: duration, timeout: timeout, lifetime: uint32(lifetime)}
+	var err error
+	if opts.target, err = net.ResolveUDPAddr("udp4", target); err != nil {
+		return nil, fmt.Errorf("invalid target %s: %v", target, err)
+	}
+	if opts.sources, err = netip.ParsePrefix(sources); err != nil || !opts.sources.Addr().Is4() {
+		return nil, fmt.Errorf("invalid source network %s: %v", sources, err)
+	}
+	opts.sources = opts.sources.Masked()
+	if clients < 1 || rate <= 0 || lifetime < 1 {
+		return nil, fmt.Errorf("clients, rate and lifetime must be positive")
+	}
+
+	total := 0
+	for _, w := range strings.Split(mix, ",") {
+		kv := strings.SplitN(strings.TrimSpace(w), "=", 2)
+		op := -1
+		for i, name := range benchOpNames {
+			if kv[0] == name {
+				op = i
+			}
+		}
+		var weight int
+		if op < 0 || len(kv) != 2 {
+			return nil, fmt.Errorf("invalid mix %s", mix)
+		}
+		if _, err := fmt.Sscanf(kv[1], "%d", &weight); err != nil || weight < 0 {
+			return nil, fmt.Errorf("invalid mix %s", mix)
+		}
+		opts.weights[op] = weight
+		total += weight
+	}
+	if total == 0 {
+		return nil, fmt.Errorf("invalid mix %s", mix)
+	}
+	return opts, nil
+}
+
+// sourceIP returns the ip of client n, spread over the hosts of the source network
+func (o *benchOptions) sourceIP(n int) net.IP {
+	hosts := uint32(1) << (32 - o.sources.Bits())
+	base := binary.BigEndian.Uint32(o.sources.Addr().AsSlice())
+	ip := make(net.IP, 4)
+	if hosts <= 2 {
+		binary.BigEndian.PutUint32(ip, base)
+	} else {
+		// Skip the network and broadcast address
+		binary.BigEndian.PutUint32(ip, base+1+uint32(n)%(hosts-2))
+	}
+	return ip
+}
+
+func runBench(opts *benchOptions) (*benchResult, error) {
+	conns := make([]*net.UDPConn, 0, opts.clients)
+	defer func() {
+		for _, conn := range conns {
+			conn.Close()
+		}
+	}()
+	for n := 0; n < opts.clients; n++ {
+		conn, err := net.DialUDP("udp4", &net.UDPAddr{IP: opts.sourceIP(n)}, opts.target)
+		if err != nil {
+			return nil, fmt.Errorf("failed to open client %d from %s: %v", n, opts.sourceIP(n), err)
+		}
+		conns = append(conns, conn)
+	}
+
+	interval := time.Duration(float64(time.Second) * float64(opts.clients) / opts.rate)
+	deadline := time.Now().Add(opts.duration)
+	results := make([]*benchResult, len(conns))
+	var wg sync.WaitGroup
+	for n, conn := range conns {
+		wg.Add(1)
+		results[n] = &benchResult{}
+		go func(n int, conn *net.UDPConn) {
+			defer wg.Done()
+			c := &benchClient{opts: opts, conn: conn, random: rand.New(rand.NewSource(int64(n))), result: results[n]}
+			// Spread the first requests of the clients over the interval
+			time.Sleep(time.Duration(c.random.Int63n(int64(interval) + 1)))
+			ticker := time.NewTicker(interval)
+			defer ticker.Stop()
+			for time.Now().Before(deadline) {
+				c.request()
+				<-ticker.C
+			}
+		}(n, conn)
+	}
+	wg.Wait()
+
+	total := &benchResult{}
+	for _, r := range results {
+		for op := 0; op < benchOps; op++ {
+			total.sent[op] += r.sent[op]
+			total.received[op] += r.received[op]
+			total.failed[op] += r.failed[op]
+			total.dropped[op] += r.dropped[op]
+		}
+		total.latencies = append(total.latencies, r.latencies...)
+	}
+	sort.Slice(total.latencies, func(i, j int) bool { return total.latencies[i] < total.latencies[j] })
+	return total, nil
+}
+
+// benchClient is one simulated client, sending one request at a time
+type benchClient struct {
+	opts     *benchOptions
+	conn     *net.UDPConn
+	random   *rand.Rand
+	result   *benchResult
+	nextPort uint16
+	mapped   []uint16
+	buf      [16]byte
+}
+
+func (c *benchClient) pickOp() int {
+	total := 0
+	for _, w := range c.opts.weights {
+		total += w
+	}
+	r := c.random.Intn(total)
+	for op, w := range c.opts.weights {
+		if r < w {
+			return op
+		}
+		r -= w
+	}
+	return benchOpExternal
+}
+
+func (c *benchClient) request() {
+	op := c.pickOp()
+	if (op == benchOpRenew || op == benchOpDelete) && len(c.mapped) == 0 {
+		op = benchOpMap
+	}
+
+	var req []byte
+	var port uint16
+	var mappedIndex int
+	switch op {
+	case benchOpExternal:
+		req = []byte{0, 0}
+	case benchOpMap:
+		c.nextPort++
+		port = 1024 + c.nextPort%60000
+		req = mappingRequest(port, c.opts.lifetime)
+	case benchOpRenew, benchOpDelete:
+		mappedIndex = c.random.Intn(len(c.mapped))
+		port = c.mapped[mappedIndex]
+		lifetime := c.opts.lifetime
+		if op == benchOpDelete {
+			lifetime = 0
+		}
+		req = mappingRequest(port, lifetime)
+	}
+
+	c.result.sent[op]++
+	start := time.Now()
+	if _, err := c.conn.Write(req); err != nil {
+		c.result.dropped[op]++
+		return
+	}
+
+	c.conn.SetReadDeadline(start.Add(c.opts.timeout))
+	for {
+		n, err := c.conn.Read(c.buf[:])
+		if err != nil {
+			c.result.dropped[op]++
+			return
+		}
+		// Skip late responses to earlier requests
+		if n < 4 || c.buf[1] != req[1]+128 || (req[1] != 0 && (n < 10 || binary.BigEndian.Uint16(c.buf[8:10]) != port)) {
+			continue
+		}
+		break
+	}
+	c.result.latencies = append(c.result.latencies, time.Since(start))
+	c.result.received[op]++
+	if binary.BigEndian.Uint16(c.buf[2:4]) != 0 {
+		c.result.failed[op]++
+		return
+	}
+
+	switch op {
+	case benchOpMap:
+		c.mapped = append(c.mapped, port)
+	case benchOpDelete:
+		c.mapped[mappedIndex] = c.mapped[len(c.mapped)-1]
+		c.mapped = c.mapped[:len(c.mapped)-1]
+	}
+}
+
+// mappingRequest returns a udp mapping request for port, suggesting the same external port
+func mappingRequest(port uint16, lifetime uint32) []byte {
+	req := make([]byte, 12)
+	req[1] = 1
+	binary.BigEndian.PutUint16(req[4:6], port)
+	binary.BigEndian.PutUint16(req[6:8], port)
+	binary.BigEndian.PutUint32(req[8:12], lifetime)
+	return req
+}
+
+func (r *benchResult) percentile(p float64) time.Duration {
+	if len(r.latencies) == 0 {
+		return 0
+	}
+	i := int(float64(len(r.latencies)) * p)
+	if i >= len(r.latencies) {
+		i = len(r.latencies) - 1
+	}
+	return r.latencies[i]
+}
+
+func (r *benchResult) print(opts *benchOptions) {
+	sent, received, failed, dropped := 0, 0, 0, 0
+	fmt.Printf("%-10s %10s %10s %10s %10s\n", "request", "sent", "received", "failed", "dropped")
+	for op := 0; op < benchOps; op++ {
+		fmt.Printf("%-10s %10d %10d %10d %10d\n", benchOpNames[op], r.sent[op], r.received[op], r.failed[op], r.dropped[op])
+		sent += r.sent[op]
+		received += r.received[op]
+		failed += r.failed[op]
+		dropped += r.dropped[op]
+	}
+	fmt.Printf("%-10s %10d %10d %10d %10d\n", "total", sent, received, failed, dropped)
+	fmt.Printf("\nrate %.0f/s of %.0f/s requested\n", float64(sent)/opts.duration.Seconds(), opts.rate)
+	if sent > 0 {
+		fmt.Printf("drops %.3f%%\n", float64(dropped)*100/float64(sent))
+	}
+	fmt.Printf("latency p50 %v p99 %v p999 %v max %v\n", r.percentile(0.5), r.percentile(0.99), r.percentile(0.999), r.percentile(1))
+}
@@ -0,0 +1,73 @@
+package main
+
+import (
+	"sync"
+	"time"
+)
+
+// changeLog is a bounded ring of the local lease changes, numbered by a
+// sequence starting at 1. The epoch identifies the run of the process, a
+// sequence is only meaningful together with its epoch.
+type changeLog struct {
+	mu      sync.Mutex
+	epoch   int64
+	entries []changeEntry
+	next    uint64
+	// Closed and replaced on every append
+	notify chan struct{}
+}
+
+// changeEntry is one line of the change stream, entries without lease are
+// heartbeats telling the current sequence.
+type changeEntry struct {
+	Epoch int64             `json:"epoch,omitempty"`
+	Seq   uint64            `json:"seq"`
+	Lease *PortMappingLease `json:"lease,omitempty"`
+}
+
+func newChangeLog(size int) *changeLog {
+	if size < 1 {
+		size = 1
+	}
+	return &changeLog{
+		epoch:   time.Now().UnixNano(),
+		entries: make([]changeEntry, size),
+		next:    1,
+		notify:  make(chan struct{}),
+	}
+}
+
+func (c *changeLog) append(lease PortMappingLease) {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	c.entries[c.next%uint64(len(c.entries))] = changeEntry{Seq: c.next, Lease: &lease}
+	c.next++
+	close(c.notify)
+	c.notify = make(chan struct{})
+}
+
+// last returns the sequence of the last change
+func (c *changeLog) last() uint64 {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	return c.next - 1
+}
+
+// since returns up to max changes after seq, and a channel closed on the next
+// change. It returns false when the changes after seq are no longer held.
+func (c *changeLog) since(seq uint64, max int) ([]changeEntry, <-chan struct{}, bool) {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	oldest := uint64(1)
+	if c.next > uint64(len(c.entries)) {
+		oldest = c.next - uint64(len(c.entries))
+	}
+	if seq+1 < oldest || seq >= c.next {
+		return nil, nil, false
+	}
+	entries := make([]changeEntry, 0)
+	for s := seq + 1; s < c.next && len(entries) < max; s++ {
+		entries = append(entries, c.entries[s%uint64(len(c.entries))])
+	}
+	return entries, c.notify, true
+}
@@ -14,6 +14,7 @@ import (
 	"regexp"
 	"strconv"
 	"strings"
+	"time"
 )
 
 type ACLConfiguration struct {
@@ -22,19 +23,57 @@ type ACLConfiguration struct {
 	Deny          bool
 }
 type Configuration struct {
-	ACLAllowDefault       bool
-	CreateChains          bool
-	DataDir               string   `validate:"dir,required"`
-	ExternalIP            string   `validate:"omitempty,ipv4"`
-	ListenAddrs           []string `validate:"required,dive,hostname_port,min=1"`
-	LogFormat             string
-	LogLevel              string
-	PortRange             string `validate:"range,required"`
-	SkipJumpCheck         bool
-	ACL                   []ACLConfiguration
-	ReplicationListenAddr string `validate:"omitempty,hostname_port"`
-	ReplicationSecret     string
-	ReplicationPeers      []string
+	ACLAllowDefault          bool
+	CreateChains             bool
+	DataDir                  string `validate:"dir,required"`
+	DebugListenAddr          string `validate:"omitempty,hostname_port"`
+	ExternalIP               string `validate:"omitempty,ipv4"`
+	ExternalIPCheckInterval  time.Duration
+	ExternalIPs              []string `validate:"omitempty,dive,ipv4"`
+	HonorSuggestedPort       bool
+	IPTablesBackend          string   `validate:"oneof=exec restore"`
+	ListenAddrs              []string `validate:"required,dive,hostname_port,min=1"`
+	ListenSockets            int      `validate:"min=1"`
+	LogBufferSize            int      `validate:"min=0"`
+	LogFlushInterval         time.Duration
+	LogFormat                string
+	LogLevel                 string
+	LogSampleInitial         int    `validate:"min=0"`
+	LogSampleThereafter      int    `validate:"min=0"`
+	MetricsListenAddr        string `validate:"omitempty,hostname_port"`
+	MaxLeaseLifetime         time.Duration
+	MappingEngine            string `validate:"oneof=iptables nftables"`
+	NFTablesForwardMark      uint32
+	NFTablesTable            string
+	PortPartitioning         bool
+	PortRange                string `validate:"range,required"`
+	PortReuseDelay           time.Duration
+	RateLimit                float64 `validate:"min=0"`
+	RateLimitAction          string  `validate:"oneof=drop reject"`
+	RateLimitBurst           int     `validate:"min=1"`
+	RateLimitClients         int     `validate:"min=1"`
+	ReconcileDebounce        time.Duration
+	ReconcileMaxDelay        time.Duration
+	ReconcileWait            time.Duration
+	RenewalPublishMargin     float64 `validate:"min=0,max=1"`
+	ReceiveBatchSize         int     `validate:"min=1"`
+	Workers                  int     `validate:"min=0"`
+	WorkerQueueSize          int     `validate:"min=0"`
+	SkipJumpCheck            bool
+	StoreDurability          string        `validate:"oneof=sync async"`
+	StoreFlushInterval       time.Duration `validate:"min=1ms"`
+	StoreFlushSize           int           `validate:"min=1"`
+	TraceSampleRatio         float64       `validate:"min=0,max=1"`
+	ACL                      []ACLConfiguration
+	ReplicationAdvertiseAddr string `validate:"omitempty,hostname_port"`
+	ReplicationListenAddr    string `validate:"omitempty,hostname_port"`
+	ReplicationSecret        string
+	ReplicationPeers         []string
+	ReplicationChangeLogSize int           `validate:"min=1"`
+	ReplicationHeartbeat     time.Duration `validate:"min=100ms"`
+	ReplicationQueueSize     int           `validate:"min=1"`
+	ReplicationBatchSize     int           `validate:"min=1"`
+	ReplicationSyncInterval  time.Duration `validate:"min=1s"`
 }
 
 func NewRootCommand() *cobra.Command {
@@ -45,29 +84,80 @@ func NewRootCommand() *cobra.Command {
 			return initializeConfig(cmd)
 		},
 		Run: func(cmd *cobra.Command, args []string) {
-			start()
+			start(cmd)
 		},
 	}
 	rootCmd.PersistentFlags().StringP("config", "c", "config.yaml", "config file")
 	rootCmd.PersistentFlags().StringP("data-dir", "d", "/tmp/dynport", "director to use for storing data")
 	rootCmd.PersistentFlags().String("log-level", "INFO", "log level")
 	rootCmd.PersistentFlags().String("log-format", "json", "log format (plain/json)")
+	rootCmd.PersistentFlags().Int("log-sample-initial", 100, "entries logged per message and second before sampling, 0 disables sampling")
+	rootCmd.PersistentFlags().Int("log-sample-thereafter", 100, "when sampling, log every nth entry of a message in the same second, 0 drops them")
+	rootCmd.PersistentFlags().Int("log-buffer-size", 0, "bytes of log output buffered before writing, 0 writes every entry right away")
+	rootCmd.PersistentFlags().Duration("log-flush-interval", time.Second, "maximum time log output stays buffered")
 	rootCmd.Flags().String("external-ip", "", "ip to report to client as external (default auto detect)")
+	rootCmd.Flags().Duration("external-ip-check-interval", time.Minute, "interval to detect changes of the auto detected external ip, announcing the new one, 0 disables")
+	rootCmd.Flags().StringSlice("external-ips", []string{}, "external ips to place the leases on, clients are spread over them and moved to another one when the ports of theirs are used up, the first one is reported for leases without one (overrides external-ip)")
 	rootCmd.Flags().StringSlice("listen-addrs", []string{}, "addresses to listen on for nat-pmp requests, needs to be actual ip")
+	rootCmd.Flags().Int("listen-sockets", 1, "sockets per listen address, sharing it with SO_REUSEPORT")
+	rootCmd.Flags().Int("workers", 0, "workers handling nat-pmp requests (default one per cpu)")
+	rootCmd.Flags().Int("worker-queue-size", 64, "received request batches queued for the workers")
+	rootCmd.Flags().Int("receive-batch-size", 32, "nat-pmp requests read at most per syscall")
 	rootCmd.Flags().Bool("create-chains", true, "create required chains")
 	rootCmd.Flags().Bool("skip-jump-check", false, "disable check of rule pointing to chains")
+	rootCmd.Flags().String("iptables-backend", iptables_backend_restore, "how rules are applied, one iptables-restore transaction per reconcile (restore) or one iptables call per rule (exec)")
+	rootCmd.Flags().String("mapping-engine", mapping_engine_iptables, "engine programming the mappings (iptables/nftables)")
+	rootCmd.Flags().Uint32("nftables-forward-mark", 0, "ct mark or-ed into the connections translated to a lease, for the forward chains of other tables to accept, used by the nftables engine (0 sets none)")
+	rootCmd.Flags().String("nftables-table", "ip dynport", "nftables table holding the mapping set and maps, used by the nftables engine")
 	rootCmd.Flags().Bool("acl-allow-default", false, "default allow port mappings")
 	rootCmd.Flags().String("port-range", "10000-19999", "external port range to allocate from")
+	rootCmd.Flags().Bool("port-partitioning", false, "with replication peers allocate new ports only from the slice of the port range this node owns, one slice per node ordered by address, the peers then list all nodes including this one")
+	rootCmd.Flags().Duration("max-lease-lifetime", 2*time.Hour, "maximum lifetime granted to a mapping, longer requested lifetimes are reduced")
+	rootCmd.Flags().Duration("port-reuse-delay", 2*time.Minute, "time a released external port cools down before it is allocated again")
+	rootCmd.Flags().Bool("honor-suggested-port", true, "allocate the external port suggested by the client when it is free")
+	rootCmd.Flags().Duration("reconcile-debounce", 100*time.Millisecond, "quiet period merging reconcile requests into one run")
+	rootCmd.Flags().Duration("reconcile-max-delay", time.Second, "maximum delay of a reconcile after it has been requested")
+	rootCmd.Flags().Duration("reconcile-wait", 0, "wait up to this long for the rules to be applied before responding to a mapping request (0 responds right away)")
+	rootCmd.Flags().String("metrics-listen-addr", "", "enable and listen for prometheus metrics requests on /metrics and readiness on /ready")
+	rootCmd.Flags().String("debug-listen-addr", "", "enable and listen for pprof requests on /debug/pprof/, for local access only")
+	rootCmd.Flags().Float64("trace-sample-ratio", 0, "fraction of requests traced, the spans of traced requests are logged and carried to the peers (0 disables tracing)")
 	rootCmd.Flags().String("replication-listen-addr", "", "enable and listen for replication requests")
+	rootCmd.Flags().String("replication-advertise-addr", "", "address of this node as listed in the replication peers, tells peers which node follows their changes and is needed by port partitioning (default replication listen addr)")
 	rootCmd.Flags().StringSlice("replication-peers", []string{}, "peers to replicate with `x.x.x.x:8080`")
+	rootCmd.Flags().Int("replication-queue-size", 10000, "lease updates queued per peer, a peer gets all leases pushed when its queue overflows")
+	rootCmd.Flags().Int("replication-batch-size", 500, "lease updates pushed to a peer per request")
+	rootCmd.Flags().Duration("replication-sync-interval", 5*time.Minute, "interval of comparing the leases with the peers, pulling the differing ones")
+	rootCmd.Flags().Int("replication-change-log-size", 65536, "local lease changes kept for peers resuming their change stream")
+	rootCmd.Flags().Duration("replication-heartbeat", 10*time.Second, "heartbeat interval of change streams, a stream silent for three intervals is reconnected")
+	rootCmd.Flags().String("store-durability", "sync", "when lease changes are acknowledged, after their group commit (sync) or once applied in memory (async)")
+	rootCmd.Flags().Duration("store-flush-interval", 100*time.Millisecond, "maximum time lease changes are pending before they are committed")
+	rootCmd.Flags().Int("store-flush-size", 1000, "pending lease changes starting a commit, and changes per transaction")
+	rootCmd.Flags().Float64("renewal-publish-margin", 0.25, "renewals are persisted and replicated once the lifetime left as known to disk and peers is below this fraction of the lease lifetime")
+	rootCmd.Flags().Float64("rate-limit", 0, "nat-pmp requests per second allowed per client ip (0 disables the limit)")
+	rootCmd.Flags().Int("rate-limit-burst", 20, "nat-pmp requests a client ip may send at once before the rate limit applies")
+	rootCmd.Flags().Int("rate-limit-clients", 65536, "client ips tracked by the rate limit")
+	rootCmd.Flags().String("rate-limit-action", "drop", "what happens to requests over the rate limit, dropped (drop) or answered with result code 3 (reject)")
+	rootCmd.AddCommand(NewBenchCommand())
 	return rootCmd
 }
 func initializeConfig(cmd *cobra.Command) error {
+	c, err := loadConfig(cmd)
+	if err != nil {
+		return err
+	}
+	config = c
+	return nil
+}
+
+// loadConfig reads and validates the configuration from the config file, the
+// environment and the flags
+func loadConfig(cmd *cobra.Command) (Configuration, error) {
+	var config Configuration
 	vp := viper.New()
 	// Don't forget to read config either from cfgFile or from home directory!
 	cfgFile, err := cmd.PersistentFlags().GetString("config")
 	if err != nil {
-		return err
+		return config, err
 	}
 
 	if cfgFile != "" {
@@ -75,7 +165,7 @@ func initializeConfig(cmd *cobra.Command) error {
 			// Use config file from the flag.
 			vp.SetConfigFile(cfgFile)
 			if err := vp.ReadInConfig(); err != nil {
-				return err
+				return config, err
 			}
 		}
 	}
@@ -87,7 +177,7 @@ func initializeConfig(cmd *cobra.Command) error {
 	bindFlags(cmd, vp)
 
 	if err := vp.Unmarshal(&config); err != nil {
-		return err
+		return config, err
 	}
 
 	validate := validator.New()
@@ -114,10 +204,10 @@ func initializeConfig(cmd *cobra.Command) error {
 		return false
 	})
 	if err := validate.Struct(&config); err != nil {
-		return err
+		return config, err
 	}
 
-	return nil
+	return config, nil
 }
 
 // Bind each cobra flag to its associated viper configuration (config file and environment variable)
@@ -146,7 +236,9 @@ func bindFlags(cmd *cobra.Command, v *viper.Viper) {
 	})
 }
 
-func getLogger() *zap.Logger {
+// getLogger returns the logger and the logger of the trace spans, which is not
+// sampled, as the tracer samples whole traces
+func getLogger() (*zap.Logger, *zap.Logger) {
 	level, err := zapcore.ParseLevel(config.LogLevel)
 	if err != nil {
 		fmt.Println("failed to parse level")
@@ -155,12 +247,24 @@ func getLogger() *zap.Logger {
 
 	var zcore zapcore.Core
 
+	ws := zapcore.AddSync(os.Stdout)
+	if config.LogBufferSize > 0 {
+		// Flushed by the flush interval, Sync and entries above error level
+		ws = &zapcore.BufferedWriteSyncer{WS: ws, Size: config.LogBufferSize, FlushInterval: config.LogFlushInterval}
+	}
+
 	if config.LogFormat == "plain" {
-		zcore = zapcore.NewCore(zapcore.NewConsoleEncoder(zap.NewProductionEncoderConfig()), zapcore.AddSync(os.Stdout), level)
+		zcore = zapcore.NewCore(zapcore.NewConsoleEncoder(zap.NewProductionEncoderConfig()), ws, level)
 	} else {
 		encoderConfig := ecszap.NewDefaultEncoderConfig()
-		zcore = ecszap.NewCore(encoderConfig, os.Stdout, level)
+		zcore = ecszap.NewCore(encoderConfig, ws, level)
+	}
+	spans := zap.New(zcore)
+
+	if config.LogSampleInitial > 0 {
+		// Caps the entries per message and second, so a flood of requests does not turn into a flood of logs
+		zcore = zapcore.NewSamplerWithOptions(zcore, time.Second, config.LogSampleInitial, config.LogSampleThereafter)
 	}
 
-	return zap.New(zcore, zap.AddCaller())
+	return zap.New(zcore, zap.AddCaller()), spans
 }
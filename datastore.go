@@ -2,17 +2,68 @@ package main
 
 import (
 	"crypto/md5"
+	"encoding/hex"
 	"fmt"
 	"github.com/timshannon/badgerhold"
 	"go.uber.org/zap"
 	"net"
+	"net/netip"
+	"os"
+	"sort"
+	"strconv"
+	"strings"
+	"sync"
+	"sync/atomic"
 	"time"
 )
 
+// DataStore serves all reads from an in-memory index of the leases, loaded at
+// startup, and writes changes behind to badgerhold, see PersistOptions. The
+// leases are split into shards by client, each with its own lock, so requests
+// of different clients do not serialize on one lock.
 type DataStore struct {
-	l     *zap.Logger
-	store *badgerhold.Store
+	l       *zap.Logger
+	store   *badgerhold.Store
+	persist PersistOptions
+
+	shards [storeShards]storeShard
+	// external maps the external ports to the Id of their lease over all
+	// shards, clients the client ips to the external ip they are placed on
+	externalMu sync.Mutex
+	external   map[externalKey]string
+	clients    map[netip.Addr]clientPlacement
+	clock      hybridClock
+	ports      *PortAllocator
+	commit     atomic.Pointer[pendingCommit]
+	pendingLen atomic.Int64
+	// seq is the last commit, journal and seq are owned by the flusher
+	seq     uint64
+	journal *leaseJournal
+	// loaded is the state at startup, to be written as snapshot
+	loaded  []PortMappingLease
+	flushCh chan struct{}
+	flushed chan struct{}
+	closeCh chan interface{}
+}
+
+const storeShards = 32
+
+// clientPlacement is the external ip of the leases of a client ip
+type clientPlacement struct {
+	ip     netip.Addr
+	leases int
 }
+
+// storeShard holds the leases of the clients hashed to it
+type storeShard struct {
+	mu      sync.RWMutex
+	index   *leaseIndex
+	pending map[string]pendingWrite
+	// renewals are the leases renewed in memory only, with the time they
+	// are to be published by
+	renewals map[string]time.Time
+}
+
 type badgerLog struct {
 	zap.SugaredLogger
 }
@@ -20,101 +71,585 @@ type badgerLog struct {
 func (b *badgerLog) Warningf(format string, args ...interface{}) {
 	b.Warnf(format, args...)
 }
-func NewDataStore(logger *zap.Logger, dataDir string) (*DataStore, error) {
+func NewDataStore(logger *zap.Logger, dataDir string, ports *PortAllocator, persist PersistOptions) (*DataStore, error) {
 	options := badgerhold.DefaultOptions
 	options.Dir = dataDir
 	options.ValueDir = dataDir
 	options.Logger = &badgerLog{*logger.Sugar()}
+	options.Encoder = storeEncode
+	options.Decoder = storeDecode
 
 	store, err := badgerhold.Open(options)
 	if err != nil {
 		return nil, fmt.Errorf("failed to open badgerhold: %v", err)
 	}
 
-	return &DataStore{l: logger, store: store}, nil
+	if persist.Size < 1 {
+		persist.Size = 1
+	}
+	d := &DataStore{
+		l:        logger,
+		store:    store,
+		persist:  persist,
+		external: make(map[externalKey]string),
+		clients:  make(map[netip.Addr]clientPlacement),
+		ports:    ports,
+		journal:  &leaseJournal{dir: dataDir},
+		flushCh:  make(chan struct{}, 1),
+		flushed:  make(chan struct{}),
+		closeCh:  make(chan interface{}),
+	}
+	for i := range d.shards {
+		d.shards[i] = storeShard{
+			index:    newLeaseIndex(),
+			pending:  make(map[string]pendingWrite),
+			renewals: make(map[string]time.Time),
+		}
+	}
+	d.commit.Store(newPendingCommit())
+	if err := d.load(); err != nil {
+		store.Close()
+		return nil, fmt.Errorf("failed to load leases: %v", err)
+	}
+	go d.runFlusher()
+	return d, nil
+}
+
+// shard returns the shard of the client key
+func (d *DataStore) shard(key clientKey) *storeShard {
+	ip := key.ip.As16()
+	h := uint64(fnvOffset64)
+	for _, b := range ip {
+		h = (h ^ uint64(b)) * fnvPrime64
+	}
+	h = (h ^ uint64(key.port>>8)) * fnvPrime64
+	h = (h ^ uint64(key.port&0xff)) * fnvPrime64
+	h = (h ^ uint64(key.protocol)) * fnvPrime64
+	return &d.shards[h%storeShards]
+}
+
+func (d *DataStore) shardOf(lease *PortMappingLease) *storeShard {
+	return d.shard(newClientKey(lease.ClientIP, lease.ClientPort, lease.Protocol))
+}
+
+func (d *DataStore) externalKey(lease *PortMappingLease) externalKey {
+	return externalKey{protocol: lease.Protocol, ip: d.ports.CanonicalIP(lease.ExternalIP), port: lease.ExternalPort}
+}
+
+// claimExternal takes the external port for the lease, unless another lease
+// has it
+func (d *DataStore) claimExternal(lease *PortMappingLease) (string, bool) {
+	key := d.externalKey(lease)
+	d.externalMu.Lock()
+	defer d.externalMu.Unlock()
+	if other, ok := d.external[key]; ok && other != lease.Id {
+		return other, false
+	}
+	if _, ok := d.external[key]; !ok {
+		d.place(lease, key.ip)
+	}
+	d.external[key] = lease.Id
+	return "", true
+}
+
+func (d *DataStore) releaseExternal(lease *PortMappingLease) {
+	key := d.externalKey(lease)
+	d.externalMu.Lock()
+	defer d.externalMu.Unlock()
+	if d.external[key] == lease.Id {
+		delete(d.external, key)
+		client := newClientKey(lease.ClientIP, 0, lease.Protocol).ip
+		if c := d.clients[client]; c.leases > 1 {
+			c.leases--
+			d.clients[client] = c
+		} else {
+			delete(d.clients, client)
+		}
+	}
+}
+
+// place counts the lease for the placement of its client, the last lease of
+// a client moves it to its external ip. externalMu is held.
+func (d *DataStore) place(lease *PortMappingLease, ip netip.Addr) {
+	client := newClientKey(lease.ClientIP, 0, lease.Protocol).ip
+	c := d.clients[client]
+	c.ip = ip
+	c.leases++
+	d.clients[client] = c
+}
+
+// ClientExternalIP returns the external ip the leases of the client ip are
+// on, the zero address without leases
+func (d *DataStore) ClientExternalIP(client netip.Addr) netip.Addr {
+	d.externalMu.Lock()
+	defer d.externalMu.Unlock()
+	return d.clients[client.Unmap()].ip
+}
+
+// load loads the leases from the snapshot and journal when they reach the last
+// commit of the store, and otherwise from the store.
+func (d *DataStore) load() error {
+	var meta storeMeta
+	if err := d.store.Get(storeMetaKey, &meta); err != nil && err != badgerhold.ErrNotFound {
+		return err
+	}
+	d.seq = meta.Seq
+
+	source := "snapshot"
+	leases, err := readSnapshot(d.journal.dir, meta.Seq)
+	if err != nil {
+		if !os.IsNotExist(err) {
+			d.l.With(zap.Error(err)).Info("lease snapshot is not usable, loading from the store")
+		}
+		source = "store"
+		leases = make([]*PortMappingLease, 0)
+		if err := d.store.Find(&leases, &badgerhold.Query{}); err != nil {
+			return err
+		}
+	}
+	for _, lease := range leases {
+		lease.ExternalIP = d.ports.LeaseIP(lease.ExternalIP)
+		d.shardOf(lease).index.put(lease)
+		key := d.externalKey(lease)
+		if _, ok := d.external[key]; !ok {
+			d.place(lease, key.ip)
+		}
+		d.external[key] = lease.Id
+		d.clock.observe(lease.Version)
+		d.ports.Reserve(lease.Protocol, lease.ExternalIP, lease.ExternalPort)
+	}
+	if source == "store" || d.journal.hasRecords() {
+		d.loaded = make([]PortMappingLease, 0, len(leases))
+		for _, lease := range leases {
+			d.loaded = append(d.loaded, *lease)
+		}
+	}
+	d.l.Sugar().Infof("loaded %d leases from the %s", len(leases), source)
+	return nil
 }
 
+// Close writes the pending changes and closes the store
 func (d *DataStore) Close() error {
+	close(d.closeCh)
+	<-d.flushed
 	return d.store.Close()
 }
 
-func (d *DataStore) GetLeases() ([]*PortMappingLease, error) {
-	leases := make([]*PortMappingLease, 0)
-	err := d.store.Find(&leases, &badgerhold.Query{})
-	if err != nil {
-		return nil, err
+// collect returns the leases fn returns per shard
+func (d *DataStore) collect(fn func(x *leaseIndex) []*PortMappingLease) []*PortMappingLease {
+	var leases []*PortMappingLease
+	for i := range d.shards {
+		s := &d.shards[i]
+		s.mu.RLock()
+		leases = append(leases, fn(s.index)...)
+		s.mu.RUnlock()
+	}
+	if leases == nil {
+		leases = make([]*PortMappingLease, 0)
 	}
-	return leases, nil
+	return leases
+}
+
+func (d *DataStore) GetLeases() ([]*PortMappingLease, error) {
+	return d.collect((*leaseIndex).all), nil
 }
 
 func (d *DataStore) GetActiveLeases() ([]*PortMappingLease, error) {
-	after := time.Now().Add(-(5 * time.Minute))
+	now := time.Now()
+	return d.collect(func(x *leaseIndex) []*PortMappingLease { return x.active(now) }), nil
+}
+
+// UpsertLease stores a local change of the lease, giving it and the stored
+// lease a new version. It returns whether the store changed.
+func (d *DataStore) UpsertLease(lease *PortMappingLease) (bool, error) {
+	return d.upsert(lease, false)
+}
+
+// MergeLease stores a lease replicated from a peer when it is newer than the
+// stored one, keeping its version. It returns whether the store changed.
+func (d *DataStore) MergeLease(lease *PortMappingLease) (bool, error) {
+	return d.upsert(lease, lease.Version != 0)
+}
 
-	leases := make([]*PortMappingLease, 0)
-	err := d.store.Find(&leases, badgerhold.Where("LastSeen").Ge(after))
+// CreateLease stores a new local lease. When another request of the client
+// created its lease meanwhile, that lease is renewed instead and lease gets
+// its external port. It returns whether lease was created.
+func (d *DataStore) CreateLease(lease *PortMappingLease) (bool, error) {
+	defer metricStoreUpsertDuration.observe(time.Now(), "local")
+	s := d.shardOf(lease)
+	s.mu.Lock()
+	created := true
+	if existing := s.index.get(lease.Id); existing != nil {
+		created = false
+		lease.ExternalIP, lease.ExternalPort, lease.Created = existing.ExternalIP, existing.ExternalPort, existing.Created
+	}
+	changed, err := d.upsertLocked(s, lease, false)
+	commit := d.commit.Load()
+	s.mu.Unlock()
 	if err != nil {
-		return nil, err
+		return false, err
+	}
+	if changed {
+		err = d.waitCommit(commit)
 	}
-	return leases, nil
+	return created, err
 }
 
-func (d *DataStore) UpsertLease(lease *PortMappingLease) error {
-	leases := make([]*PortMappingLease, 0)
-	err := d.store.Find(&leases, badgerhold.Where("Id").Eq(lease.Id))
-	if err != nil {
-		return err
+func (d *DataStore) upsert(lease *PortMappingLease, versioned bool) (bool, error) {
+	source := "local"
+	if versioned {
+		source = "peer"
+	}
+	defer metricStoreUpsertDuration.observe(time.Now(), source)
+	s := d.shardOf(lease)
+	s.mu.Lock()
+	changed, err := d.upsertLocked(s, lease, versioned)
+	commit := d.commit.Load()
+	s.mu.Unlock()
+	if !changed || err != nil {
+		return changed, err
+	}
+	return true, d.waitCommit(commit)
+}
+
+func (d *DataStore) upsertLocked(s *storeShard, lease *PortMappingLease, versioned bool) (bool, error) {
+	if versioned {
+		d.clock.observe(lease.Version)
+	}
+	existing := s.index.get(lease.Id)
+	if existing == nil {
+		if !lease.ExpiresAt().After(time.Now()) {
+			// Already expired, do not bring it back
+			return false, nil
+		}
+		lease.ExternalIP = d.ports.LeaseIP(lease.ExternalIP)
+		if other, ok := d.claimExternal(lease); !ok {
+			return false, &externalPortUsedError{protocol: lease.Protocol, ip: d.ports.CanonicalIP(lease.ExternalIP), port: lease.ExternalPort, other: other}
+		}
+		stored := *lease
+		if !versioned {
+			stored.Version = d.clock.now()
+		}
+		lease.Version = stored.Version
+		s.index.put(&stored)
+		d.queueWrite(s, &stored, false)
+		// Replicated leases are not allocated locally
+		d.ports.Reserve(lease.Protocol, lease.ExternalIP, lease.ExternalPort)
+		return true, nil
 	}
-	if len(leases) == 0 {
-		return d.store.Insert(lease.Id, lease)
+	if versioned && lease.Version <= existing.Version || !versioned && existing.LastSeen.After(lease.LastSeen) {
+		return false, nil
 	}
-	if leases[0].LastSeen.After(lease.LastSeen) {
-		return nil
+	if versioned {
+		return d.replaceLocked(s, existing, lease)
 	}
-	leases[0].LastSeen = lease.LastSeen
-	return d.store.Update(lease.Id, leases[0])
+	if lease.LastSeen.Equal(existing.LastSeen) && lease.Expires.Equal(existing.Expires) {
+		return false, nil
+	}
+	version := d.clock.now()
+	// Updated in place, so a renewal does not allocate a new entry
+	s.index.update(lease.Id, lease.LastSeen, lease.Expires, version)
+	delete(s.renewals, lease.Id)
+	d.queueWrite(s, existing, false)
+	lease.Version = version
+	return true, nil
 }
 
-func (d *DataStore) GetLeaseById(id string) (*PortMappingLease, error) {
-	l := &PortMappingLease{}
-	err := d.store.Get(id, l)
-	return nil, err
+// externalPortUsedError rejects a lease whose external port is used by another
+// lease, storing the lease again fails the same way
+type externalPortUsedError struct {
+	protocol PROTOCOL
+	ip       netip.Addr
+	port     uint16
+	other    string
 }
 
-func (d *DataStore) GetLeaseByIpAndPort(ip net.IP, port uint16, protocol PROTOCOL) (*PortMappingLease, error) {
-	leases := make([]*PortMappingLease, 0)
+func (e *externalPortUsedError) Error() string {
+	return fmt.Sprintf("external port %s %s:%d is already used by lease %s", e.protocol, e.ip, e.port, e.other)
+}
 
-	err := d.store.Find(&leases, badgerhold.
-		Where("ClientIP").Eq(ip).
-		And("ClientPort").Eq(port).
-		And("Protocol").Eq(protocol))
-	if err != nil {
-		return nil, err
+// replaceLocked replaces existing with the newer lease of a peer as a whole,
+// moving the claim of the external port when the peer has another one.
+func (d *DataStore) replaceLocked(s *storeShard, existing, lease *PortMappingLease) (bool, error) {
+	lease.ExternalIP = d.ports.LeaseIP(lease.ExternalIP)
+	moved := d.externalKey(lease) != d.externalKey(existing)
+	if moved {
+		if other, ok := d.claimExternal(lease); !ok {
+			return false, &externalPortUsedError{protocol: lease.Protocol, ip: d.ports.CanonicalIP(lease.ExternalIP), port: lease.ExternalPort, other: other}
+		}
+		d.releaseExternal(existing)
+		d.ports.Release(existing.Protocol, existing.ExternalIP, existing.ExternalPort)
+		d.ports.Reserve(lease.Protocol, lease.ExternalIP, lease.ExternalPort)
 	}
+	stored := *lease
+	s.index.put(&stored)
+	delete(s.renewals, lease.Id)
+	d.queueWrite(s, &stored, false)
+	return true, nil
+}
 
-	if len(leases) == 1 {
-		return leases[0], nil
-	} else if len(leases) == 0 {
-		return nil, nil
+// RenewLease extends the active lease of the client in memory, when only its
+// lifetime changes the rules stay as they are. The renewal is published to
+// disk and peers by StartRenewals once the lifetime they know about falls
+// below the renewal margin. It returns false when there is no active lease.
+func (d *DataStore) RenewLease(key clientKey, now time.Time, lifetime time.Duration) (PortMappingLease, bool) {
+	s := d.shard(key)
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	lease := s.index.getByClient(key)
+	if lease == nil || !lease.ExpiresAt().After(now) {
+		return PortMappingLease{}, false
 	}
+	if _, ok := s.renewals[lease.Id]; !ok {
+		// The expiry known to disk and peers is the one before the first renewal
+		margin := time.Duration(float64(lifetime) * d.persist.RenewalMargin)
+		s.renewals[lease.Id] = lease.ExpiresAt().Add(-margin)
+	}
+	s.index.update(lease.Id, now, now.Add(lifetime), lease.Version)
+	return *lease, true
+}
 
-	return nil, fmt.Errorf("multiple lease matching found")
+// StartRenewals publishes the renewals due every interval, giving them a new
+// version, and calls fn with the published leases.
+func (d *DataStore) StartRenewals(interval time.Duration, fn func(published []PortMappingLease)) {
+	ticker := time.NewTicker(interval)
+	defer ticker.Stop()
+	for {
+		select {
+		case now := <-ticker.C:
+			if published := d.publishRenewals(now, false); len(published) > 0 {
+				fn(published)
+			}
+		case <-d.closeCh:
+			return
+		}
+	}
 }
 
-func (d *DataStore) IsExternalPortInUse(port uint16) bool {
-	leases := make([]*PortMappingLease, 0)
-	err := d.store.Find(&leases, badgerhold.Where("ExternalPort").Eq(port))
-	if err != nil {
-		return true
+// publishRenewals publishes the renewals due by now, or all of them
+func (d *DataStore) publishRenewals(now time.Time, all bool) []PortMappingLease {
+	var published []PortMappingLease
+	for i := range d.shards {
+		s := &d.shards[i]
+		s.mu.Lock()
+		for id, due := range s.renewals {
+			if !all && due.After(now) {
+				continue
+			}
+			delete(s.renewals, id)
+			lease := s.index.get(id)
+			if lease == nil {
+				continue
+			}
+			s.index.update(id, lease.LastSeen, lease.Expires, d.clock.now())
+			d.queueWrite(s, lease, false)
+			published = append(published, *lease)
+		}
+		s.mu.Unlock()
+	}
+	return published
+}
+
+// Stats returns the number of leases held and of those the active ones
+func (d *DataStore) Stats() (int, int) {
+	now := time.Now()
+	held, active := 0, 0
+	for i := range d.shards {
+		s := &d.shards[i]
+		s.mu.RLock()
+		held += s.index.len()
+		active += s.index.len() - s.index.expiredCount(now)
+		s.mu.RUnlock()
+	}
+	return held, active
+}
+
+// Digest returns the digest of the leases, see leaseDigest
+func (d *DataStore) Digest() leaseDigest {
+	var digest leaseDigest
+	for i := range d.shards {
+		s := &d.shards[i]
+		s.mu.RLock()
+		for b, h := range s.index.digest {
+			digest[b] ^= h
+		}
+		s.mu.RUnlock()
+	}
+	return digest
+}
+
+// LeaseCursor is the position of an export, the shard and the Id of the last
+// lease exported from it
+type LeaseCursor struct {
+	Shard int
+	After string
+}
+
+func (c LeaseCursor) String() string {
+	return fmt.Sprintf("%d:%s", c.Shard, c.After)
+}
+
+func parseLeaseCursor(s string) (LeaseCursor, error) {
+	shard, after, ok := strings.Cut(s, ":")
+	n, err := strconv.Atoi(shard)
+	if !ok || err != nil || n < 0 || n >= storeShards {
+		return LeaseCursor{}, fmt.Errorf("invalid lease cursor %s", s)
+	}
+	return LeaseCursor{Shard: n, After: after}, nil
+}
+
+// ExportLeases calls fn with the leases after cursor matching filter, shard by
+// shard in Id order, copying one shard at a time. It stops after limit leases,
+// 0 is no limit, and returns the cursor to continue from and whether leases
+// may follow.
+func (d *DataStore) ExportLeases(cursor LeaseCursor, limit int, filter func(lease *PortMappingLease) bool, fn func(lease *PortMappingLease) error) (LeaseCursor, bool, error) {
+	exported := 0
+	for shard := cursor.Shard; shard < storeShards; shard++ {
+		after := ""
+		if shard == cursor.Shard {
+			after = cursor.After
+		}
+		s := &d.shards[shard]
+		s.mu.RLock()
+		leases := make([]PortMappingLease, 0, s.index.len())
+		for id, e := range s.index.byId {
+			if id > after && (filter == nil || filter(e.lease)) {
+				leases = append(leases, *e.lease)
+			}
+		}
+		s.mu.RUnlock()
+		sort.Slice(leases, func(i, j int) bool { return leases[i].Id < leases[j].Id })
+
+		for i := range leases {
+			if err := fn(&leases[i]); err != nil {
+				return cursor, false, err
+			}
+			if exported++; exported == limit {
+				return LeaseCursor{Shard: shard, After: leases[i].Id}, i < len(leases)-1 || shard < storeShards-1, nil
+			}
+		}
+	}
+	return LeaseCursor{Shard: storeShards}, false, nil
+}
+
+// StartExpiry removes expired leases every interval from memory and disk,
+// releasing their external ports, and calls fn with the removed leases.
+func (d *DataStore) StartExpiry(interval time.Duration, fn func(expired []*PortMappingLease)) {
+	ticker := time.NewTicker(interval)
+	defer ticker.Stop()
+	for {
+		select {
+		case now := <-ticker.C:
+			if expired := d.expire(now); len(expired) > 0 {
+				fn(expired)
+			}
+		case <-d.closeCh:
+			return
+		}
+	}
+}
+
+func (d *DataStore) expire(now time.Time) []*PortMappingLease {
+	var expired []*PortMappingLease
+	for i := range d.shards {
+		s := &d.shards[i]
+		s.mu.Lock()
+		for _, lease := range s.index.popExpired(now) {
+			delete(s.renewals, lease.Id)
+			d.queueWrite(s, lease, true)
+			d.releaseExternal(lease)
+			d.ports.Release(lease.Protocol, lease.ExternalIP, lease.ExternalPort)
+			expired = append(expired, lease)
+		}
+		s.mu.Unlock()
+	}
+	if len(expired) > 0 {
+		d.l.Sugar().Debugf("expired %d leases", len(expired))
+	}
+	return expired
+}
+
+// GetLeasesByClientIp returns the leases of a client ip for protocol
+func (d *DataStore) GetLeasesByClientIp(ip net.IP, protocol PROTOCOL) []*PortMappingLease {
+	addr := newClientKey(ip, 0, protocol).ip
+	return d.collect(func(x *leaseIndex) []*PortMappingLease {
+		var leases []*PortMappingLease
+		for _, lease := range x.all() {
+			if lease.Protocol == protocol && newClientKey(lease.ClientIP, 0, protocol).ip == addr {
+				leases = append(leases, lease)
+			}
+		}
+		return leases
+	})
+}
+
+func (d *DataStore) GetLeaseById(id string) (*PortMappingLease, error) {
+	for i := range d.shards {
+		s := &d.shards[i]
+		s.mu.RLock()
+		lease := s.index.get(id)
+		var c PortMappingLease
+		if lease != nil {
+			c = *lease
+		}
+		s.mu.RUnlock()
+		if lease != nil {
+			return &c, nil
+		}
+	}
+	return nil, badgerhold.ErrNotFound
+}
+
+// GetLeaseByClient returns a copy of the lease of the client key
+func (d *DataStore) GetLeaseByClient(key clientKey) (PortMappingLease, bool) {
+	s := d.shard(key)
+	s.mu.RLock()
+	defer s.mu.RUnlock()
+	lease := s.index.getByClient(key)
+	if lease == nil {
+		return PortMappingLease{}, false
+	}
+	return *lease, true
+}
+
+func (d *DataStore) GetLeaseByIpAndPort(ip net.IP, port uint16, protocol PROTOCOL) (*PortMappingLease, error) {
+	lease, ok := d.GetLeaseByClient(newClientKey(ip, port, protocol))
+	if !ok {
+		return nil, nil
 	}
-	return len(leases) > 0
+	return &lease, nil
+}
+
+// IsExternalPortInUse tells whether a lease has the external port on the ip,
+// see PortAllocator.CanonicalIP
+func (d *DataStore) IsExternalPortInUse(protocol PROTOCOL, ip netip.Addr, port uint16) bool {
+	d.externalMu.Lock()
+	defer d.externalMu.Unlock()
+	_, ok := d.external[externalKey{protocol: protocol, ip: ip, port: port}]
+	return ok
 }
 
 func leaseHash(protocol PROTOCOL, clientIP net.IP, internalPort uint16) string {
-	data := make([]byte, 0)
-	data = append(data, []byte(protocol.String())...)
+	addr, _ := netip.AddrFromSlice(clientIP)
+	return newLeaseId(protocol, addr.Unmap(), internalPort)
+}
+
+// newLeaseId is the md5 of protocol, ip and internal port, shared with the peers.
+// It is built in stack buffers, only the returned string is allocated.
+func newLeaseId(protocol PROTOCOL, addr netip.Addr, internalPort uint16) string {
+	var buf [64]byte
+	data := append(buf[:0], protocol.String()...)
 	data = append(data, 0)
-	data = append(data, []byte(clientIP.To16().String())...)
+	if addr.IsValid() {
+		data = addr.AppendTo(data)
+	} else {
+		// As net.IP formats a nil ip
+		data = append(data, "<nil>"...)
+	}
 	data = append(data, 0)
-	data = append(data, []byte(fmt.Sprintf("%d", internalPort))...)
-	return fmt.Sprintf("%x", md5.Sum(data))
+	data = strconv.AppendUint(data, uint64(internalPort), 10)
+	sum := md5.Sum(data)
+	var id [2 * md5.Size]byte
+	hex.Encode(id[:], sum[:])
+	return string(id[:])
 }
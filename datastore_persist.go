@@ -0,0 +1,198 @@
+package main
+
+import (
+	"fmt"
+	"github.com/dgraph-io/badger"
+	"github.com/timshannon/badgerhold"
+	"go.uber.org/zap"
+	"time"
+)
+
+// PersistOptions configure how lease changes reach the disk. Changes are
+// applied in memory first and written behind in group commits, a batch is
+// committed every Interval or once Size changes are pending. With Sync an
+// upsert returns only when the batch holding its change is committed.
+// Renewals are published once the lifetime left as known to disk and peers is
+// below RenewalMargin of the lease lifetime.
+type PersistOptions struct {
+	Interval      time.Duration
+	Size          int
+	Sync          bool
+	RenewalMargin float64
+}
+
+// pendingWrite is a lease change not yet committed, the latest per lease
+type pendingWrite struct {
+	lease   PortMappingLease
+	deleted bool
+}
+
+// pendingCommit is the batch collecting the changes until the next flush
+type pendingCommit struct {
+	done chan struct{}
+	err  error
+}
+
+func newPendingCommit() *pendingCommit {
+	return &pendingCommit{done: make(chan struct{})}
+}
+
+// queueWrite records a change of the lease for the next flush, the lock of
+// the shard is held
+func (d *DataStore) queueWrite(s *storeShard, lease *PortMappingLease, deleted bool) {
+	if _, ok := s.pending[lease.Id]; !ok && d.pendingLen.Add(1) >= int64(d.persist.Size) {
+		d.signalFlush()
+	}
+	s.pending[lease.Id] = pendingWrite{lease: *lease, deleted: deleted}
+}
+
+func (d *DataStore) signalFlush() {
+	select {
+	case d.flushCh <- struct{}{}:
+	default:
+	}
+}
+
+// waitCommit waits for the commit when writes are synchronous
+func (d *DataStore) waitCommit(commit *pendingCommit) error {
+	if !d.persist.Sync {
+		return nil
+	}
+	// Changes of the other writers until the flusher runs are committed along
+	d.signalFlush()
+	select {
+	case <-commit.done:
+		return commit.err
+	case <-d.flushed:
+		// Closed, the final flush may have taken the change along
+		select {
+		case <-commit.done:
+			return commit.err
+		default:
+			return fmt.Errorf("store is closed")
+		}
+	}
+}
+
+func (d *DataStore) runFlusher() {
+	defer close(d.flushed)
+	defer d.journal.close()
+	if d.loaded != nil {
+		// Loaded from the store, or from a snapshot with a journal to replay
+		if err := d.journal.writeSnapshot(d.seq, d.loaded); err != nil {
+			d.l.With(zap.Error(err)).Warn("failed to write lease snapshot")
+		}
+		d.loaded = nil
+	}
+	ticker := time.NewTicker(d.persist.Interval)
+	defer ticker.Stop()
+	for {
+		select {
+		case <-ticker.C:
+		case <-d.flushCh:
+		case <-d.closeCh:
+			// Renewals not published yet are stored, peers get them by sync
+			d.publishRenewals(time.Now(), true)
+			if err := d.flush(true); err != nil {
+				d.l.With(zap.Error(err)).Error("failed to write pending lease changes on close")
+			}
+			return
+		}
+		if err := d.flush(d.journal.snapshotDue()); err != nil {
+			d.l.With(zap.Error(err)).Warn("failed to write lease changes, retrying with the next flush")
+		}
+	}
+}
+
+// flush commits the pending changes in transactions of up to Size changes.
+// Changes of a failed transaction are pending again, unless changed since.
+// With snapshot the state the changes lead to is written as a snapshot.
+func (d *DataStore) flush(snapshot bool) error {
+	if d.pendingLen.Load() == 0 && !snapshot {
+		return nil
+	}
+	// Writers take the commit after queueing their change under the shard
+	// lock, so every change of the old commit is in the shards taken below
+	commit := d.commit.Swap(newPendingCommit())
+	var pending []pendingWrite
+	var state []PortMappingLease
+	for i := range d.shards {
+		s := &d.shards[i]
+		s.mu.Lock()
+		for _, w := range s.pending {
+			pending = append(pending, w)
+		}
+		if len(s.pending) > 0 {
+			s.pending = make(map[string]pendingWrite, len(s.pending))
+		}
+		if snapshot {
+			for _, lease := range s.index.all() {
+				state = append(state, *lease)
+			}
+		}
+		s.mu.Unlock()
+	}
+	d.pendingLen.Add(-int64(len(pending)))
+
+	batch := make([]pendingWrite, 0, d.persist.Size)
+	var failed []pendingWrite
+	var err error
+	write := func() {
+		seq := d.seq + 1
+		txErr := d.store.Badger().Update(func(tx *badger.Txn) error {
+			if err := d.store.TxUpsert(tx, storeMetaKey, &storeMeta{Seq: seq}); err != nil {
+				return err
+			}
+			for i := range batch {
+				w := &batch[i]
+				var err error
+				if w.deleted {
+					err = d.store.TxDelete(tx, w.lease.Id, &PortMappingLease{})
+				} else {
+					err = d.store.TxUpsert(tx, w.lease.Id, &w.lease)
+				}
+				if err != nil && err != badgerhold.ErrNotFound {
+					return err
+				}
+			}
+			return nil
+		})
+		if txErr != nil {
+			err = txErr
+			failed = append(failed, batch...)
+		} else {
+			d.seq = seq
+			if err := d.journal.append(seq, batch); err != nil {
+				// The journal no longer reaches the store, the next start loads from it
+				d.l.With(zap.Error(err)).Warn("failed to append to the lease journal")
+			}
+		}
+		batch = batch[:0]
+	}
+	for _, w := range pending {
+		if batch = append(batch, w); len(batch) == d.persist.Size {
+			write()
+		}
+	}
+	if len(batch) > 0 {
+		write()
+	}
+
+	for _, w := range failed {
+		s := d.shardOf(&w.lease)
+		s.mu.Lock()
+		if _, ok := s.pending[w.lease.Id]; !ok {
+			s.pending[w.lease.Id] = w
+			d.pendingLen.Add(1)
+		}
+		s.mu.Unlock()
+	}
+	commit.err = err
+	close(commit.done)
+	if snapshot && err == nil {
+		if err := d.journal.writeSnapshot(d.seq, state); err != nil {
+			d.l.With(zap.Error(err)).Warn("failed to write lease snapshot")
+		}
+	}
+	return err
+}
@@ -0,0 +1,119 @@
+package main
+
+import (
+	"go.uber.org/zap"
+	"sync"
+	"testing"
+	"time"
+)
+
+// newTestStore returns a store in a temporary directory with the ports
+// 10000-60000 on the detected external ip
+func newTestStore(tb testing.TB) *DataStore {
+	ports, err := NewPortAllocator("10000-60000", nil, 0)
+	if err != nil {
+		tb.Fatal(err)
+	}
+	store, err := NewDataStore(zap.NewNop(), tb.TempDir(), ports, PersistOptions{Interval: time.Millisecond, Size: 4096})
+	if err != nil {
+		tb.Fatal(err)
+	}
+	tb.Cleanup(func() { store.Close() })
+	return store
+}
+
+// storeLeases creates the leases concurrently, so they share the commits
+func storeLeases(tb testing.TB, store *DataStore, leases []*PortMappingLease) {
+	var wg sync.WaitGroup
+	errs := make(chan error, len(leases))
+	for w := 0; w < 64; w++ {
+		wg.Add(1)
+		go func(w int) {
+			defer wg.Done()
+			for j := w; j < len(leases); j += 64 {
+				lease := *leases[j]
+				if _, err := store.CreateLease(&lease); err != nil {
+					errs <- err
+				}
+			}
+		}(w)
+	}
+	wg.Wait()
+	close(errs)
+	for err := range errs {
+		tb.Fatal(err)
+	}
+}
+
+func testClientKeys(leases []*PortMappingLease) []clientKey {
+	keys := make([]clientKey, len(leases))
+	for j, lease := range leases {
+		keys[j] = newClientKey(lease.ClientIP, lease.ClientPort, lease.Protocol)
+	}
+	return keys
+}
+
+func BenchmarkRenewLease(b *testing.B) {
+	store := newTestStore(b)
+	leases := testLeases(1000)
+	storeLeases(b, store, leases)
+	keys := testClientKeys(leases)
+	now := time.Now()
+	b.ReportAllocs()
+	b.ResetTimer()
+	for n := 0; n < b.N; n++ {
+		if _, ok := store.RenewLease(keys[n%len(keys)], now, time.Hour); !ok {
+			b.Fatal("lease not renewed")
+		}
+	}
+}
+
+func BenchmarkGetLeaseByClient(b *testing.B) {
+	store := newTestStore(b)
+	leases := testLeases(1000)
+	storeLeases(b, store, leases)
+	keys := testClientKeys(leases)
+	b.ReportAllocs()
+	b.ResetTimer()
+	for n := 0; n < b.N; n++ {
+		if _, ok := store.GetLeaseByClient(keys[n%len(keys)]); !ok {
+			b.Fatal("lease not found")
+		}
+	}
+}
+
+func BenchmarkGetActiveLeases(b *testing.B) {
+	store := newTestStore(b)
+	storeLeases(b, store, testLeases(10000))
+	b.ReportAllocs()
+	b.ResetTimer()
+	for n := 0; n < b.N; n++ {
+		store.GetActiveLeases()
+	}
+}
+
+func BenchmarkDigest(b *testing.B) {
+	store := newTestStore(b)
+	storeLeases(b, store, testLeases(10000))
+	b.ReportAllocs()
+	b.ResetTimer()
+	for n := 0; n < b.N; n++ {
+		store.Digest()
+	}
+}
+
+// TestMergeLeaseExternalPortUsed rejects a lease of a peer on the external port
+// of another lease, as a conflict the peer does not retry
+func TestMergeLeaseExternalPortUsed(t *testing.T) {
+	store := newTestStore(t)
+	leases := testLeases(2)
+	storeLeases(t, store, leases[:1])
+	conflicting := *leases[1]
+	conflicting.ExternalPort = leases[0].ExternalPort
+	conflicting.Version = 1
+	if _, err := store.MergeLease(&conflicting); err == nil {
+		t.Fatal("lease on a used external port was merged")
+	} else if _, ok := err.(*externalPortUsedError); !ok {
+		t.Errorf("MergeLease() = %v, want an externalPortUsedError", err)
+	}
+}
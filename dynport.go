@@ -3,36 +3,71 @@ package main
 import (
 	"fmt"
 	"go.uber.org/zap"
-	"math/rand"
 	"net"
 	"net/netip"
-	"strconv"
+	"runtime"
 	"strings"
 	"sync"
+	"sync/atomic"
 	"time"
 )
 
+// ReceiveOptions configures how requests are read and handled
+type ReceiveOptions struct {
+	// Sockets per listen address, sharing it with SO_REUSEPORT
+	Sockets int
+	// Workers handling requests, 0 is one per cpu
+	Workers int
+	// Read batches queued for the workers
+	QueueSize int
+	// Packets read at most per syscall
+	BatchSize int
+}
+
 type DynPortServer struct {
-	conns        []net.PacketConn
-	externalIP   net.IP
-	ipt          *IPTablesManager
-	l            *zap.SugaredLogger
-	listenAddrs  []string
-	started      time.Time
-	store        *DataStore
-	acl          []ACLConfiguration
-	allowDefault bool
-	listeners    []func(lease PortMappingLease)
+	conns   []net.PacketConn
+	receive ReceiveOptions
+	ipt     MappingEngine
+	l       *zap.SugaredLogger
+	// zl logs on the request path, entries are checked before building fields
+	zl            *zap.Logger
+	listenAddrs   []string
+	epoch         atomic.Int64 // unix time the epoch started
+	store         *DataStore
+	ports         *PortAllocator
+	honorPort     bool
+	acl           atomic.Pointer[compiledACL]
+	allowDefault  atomic.Bool
+	waitApplied   time.Duration
+	maxLifetime   time.Duration
+	listeners     []func(lease PortMappingLease, trace spanContext)
+	requests      requestCache
+	limiter       *rateLimiter
+	rejectLimited bool
+	// externalResponse is the response to external address requests, but for the epoch
+	externalResponse atomic.Pointer[[12]byte]
+	// externalResponses are the responses per external ip with more than one
+	externalResponses map[netip.Addr]*[12]byte
+	// mu guards conns and announceStop, announcements run while the sockets
+	// are opened and closed
+	mu           sync.Mutex
+	announceStop chan struct{}
 }
 
 func NewDynPortServer(
 	l *zap.Logger,
-	ipt *IPTablesManager,
+	ipt MappingEngine,
 	store *DataStore,
+	ports *PortAllocator,
+	honorSuggestedPort bool,
 	listenAddrs []string,
-	externalIP net.IP,
+	externalIPs []net.IP,
 	acl []ACLConfiguration,
 	allowDefault bool,
+	waitApplied time.Duration,
+	maxLifetime time.Duration,
+	receive ReceiveOptions,
+	limit RateLimitOptions,
 ) (*DynPortServer, error) {
 	for _, a := range listenAddrs {
 		addrPort, err := netip.ParseAddrPort(a)
@@ -45,98 +80,237 @@ func NewDynPortServer(
 	}
 
 	p := &DynPortServer{
-		l:            l.Sugar(),
-		ipt:          ipt,
-		store:        store,
-		listenAddrs:  listenAddrs,
-		externalIP:   externalIP,
-		acl:          acl,
-		allowDefault: allowDefault,
+		l:             l.Sugar(),
+		zl:            l,
+		ipt:           ipt,
+		store:         store,
+		ports:         ports,
+		honorPort:     honorSuggestedPort,
+		listenAddrs:   listenAddrs,
+		waitApplied:   waitApplied,
+		maxLifetime:   maxLifetime,
+		receive:       receive,
+		limiter:       newRateLimiter(limit),
+		rejectLimited: limit.Reject,
+	}
+	p.setExternalResponse(externalIPs[0])
+	if len(externalIPs) > 1 {
+		p.externalResponses = make(map[netip.Addr]*[12]byte, len(externalIPs))
+		for _, ip := range externalIPs {
+			addr, _ := netip.AddrFromSlice(ip.To4())
+			p.externalResponses[addr] = newExternalResponse(ip)
+		}
+	}
+	if p.receive.Sockets < 1 {
+		p.receive.Sockets = 1
+	}
+	if p.receive.Workers < 1 {
+		p.receive.Workers = runtime.NumCPU()
+	}
+	if err := p.SetACL(acl, allowDefault); err != nil {
+		return nil, err
 	}
 	return p, nil
 }
 
+// SetACL compiles acl and swaps it in for the following requests
+func (p *DynPortServer) SetACL(acl []ACLConfiguration, allowDefault bool) error {
+	compiled, err := compileACL(acl)
+	if err != nil {
+		return fmt.Errorf("invalid acl: %v", err)
+	}
+	p.acl.Store(compiled)
+	p.allowDefault.Store(allowDefault)
+	return nil
+}
+
 func (p *DynPortServer) Start() error {
-	p.started = time.Now()
+	p.epoch.Store(time.Now().Unix())
+	var conns []net.PacketConn
 	for _, addr := range p.listenAddrs {
-		conn, err := net.ListenPacket("udp4", addr)
-		if err != nil {
-			return fmt.Errorf("failed to listen for udp4 on `%s`: %v", addr, err)
+		for s := 0; s < p.receive.Sockets; s++ {
+			conn, err := listenPacket(addr, p.receive.Sockets > 1)
+			if err != nil {
+				return fmt.Errorf("failed to listen for udp4 on `%s`: %v", addr, err)
+			}
+			conns = append(conns, conn)
+			// Stop closes the sockets opened before a failure
+			p.mu.Lock()
+			p.conns = append(p.conns, conn)
+			p.mu.Unlock()
 		}
-		p.conns = append(p.conns, conn)
 	}
 
-	var wg sync.WaitGroup
+	go p.store.StartRenewals(time.Second, p.publishRenewals)
+	// Clients re-map at once after a restart or failover
+	p.announce()
+
+	// Readers only read, so a slow request does not stall the sockets
+	work := make(chan *requestBatch, p.receive.QueueSize)
+	var workers sync.WaitGroup
+	for w := 0; w < p.receive.Workers; w++ {
+		workers.Add(1)
+		go func() {
+			defer workers.Done()
+			responses := &responseBatch{}
+			for batch := range work {
+				p.handleBatch(batch, responses)
+			}
+		}()
+	}
 
-	for _, conn := range p.conns {
-		wg.Add(1)
+	var readers sync.WaitGroup
+	for _, conn := range conns {
+		readers.Add(1)
 		go func(conn net.PacketConn) {
+			defer readers.Done()
+			reader := newBatchReader(conn, p.receive.BatchSize)
 			for {
-				buf := make([]byte, 1500)
-				p.l.Debugf("read from %s", conn.LocalAddr())
-				n, addr, err := conn.ReadFrom(buf)
-				if n > 0 {
-					p.l.Debugf("received %d bytes from %s", n, addr)
-
-					err = p.handleRequest(conn, addr, buf[0:n])
-					if err != nil {
-						p.l.With(zap.Error(err)).Errorf("failed to handle request from %s", addr)
-						continue
-					}
-
-					continue
-				} else if err != nil {
+				batch, err := reader.read()
+				if err != nil {
 					if strings.Contains(err.Error(), "use of closed network connection") {
 						p.l.With(zap.Error(err)).Debugf("failed to read")
 					} else {
 						p.l.With(zap.Error(err)).Errorf("failed to read")
 					}
-					wg.Done()
 					return
 				}
+				if len(batch.packets) > 0 {
+					work <- batch
+				}
 			}
 		}(conn)
 	}
 
-	wg.Wait()
+	readers.Wait()
+	close(work)
+	workers.Wait()
 	return nil
 }
 
-func (p *DynPortServer) handleRequest(conn net.PacketConn, addr net.Addr, buf []byte) error {
+func (p *DynPortServer) handleBatch(batch *requestBatch, responses *responseBatch) {
+	responses.conn = batch.conn
+	for _, pkt := range batch.packets {
+		if ce := p.zl.Check(zap.DebugLevel, "received request"); ce != nil {
+			ce.Write(zap.Int("request.bytes", pkt.n), zap.Stringer("client.address", pkt.addr))
+		}
+		start := time.Now()
+		buf := (*pkt.buf)[:pkt.n]
+		if p.limiter != nil && !p.limiter.allow(pkt.addr, start) {
+			p.limited(responses, pkt.addr, buf)
+			continue
+		}
+		if err := p.handleRequest(responses, pkt.addr, buf); err != nil {
+			if ce := p.zl.Check(zap.ErrorLevel, "failed to handle request"); ce != nil {
+				ce.Write(zap.Error(err), zap.Stringer("client.address", pkt.addr))
+			}
+		}
+		if len(buf) >= 2 {
+			metricRequestDuration.observe(start, opcodeLabels[buf[1]])
+		}
+	}
+	batch.release()
+	if err := responses.flush(); err != nil {
+		p.l.With(zap.Error(err)).Errorf("failed to send responses")
+	}
+}
+
+// limited drops a request of a client over its rate limit, or answers it with
+// result code 3
+func (p *DynPortServer) limited(conn packetWriter, addr net.Addr, buf []byte) {
+	if !p.rejectLimited {
+		metricRateLimited.with("dropped").Add(1)
+		return
+	}
+	metricRateLimited.with("rejected").Add(1)
+	op := requestOpcode(buf)
+	if len(buf) >= 12 && buf[0] == 0 && (op == 1 || op == 2) {
+		internalPort, _ := readNetworkOrderUint16(buf[4:6])
+		p.responseMapping(conn, op, addr, mappingResult{code: 3, internalPort: internalPort})
+		return
+	}
+	p.responseWithErrorResultCode(conn, addr, op, 3)
+}
+
+func (p *DynPortServer) handleRequest(conn packetWriter, addr net.Addr, buf []byte) error {
 	if len(buf) >= 1 && buf[0] == 0 {
 		// Version 0
 		err := p.handleNATPMPRequest(conn, addr, buf)
 		return err
 	}
 	// Respond with Unsupported Version
-	p.responseWithErrorResultCode(conn, addr, 1)
+	p.responseWithErrorResultCode(conn, addr, requestOpcode(buf), 1)
 	return fmt.Errorf("unsupported version")
 }
 
-func (p *DynPortServer) handleNATPMPRequest(conn net.PacketConn, addr net.Addr, buf []byte) error {
+func (p *DynPortServer) handleNATPMPRequest(conn packetWriter, addr net.Addr, buf []byte) error {
 	if len(buf) >= 2 {
 		switch buf[1] {
 		case 0:
 			return p.handleNATPMPExternalAddressRequest(conn, addr)
-		case 1: // UDP mapping request
-			return p.handleNATPMPMappingRequest(conn, 1, addr, buf[4:])
-		case 2: // TCP mapping request
-			return p.handleNATPMPMappingRequest(conn, 2, addr, buf[4:])
+		case 1, 2: // UDP and TCP mapping request
+			if len(buf) < 12 {
+				return fmt.Errorf("mapping request too short, %d bytes", len(buf))
+			}
+			return p.handleMapping(conn, addr, buf[:12])
 		default:
 			// Respond with Unsupported opcode
-			p.responseWithErrorResultCode(conn, addr, 5)
+			p.responseWithErrorResultCode(conn, addr, buf[1], 5)
 			return fmt.Errorf("operation not implemented")
 		}
 
 	}
 	// Respond with Unsupported opcode
-	p.responseWithErrorResultCode(conn, addr, 5)
+	p.responseWithErrorResultCode(conn, addr, requestOpcode(buf), 5)
 	return nil
 }
 
-func (p *DynPortServer) responseWithErrorResultCode(conn net.PacketConn, addr net.Addr, code uint16) {
-	res := make([]byte, 8)
-	sec := time.Now().Unix() - p.started.Unix()
+// handleMapping answers retransmits of a request still being handled or just
+// answered from the request cache, and handles new requests.
+func (p *DynPortServer) handleMapping(conn packetWriter, addr net.Addr, req []byte) error {
+	op := req[1]
+	key, cacheable := newRequestKey(addr, req)
+	if cacheable {
+		result, state := p.requests.begin(&key, time.Now())
+		switch state {
+		case requestInFlight:
+			// The response to the pending request goes to the same address
+			metricDuplicateRequests.with("in_flight").Add(1)
+			return nil
+		case requestAnswered:
+			metricDuplicateRequests.with("answered").Add(1)
+			return p.responseMapping(conn, op, addr, result)
+		}
+	}
+
+	sp := tracer.start("natpmp.mapping")
+	result, err := p.handleNATPMPMappingRequest(sp, op, addr, req[4:])
+	if sp != nil {
+		sp.set(zap.Stringer("client.address", addr), zap.Uint16("mapping.internal_port", result.internalPort), zap.Uint16("mapping.external_port", result.externalPort), zap.Uint16("natpmp.result_code", result.code))
+		sp.end()
+	}
+	if cacheable {
+		p.requests.finish(&key, result, err == nil)
+	}
+	if err != nil {
+		return err
+	}
+	return p.responseMapping(conn, op, addr, result)
+}
+
+// requestOpcode returns the opcode of a request, 0 when it is too short to have one
+func requestOpcode(buf []byte) byte {
+	if len(buf) >= 2 {
+		return buf[1]
+	}
+	return 0
+}
+
+func (p *DynPortServer) responseWithErrorResultCode(conn packetWriter, addr net.Addr, op byte, code uint16) {
+	metricRequests.with(opcodeLabels[op], resultLabels[byte(code)]).Add(1)
+	res := responseBuffer(conn, 8)
+	res[1] = 128 + op // Response op code
+	sec := time.Now().Unix() - p.epoch.Load()
 	writeNetworkOrderUint16(res[2:4], code)
 	writeNetworkOrderUint32(res[4:8], uint32(sec)) // Seconds Since Start of Epoch
 	if conn != nil {
@@ -144,24 +318,45 @@ func (p *DynPortServer) responseWithErrorResultCode(conn net.PacketConn, addr ne
 	}
 }
 
-func (p *DynPortServer) handleNATPMPExternalAddressRequest(conn net.PacketConn, addr net.Addr) error {
-	res := make([]byte, 12)
-	res[1] = 128 + 0 // Response op code
-	// 2 byte result code
-	sec := time.Now().Unix() - p.started.Unix()
+func (p *DynPortServer) handleNATPMPExternalAddressRequest(conn packetWriter, addr net.Addr) error {
+	metricRequests.with(opcodeLabels[0], resultLabels[0]).Add(1)
+	res := responseBuffer(conn, 12)
+	external := p.externalResponse.Load()
+	if udpAddr, ok := addr.(*net.UDPAddr); ok && p.externalResponses != nil {
+		// The address of the ip the mappings of the client are on
+		client := udpAddr.AddrPort().Addr().Unmap()
+		if r, ok := p.externalResponses[p.clientExternalIP(client)]; ok {
+			external = r
+		}
+	}
+	copy(res, external[:])
+	sec := time.Now().Unix() - p.epoch.Load()
 	writeNetworkOrderUint32(res[4:8], uint32(sec)) // Seconds Since Start of Epoch
-	writeNetworkOrderIP(res[8:12], p.externalIP.To4())
 	if conn != nil {
 		_, err := conn.WriteTo(res, addr)
 		return err
 	}
 	return nil
 }
-func (p *DynPortServer) handleNATPMPMappingRequest(conn net.PacketConn, op byte, addr net.Addr, buf []byte) error {
+
+// clientExternalIP returns the external ip of the leases of the client, for a
+// client without leases the one its leases are placed on
+func (p *DynPortServer) clientExternalIP(client netip.Addr) netip.Addr {
+	if ip := p.store.ClientExternalIP(client); ip.IsValid() {
+		return ip
+	}
+	return p.ports.PreferredIP(client)
+}
+
+// handleNATPMPMappingRequest handles the mapping request in buf, the part after
+// the opcode, and returns the response to send. The steps are spans of sp.
+func (p *DynPortServer) handleNATPMPMappingRequest(sp *span, op byte, addr net.Addr, buf []byte) (mappingResult, error) {
 	internalPort, buf := readNetworkOrderUint16(buf)
 	externalPort, buf := readNetworkOrderUint16(buf)
 	lifetime, buf := readNetworkOrderUint32(buf)
-	p.l.Infof("received mapping request for internalPort %d, externalPort %d with lifetime %d", internalPort, externalPort, lifetime)
+	if ce := p.zl.Check(zap.DebugLevel, "received mapping request"); ce != nil {
+		ce.Write(zap.Uint16("mapping.internal_port", internalPort), zap.Uint16("mapping.external_port", externalPort), zap.Uint32("mapping.lifetime", lifetime))
+	}
 
 	var clientIP net.IP
 	switch addr := addr.(type) {
@@ -179,84 +374,196 @@ func (p *DynPortServer) handleNATPMPMappingRequest(conn net.PacketConn, op byte,
 		protocol = TCP
 	}
 
-	// Check ACL
-	allowed := p.allowDefault
-	if p.acl != nil {
-		p.l.Debugf("Checking ACL for request from %s for %d", clientIP.String(), internalPort)
-		for _, a := range p.acl {
-			_, ipNet, err := net.ParseCIDR(a.CIDR)
-			if err != nil {
-				p.l.With(zap.Error(err)).Warnf("failed to parse cidr %s", a.CIDR)
-				continue
-			}
-			if ipNet.Contains(clientIP) && isPortInRange(internalPort, a.InternalPorts) {
-				allowed = !a.Deny
-				if allowed {
-					break
-				}
-			}
-		}
+	if lifetime == 0 {
+		// Delete request, an internal port of 0 deletes all mappings of the client
+		st := sp.child("store.delete")
+		p.deleteMappings(clientIP, internalPort, protocol)
+		// Answers of the requests that created the mappings are stale now
+		p.requests.evict(newClientKey(clientIP, 0, protocol).ip, op, internalPort)
+		st.end()
+		return mappingResult{internalPort: internalPort}, nil
+	}
+	if max := uint32(p.maxLifetime / time.Second); max > 0 && lifetime > max {
+		lifetime = max
 	}
 
-	resultCode := 0
-	if allowed {
+	// Check ACL
+	key := newClientKey(clientIP, internalPort, protocol)
+	allowed := p.acl.Load().allowed(key.ip, internalPort, p.allowDefault.Load())
 
-		lease, err := p.store.GetLeaseByIpAndPort(clientIP, internalPort, protocol)
-		if err != nil {
-			return fmt.Errorf("error getting existing lease %v", err)
-		}
-		if lease == nil {
-			start := uint16(10000)
-			end := uint16(10999)
-			externalPort = randomPort(start, end)
-			for i := 0; i < 10; i++ {
-				if !p.store.IsExternalPortInUse(externalPort) {
-					break
-				}
-				if i == 9 {
-					return fmt.Errorf("no port is free")
-				}
-				externalPort = randomPort(start, end)
+	var resultCode uint16
+	if allowed {
+		st := sp.child("store.renew")
+		lease, ok := p.store.RenewLease(key, time.Now(), time.Duration(lifetime)*time.Second)
+		st.end()
+		if ok {
+			metricRenewals.with("renewed").Add(1)
+			if ce := p.zl.Check(zap.DebugLevel, "renewed mapping"); ce != nil {
+				ce.Write(zap.Stringer("client.ip", clientIP), zap.Uint16("mapping.internal_port", internalPort), zap.Uint16("mapping.external_port", lease.ExternalPort), zap.Uint32("mapping.lifetime", lifetime))
 			}
+			return mappingResult{internalPort: internalPort, externalPort: lease.ExternalPort, lifetime: lifetime}, nil
+		}
 
-			lease = &PortMappingLease{
-				Id:           leaseHash(protocol, clientIP, internalPort),
-				Created:      time.Now(),
-				LastSeen:     time.Now(),
-				ClientIP:     clientIP,
-				ClientPort:   internalPort,
-				Protocol:     protocol,
-				ExternalPort: externalPort,
+		st = sp.child("store.get")
+		lease, found := p.store.GetLeaseByClient(key)
+		st.end()
+		var err error
+		if found {
+			lease.LastSeen = time.Now()
+			lease.Expires = lease.LastSeen.Add(time.Duration(lifetime) * time.Second)
+			st = sp.child("store.upsert")
+			_, err = p.store.UpsertLease(&lease)
+			st.end()
+		} else {
+			var ok bool
+			if lease, ok, err = p.createLease(sp, key, clientIP, externalPort, lifetime); err == nil && !ok {
+				// Respond with Out of resources
+				return mappingResult{code: 4, internalPort: internalPort}, nil
 			}
 		}
-		lease.LastSeen = time.Now()
-		err = p.store.UpsertLease(lease)
 		if err != nil {
-			return fmt.Errorf("failed to upsert new lease %v", err)
+			return mappingResult{}, fmt.Errorf("failed to upsert new lease %v", err)
 		}
 		externalPort = lease.ExternalPort
 
 		for _, listener := range p.listeners {
-			go listener(*lease)
+			listener(lease, sp.context())
 		}
 
-		p.ipt.Reconcile()
+		if p.waitApplied > 0 {
+			// Only respond when the rules are in place, or when giving up waiting
+			st = sp.child("reconcile.wait")
+			select {
+			case err := <-p.ipt.ReconcileAndWait():
+				// The lease stays, the following reconciles apply it
+				if err != nil {
+					if ce := p.zl.Check(zap.WarnLevel, "failed to apply mapping"); ce != nil {
+						ce.Write(zap.Error(err), zap.Stringer("client.ip", clientIP), zap.Uint16("mapping.internal_port", internalPort))
+					}
+				}
+			case <-time.After(p.waitApplied):
+				if ce := p.zl.Check(zap.WarnLevel, "timed out waiting for mapping to be applied"); ce != nil {
+					ce.Write(zap.Stringer("client.ip", clientIP), zap.Uint16("mapping.internal_port", internalPort))
+				}
+			}
+			st.end()
+		} else {
+			p.ipt.Reconcile()
+		}
 
-		p.l.Debugf("created mapping request for %s internalPort %d, externalPort %d with lifetime %d", clientIP.String(), internalPort, externalPort, lifetime)
+		if ce := p.zl.Check(zap.DebugLevel, "created mapping"); ce != nil {
+			ce.Write(zap.Stringer("client.ip", clientIP), zap.Uint16("mapping.internal_port", internalPort), zap.Uint16("mapping.external_port", externalPort), zap.Uint32("mapping.lifetime", lifetime))
+		}
 	} else {
-		p.l.Warnf("port-mapping is not allowed from %s for %d", clientIP.String(), internalPort)
+		if ce := p.zl.Check(zap.WarnLevel, "port-mapping is not allowed"); ce != nil {
+			ce.Write(zap.Stringer("client.ip", clientIP), zap.Uint16("mapping.internal_port", internalPort))
+		}
 		resultCode = 2
 	}
 
-	res := make([]byte, 16)
+	return mappingResult{code: resultCode, internalPort: internalPort, externalPort: externalPort, lifetime: lifetime}, nil
+}
+
+// createLeaseAttempts is how often a new lease is allocated another port when
+// a lease of a peer takes the allocated one first
+const createLeaseAttempts = 3
+
+// createLease allocates an external port for the client key and stores its
+// new lease. It returns false when no port is free.
+func (p *DynPortServer) createLease(sp *span, key clientKey, clientIP net.IP, suggested uint16, lifetime uint32) (PortMappingLease, bool, error) {
+	for attempt := 1; ; attempt++ {
+		st := sp.child("ports.allocate")
+		externalIP, externalPort, err := p.ports.Allocate(key.protocol, p.clientExternalIP(key.ip).AsSlice(), suggested, p.honorPort)
+		st.end()
+		if err != nil {
+			if ce := p.zl.Check(zap.WarnLevel, "failed to allocate external port"); ce != nil {
+				ce.Write(zap.Error(err), zap.Stringer("client.ip", clientIP), zap.Uint16("mapping.internal_port", key.port))
+			}
+			return PortMappingLease{}, false, nil
+		}
+
+		now := time.Now()
+		lease := PortMappingLease{
+			Id:           newLeaseId(key.protocol, key.ip, key.port),
+			Created:      now,
+			LastSeen:     now,
+			Expires:      now.Add(time.Duration(lifetime) * time.Second),
+			ClientIP:     append(net.IP(nil), clientIP...),
+			ClientPort:   key.port,
+			Protocol:     key.protocol,
+			ExternalPort: externalPort,
+			ExternalIP:   externalIP,
+		}
+		// A concurrent request of the client may have created the lease
+		st = sp.child("store.create")
+		created, err := p.store.CreateLease(&lease)
+		st.end()
+		if _, used := err.(*externalPortUsedError); used {
+			// The port stays reserved for the lease holding it
+			if ce := p.zl.Check(zap.WarnLevel, "allocated external port is used by another lease"); ce != nil {
+				ce.Write(zap.Error(err), zap.Stringer("client.ip", clientIP), zap.Int("attempt", attempt))
+			}
+			if attempt < createLeaseAttempts {
+				continue
+			}
+			return PortMappingLease{}, false, nil
+		}
+		if err == nil && !created {
+			// The lease of the concurrent request keeps its port
+			p.ports.Release(key.protocol, externalIP, externalPort)
+		}
+		return lease, true, err
+	}
+}
+
+// deleteMappings expires the leases right away, they are removed by the expiry of the store
+func (p *DynPortServer) deleteMappings(clientIP net.IP, internalPort uint16, protocol PROTOCOL) {
+	var leases []*PortMappingLease
+	if internalPort == 0 {
+		leases = p.store.GetLeasesByClientIp(clientIP, protocol)
+	} else if lease, _ := p.store.GetLeaseByIpAndPort(clientIP, internalPort, protocol); lease != nil {
+		leases = append(leases, lease)
+	}
+	if len(leases) == 0 {
+		return
+	}
+
+	now := time.Now()
+	for _, lease := range leases {
+		if ce := p.zl.Check(zap.InfoLevel, "deleting mapping"); ce != nil {
+			ce.Write(zap.Stringer("client.ip", clientIP), zap.Uint16("mapping.internal_port", lease.ClientPort), zap.Uint16("mapping.external_port", lease.ExternalPort))
+		}
+		lease.LastSeen = now
+		lease.Expires = now
+		if _, err := p.store.UpsertLease(lease); err != nil {
+			p.l.With(zap.Error(err)).Errorf("failed to expire lease %s", lease.Id)
+			continue
+		}
+		for _, listener := range p.listeners {
+			listener(*lease, spanContext{})
+		}
+	}
+	p.ipt.Reconcile()
+}
+
+// mappingResult is the content of a mapping response
+type mappingResult struct {
+	code         uint16
+	internalPort uint16
+	externalPort uint16
+	lifetime     uint32
+}
+
+func (p *DynPortServer) responseMapping(conn packetWriter, op byte, addr net.Addr, r mappingResult) error {
+	metricRequests.with(opcodeLabels[op], resultLabels[byte(r.code)]).Add(1)
+	res := responseBuffer(conn, 16)
 	res[1] = 128 + op // Response op code
-	// 2 byte result code
-	res[3] = byte(resultCode)
-	sec := time.Now().Unix() - p.started.Unix()
+	writeNetworkOrderUint16(res[2:4], r.code)
+	sec := time.Now().Unix() - p.epoch.Load()
 	writeNetworkOrderUint32(res[4:8], uint32(sec)) // Seconds Since Start of Epoch
-	writeNetworkOrderUint16(res[8:10], internalPort)
-	writeNetworkOrderUint16(res[10:12], externalPort)
-	writeNetworkOrderUint32(res[12:16], lifetime)
+	writeNetworkOrderUint16(res[8:10], r.internalPort)
+	writeNetworkOrderUint16(res[10:12], r.externalPort)
+	writeNetworkOrderUint32(res[12:16], r.lifetime)
 	if conn != nil {
 		_, err := conn.WriteTo(res, addr)
 		return err
@@ -266,32 +573,35 @@ func (p *DynPortServer) handleNATPMPMappingRequest(conn net.PacketConn, op byte,
 
 func (p *DynPortServer) Stop() {
 	p.l.Debugf("stopping dynport server")
-	if p.conns != nil {
-		for _, conn := range p.conns {
-			err := conn.Close()
-			if err != nil {
-				p.l.With(zap.Error(err)).Errorf("error closing conn %s", conn.LocalAddr())
-			}
+	p.mu.Lock()
+	conns := p.conns
+	p.conns = nil
+	p.mu.Unlock()
+	p.stopAnnouncements()
+	for _, conn := range conns {
+		err := conn.Close()
+		if err != nil {
+			p.l.With(zap.Error(err)).Errorf("error closing conn %s", conn.LocalAddr())
 		}
-		p.conns = nil
 	}
 }
 
-func (p *DynPortServer) RegisterListener(fn func(lease PortMappingLease)) {
-	p.listeners = append(p.listeners, fn)
+// publishRenewals passes the published renewals to the listeners, the rules
+// are unchanged so no reconcile is needed.
+func (p *DynPortServer) publishRenewals(published []PortMappingLease) {
+	metricRenewals.with("published").Add(uint64(len(published)))
+	for _, lease := range published {
+		for _, listener := range p.listeners {
+			listener(lease, spanContext{})
+		}
+	}
 }
 
-func isPortInRange(port uint16, portRange string) bool {
-	r := strings.Split(portRange, "-")
-	start, err := strconv.Atoi(r[0])
-	if err != nil {
-		return false
-	}
-	end, err := strconv.Atoi(r[1])
-	if err != nil {
-		return false
-	}
-	return int(port) >= start && int(port) <= end
+// RegisterListener adds fn to be called with every updated lease and the trace
+// of the request, invalid when it is not traced. It is called while handling
+// the request and must not block.
+func (p *DynPortServer) RegisterListener(fn func(lease PortMappingLease, trace spanContext)) {
+	p.listeners = append(p.listeners, fn)
 }
 
 func writeNetworkOrderUint16(buf []byte, d uint16) {
@@ -318,8 +628,3 @@ func readNetworkOrderUint16(buf []byte) (uint16, []byte) {
 func readNetworkOrderUint32(buf []byte) (uint32, []byte) {
 	return (uint32(buf[0]) << 24) | (uint32(buf[1]) << 16) | (uint32(buf[2]) << 8) | uint32(buf[3]), buf[4:]
 }
-
-func randomPort(start, end uint16) uint16 {
-	size := end - start + 1
-	return uint16(rand.Intn(int(size))) + start
-}
@@ -0,0 +1,188 @@
+package main
+
+import (
+	"go.uber.org/zap"
+	"net"
+	"testing"
+	"time"
+)
+
+// fakeEngine applies the mappings at once
+type fakeEngine struct{}
+
+// appliedCh is closed, a receive gets the nil error of a successful reconcile
+var appliedCh = func() chan error {
+	ch := make(chan error)
+	close(ch)
+	return ch
+}()
+
+func (fakeEngine) CheckPrerequisite(createChains, skipJumpCheck bool) error    { return nil }
+func (fakeEngine) StartReconcile(leasesFn func() ([]*PortMappingLease, error)) {}
+func (fakeEngine) Reconcile()                                                  {}
+func (fakeEngine) ReconcileAndWait() <-chan error                              { return appliedCh }
+func (fakeEngine) EnsureMappings(leases []*PortMappingLease) error             { return nil }
+func (fakeEngine) SetExternalIP(ip net.IP)                                     {}
+func (fakeEngine) Close()                                                      {}
+
+// newTestServer returns a server of the leases, not listening
+func newTestServer(tb testing.TB, leases []*PortMappingLease) *DynPortServer {
+	store := newTestStore(tb)
+	storeLeases(tb, store, leases)
+	p, err := NewDynPortServer(zap.NewNop(), fakeEngine{}, store, store.ports, false, nil, []net.IP{net.IPv4(203, 0, 113, 1)}, nil, true, 0, 0, ReceiveOptions{}, RateLimitOptions{})
+	if err != nil {
+		tb.Fatal(err)
+	}
+	return p
+}
+
+// tcpMappingRequest returns a tcp mapping request of the internal port
+func tcpMappingRequest(internalPort uint16, lifetime uint32) []byte {
+	req := mappingRequest(internalPort, lifetime)
+	req[1] = 2
+	return req
+}
+
+// clientAddrs returns the source addresses of the clients of the leases
+func clientAddrs(leases []*PortMappingLease) []*net.UDPAddr {
+	addrs := make([]*net.UDPAddr, len(leases))
+	for j, lease := range leases {
+		addrs[j] = &net.UDPAddr{IP: lease.ClientIP, Port: 5350}
+	}
+	return addrs
+}
+
+// reset drops the responses written, as flush does without sending them
+func (r *responseBatch) reset() {
+	r.msgs = r.msgs[:0]
+	r.arena = r.arena[:0]
+}
+
+func BenchmarkHandleRequestExternalAddress(b *testing.B) {
+	p := newTestServer(b, nil)
+	conn := &responseBatch{}
+	addr := &net.UDPAddr{IP: net.IPv4(10, 0, 0, 1), Port: 5350}
+	req := []byte{0, 0}
+	b.ReportAllocs()
+	b.ResetTimer()
+	for n := 0; n < b.N; n++ {
+		if err := p.handleRequest(conn, addr, req); err != nil {
+			b.Fatal(err)
+		}
+		conn.reset()
+	}
+}
+
+// BenchmarkHandleRequestRenewal renews the leases of 1000 clients, each renewal
+// has another lifetime so it is not answered from the request cache
+func BenchmarkHandleRequestRenewal(b *testing.B) {
+	leases := testLeases(1000)
+	p := newTestServer(b, leases)
+	addrs := clientAddrs(leases)
+	reqs := make([][]byte, 64)
+	for j := range reqs {
+		reqs[j] = tcpMappingRequest(8080, 3600+uint32(j))
+	}
+	conn := &responseBatch{}
+	b.ReportAllocs()
+	b.ResetTimer()
+	for n := 0; n < b.N; n++ {
+		if err := p.handleRequest(conn, addrs[n%len(addrs)], reqs[n/len(addrs)%len(reqs)]); err != nil {
+			b.Fatal(err)
+		}
+		conn.reset()
+	}
+}
+
+// BenchmarkHandleRequestRetransmit answers the same request from the request cache
+func BenchmarkHandleRequestRetransmit(b *testing.B) {
+	leases := testLeases(1)
+	p := newTestServer(b, leases)
+	addr := clientAddrs(leases)[0]
+	req := tcpMappingRequest(8080, 3600)
+	conn := &responseBatch{}
+	b.ReportAllocs()
+	b.ResetTimer()
+	for n := 0; n < b.N; n++ {
+		if err := p.handleRequest(conn, addr, req); err != nil {
+			b.Fatal(err)
+		}
+		conn.reset()
+	}
+}
+
+// TestRenewalAllocs guards the steady-state renewal path against allocations
+func TestRenewalAllocs(t *testing.T) {
+	leases := testLeases(100)
+	p := newTestServer(t, leases)
+	addrs := clientAddrs(leases)
+	reqs := make([][]byte, 20)
+	for j := range reqs {
+		reqs[j] = tcpMappingRequest(8080, 3600+uint32(j))
+	}
+	conn := &responseBatch{}
+	n := 0
+	renew := func() {
+		if err := p.handleRequest(conn, addrs[n%len(addrs)], reqs[n/len(addrs)%len(reqs)]); err != nil {
+			t.Fatal(err)
+		}
+		conn.reset()
+		n++
+	}
+	// The first renewal of a lease tracks it in the store, the first responses
+	// grow the batch
+	for range addrs {
+		renew()
+	}
+	if allocs := testing.AllocsPerRun(1000, renew); allocs > 0 {
+		t.Errorf("renewal allocates %v times, want 0", allocs)
+	}
+}
+
+// TestDeleteEvictsRequestCache maps a port again right after deleting it, with
+// the request that mapped it before
+func TestDeleteEvictsRequestCache(t *testing.T) {
+	p := newTestServer(t, nil)
+	addr := &net.UDPAddr{IP: net.IPv4(10, 0, 0, 1), Port: 5350}
+	key := newClientKey(addr.IP, 8080, TCP)
+	conn := &responseBatch{}
+	for _, req := range [][]byte{tcpMappingRequest(8080, 3600), tcpMappingRequest(8080, 0), tcpMappingRequest(8080, 3600)} {
+		if err := p.handleRequest(conn, addr, req); err != nil {
+			t.Fatal(err)
+		}
+		conn.reset()
+	}
+	lease, ok := p.store.GetLeaseByClient(key)
+	if !ok || !lease.ExpiresAt().After(time.Now()) {
+		t.Errorf("mapping was not created again after the delete, lease %+v", lease)
+	}
+}
+
+// TestCreateLeaseExternalPortUsed maps a port while the allocator still hands out
+// the external port a lease of a peer was merged on
+func TestCreateLeaseExternalPortUsed(t *testing.T) {
+	p := newTestServer(t, nil)
+	peer := *testLeases(1)[0]
+	peer.Version = 1
+	if _, err := p.store.MergeLease(&peer); err != nil {
+		t.Fatal(err)
+	}
+	p.ports.Release(TCP, peer.ExternalIP, peer.ExternalPort)
+
+	addr := &net.UDPAddr{IP: net.IPv4(10, 0, 0, 1), Port: 5350}
+	conn := &responseBatch{}
+	if err := p.handleRequest(conn, addr, tcpMappingRequest(8080, 3600)); err != nil {
+		t.Fatal(err)
+	}
+	lease, ok := p.store.GetLeaseByClient(newClientKey(addr.IP, 8080, TCP))
+	if !ok {
+		t.Fatal("mapping was not created")
+	}
+	if lease.ExternalPort == peer.ExternalPort {
+		t.Errorf("mapping got external port %d of the lease of the peer", lease.ExternalPort)
+	}
+	// The conflicting port stayed reserved
+	if _, port, err := p.ports.Allocate(TCP, nil, peer.ExternalPort, true); err != nil || port == peer.ExternalPort {
+		t.Errorf("Allocate() = %d, %v, want another port than %d", port, err, peer.ExternalPort)
+	}
+}
@@ -4,10 +4,10 @@ go 1.20
 
 require (
 	github.com/coreos/go-iptables v0.6.0
+	github.com/dgraph-io/badger v1.6.0
 	github.com/gin-gonic/gin v1.8.2
 	github.com/go-http-utils/headers v0.0.0-20181008091004-fed159eddc2a
 	github.com/go-playground/validator/v10 v10.11.2
-	github.com/google/go-cmp v0.5.8
 	github.com/google/shlex v0.0.0-20191202100458-e7afc7fbc510
 	github.com/jackpal/go-nat-pmp v1.0.2
 	github.com/spf13/cobra v0.0.5
@@ -16,13 +16,14 @@ require (
 	github.com/timshannon/badgerhold v1.0.0
 	go.elastic.co/ecszap v1.0.1
 	go.uber.org/zap v1.24.0
+	golang.org/x/net v0.7.0
+	golang.org/x/sys v0.5.0
 )
 
 replace github.com/coreos/go-iptables => github.com/slyngdk/go-iptables v0.0.0-20230212184852-41950b3865a8
 
 require (
 	github.com/AndreasBriese/bbloom v0.0.0-20190825152654-46b345b51c96 // indirect
-	github.com/dgraph-io/badger v1.6.0 // indirect
 	github.com/dgryski/go-farm v0.0.0-20190423205320-6a90982ecee2 // indirect
 	github.com/dustin/go-humanize v1.0.0 // indirect
 	github.com/fsnotify/fsnotify v1.4.7 // indirect
@@ -52,8 +53,6 @@ require (
 	go.uber.org/atomic v1.10.0 // indirect
 	go.uber.org/multierr v1.9.0 // indirect
 	golang.org/x/crypto v0.6.0 // indirect
-	golang.org/x/net v0.7.0 // indirect
-	golang.org/x/sys v0.5.0 // indirect
 	golang.org/x/text v0.7.0 // indirect
 	google.golang.org/protobuf v1.28.1 // indirect
 	gopkg.in/yaml.v2 v2.4.0 // indirect
@@ -0,0 +1,35 @@
+package main
+
+import (
+	"sync"
+	"time"
+)
+
+// hybridClock is a hybrid logical clock versioning leases. A version holds
+// the physical time in milliseconds in the upper 48 bits and a counter in the
+// lower 16 bits, it is always higher than any version seen before, local or
+// from a peer, so a newer version means a later change even with clock skew.
+type hybridClock struct {
+	mu   sync.Mutex
+	last uint64
+}
+
+func (c *hybridClock) now() uint64 {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	if pt := uint64(time.Now().UnixMilli()) << 16; pt > c.last {
+		c.last = pt
+	} else {
+		c.last++
+	}
+	return c.last
+}
+
+// observe moves the clock past a version seen from a peer
+func (c *hybridClock) observe(version uint64) {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	if version > c.last {
+		c.last = version
+	}
+}
@@ -3,7 +3,6 @@ package main
 import (
 	"fmt"
 	"github.com/coreos/go-iptables/iptables"
-	"github.com/google/go-cmp/cmp"
 	"github.com/google/shlex"
 	"go.uber.org/zap"
 	"math/rand"
@@ -24,27 +23,69 @@ const (
 	chain_port_mapping_postrouting = chain_port_mapping + "-post"
 )
 
+// iptablesClient is the part of go-iptables the manager runs, so it can be
+// run against a fake
+type iptablesClient interface {
+	List(table, chain string) ([]string, error)
+	ListChains(table string) ([]string, error)
+	ChainExists(table, chain string) (bool, error)
+	NewChain(table, chain string) error
+	ClearChain(table, chain string) error
+	ClearAndDeleteChain(table, chain string) error
+	Append(table, chain string, rulespec ...string) error
+	AppendUnique(table, chain string, rulespec ...string) error
+	Insert(table, chain string, pos int, rulespec ...string) error
+	Delete(table, chain string, rulespec ...string) error
+}
+
 type IPTablesManager struct {
 	l                *zap.SugaredLogger
-	ipt              *iptables.IPTables
-	reconcileCh      chan interface{}
+	ipt              iptablesClient
+	trigger          *reconcileTrigger
 	reconcileCloseCh chan interface{}
 	externalIP       net.IP
+	externalIPCh     chan net.IP
+	restore          *iptablesRestore
+
+	// Model of the programmed rules and the active chain per chain base, only
+	// touched from the reconcile goroutine.
+	synced     bool
+	programmed map[string]ruleModel
+	active     map[string]string
+	// span is the span of the running reconcile
+	span *span
 }
 
-func NewIPTablesManager(l *zap.Logger, externalIP net.IP) (*IPTablesManager, error) {
+// managedChain is a chain holding one rule per lease
+type managedChain struct {
+	table     string
+	chainBase string
+	fn        func(*PortMappingLease) []string
+}
+
+func NewIPTablesManager(l *zap.Logger, externalIP net.IP, trigger *reconcileTrigger, backend string) (*IPTablesManager, error) {
 	ipt, err := iptables.New(iptables.IPFamily(iptables.ProtocolIPv4), iptables.Sudo())
 	if err != nil {
 		return nil, fmt.Errorf("failed to create iptables instance, %v", err)
 	}
-	reconcileCh := make(chan interface{})
+	var restore *iptablesRestore
+	if backend == iptables_backend_restore {
+		restore, err = newIPTablesRestore(true)
+		if err != nil {
+			return nil, fmt.Errorf("failed to create iptables-restore backend, %v", err)
+		}
+	}
 	reconcileCloseCh := make(chan interface{})
 	return &IPTablesManager{
 		l:                l.Sugar(),
 		ipt:              ipt,
-		reconcileCh:      reconcileCh,
+		trigger:          trigger,
+		externalIPCh:     make(chan net.IP, 1),
 		reconcileCloseCh: reconcileCloseCh,
 		externalIP:       externalIP,
+		restore:          restore,
+		programmed:       make(map[string]ruleModel),
+		active:           make(map[string]string),
 	}, nil
 }
 
@@ -75,9 +116,9 @@ func (i *IPTablesManager) CheckPrerequisite(createChains, skipJumpCheck bool) er
 }
 
 func (i *IPTablesManager) checkChain(table, chain string, createTables bool) error {
-	if ok, _ := i.ipt.ChainExists(table, chain); !ok {
+	if ok, _ := i.iptables().ChainExists(table, chain); !ok {
 		if createTables {
-			err := i.ipt.NewChain(table, chain)
+			err := i.iptables().NewChain(table, chain)
 			if err != nil {
 				return fmt.Errorf("failed to create chain %s %s", table, chain)
 			}
@@ -90,20 +131,32 @@ func (i *IPTablesManager) checkChain(table, chain string, createTables bool) err
 
 func (i *IPTablesManager) StartReconcile(leasesFn func() ([]*PortMappingLease, error)) {
 	timer := time.NewTicker(2 * time.Minute)
-	reconcileFn := func() {
+	reconcileFn := func(full bool) {
 		i.l.Debug("reconcile iptables")
+		generation := i.trigger.begin()
+		i.span = tracer.start("reconcile.iptables")
+		defer i.span.end()
+		i.span.set(zap.Bool("reconcile.full", full))
 		leases, err := leasesFn()
-		if err != nil {
-			return
+		if err == nil && full {
+			err = i.resync(leases)
+		} else if err == nil {
+			err = i.ensureDelta(leases)
 		}
-		i.EnsureMappings(leases)
+		i.trigger.done(generation, err)
 	}
 	for {
 		select {
 		case <-timer.C:
-			reconcileFn()
-		case <-i.reconcileCh:
-			reconcileFn()
+			// Full resync, catching rules changed outside of this process
+			reconcileFn(true)
+		case <-i.trigger.C():
+			i.trigger.settle()
+			reconcileFn(false)
+		case ip := <-i.externalIPCh:
+			// The nat rules of every lease change
+			i.externalIP = ip
+			reconcileFn(false)
 		case <-i.reconcileCloseCh:
 
 			return
@@ -115,12 +168,28 @@ func (i *IPTablesManager) Close() {
 	i.reconcileCloseCh <- true
 }
 
+// Reconcile requests a reconcile without waiting for it
 func (i *IPTablesManager) Reconcile() {
-	i.reconcileCh <- true
+	i.trigger.Trigger()
+}
+
+// ReconcileAndWait requests a reconcile, the returned channel receives its error
+func (i *IPTablesManager) ReconcileAndWait() <-chan error {
+	return i.trigger.TriggerAndWait()
+}
+
+// SetExternalIP changes the ip the leases are translated to, the rules follow
+// with the reconcile it runs
+func (i *IPTablesManager) SetExternalIP(ip net.IP) {
+	select {
+	case <-i.externalIPCh:
+	default:
+	}
+	i.externalIPCh <- ip
 }
 
 func (i *IPTablesManager) jumpExist(table, chain, target string) (bool, error) {
-	list, err := i.ipt.List(table, chain)
+	list, err := i.iptables().List(table, chain)
 	if err != nil {
 		return false, err
 	}
@@ -142,12 +211,198 @@ func (i *IPTablesManager) jumpExist(table, chain, target string) (bool, error) {
 	return false, nil
 }
 
-func (i *IPTablesManager) EnsureMappings(leases []*PortMappingLease) {
+// iptables returns the iptables instance, counting the command about to be run
+func (i *IPTablesManager) iptables() iptablesClient {
+	metricEngineCommands.with("iptables").Add(1)
+	return i.ipt
+}
+
+func (i *IPTablesManager) managedChains() []managedChain {
+	return []managedChain{
+		{table: table_filter, chainBase: chain_port_mapping, fn: forwardRule},
+		{table: table_nat, chainBase: chain_port_mapping_prerouting, fn: preroutingRule},
+		{table: table_nat, chainBase: chain_port_mapping_postrouting, fn: i.postroutingRule},
+	}
+}
+
+// EnsureMappings lists the active chains and rebuilds every chain which
+// differs from the leases.
+func (i *IPTablesManager) EnsureMappings(leases []*PortMappingLease) error {
 	postFix := RandStringBytes(6)
-	i.ensureIn(table_filter, chain_port_mapping, postFix, leases, forwardRule)
-	i.ensureIn(table_nat, chain_port_mapping_prerouting, postFix, leases, preroutingRule)
-	i.ensureIn(table_nat, chain_port_mapping_postrouting, postFix, leases, i.postroutingRule)
+	i.synced = false
+	if i.restore != nil {
+		defer metricEnsureDuration.observe(time.Now(), mapping_engine_iptables, "full", "all")
+		sp := i.span.child("iptables.restore")
+		defer sp.end()
+		if err := i.ensureRestore(postFix, leases); err != nil {
+			i.l.With(zap.Error(err)).Error("failed to restore mappings")
+			return err
+		}
+		i.synced = true
+		return nil
+	}
+	for _, c := range i.managedChains() {
+		start := time.Now()
+		sp := i.span.child("iptables.ensure_chain")
+		sp.set(zap.String("iptables.table", c.table), zap.String("iptables.chain", c.chainBase))
+		err := i.ensureIn(c.table, c.chainBase, postFix, leases, c.fn)
+		sp.end()
+		metricEnsureDuration.observe(start, mapping_engine_iptables, "full", c.table)
+		if err != nil {
+			i.l.With(zap.Error(err)).Errorf("failed to ensure chain %s %s", c.table, c.chainBase)
+			return fmt.Errorf("failed to ensure chain %s %s: %v", c.table, c.chainBase, err)
+		}
+	}
+	i.synced = true
+	return nil
+}
+
+// chainDelta is the rules to change in one active chain
+type chainDelta struct {
+	managedChain
+	desired ruleModel
+	removed ruleModel
+	added   ruleModel
+}
+
+// resync adopts the rules in the kernel as the programmed state and applies
+// only the rules differing from the leases. The chains are rebuilt when they
+// cannot be adopted.
+func (i *IPTablesManager) resync(leases []*PortMappingLease) error {
+	if err := i.adopt(); err != nil {
+		i.l.With(zap.Error(err)).Info("not adopting the programmed rules, rebuilding chains")
+		return i.EnsureMappings(leases)
+	}
+	return i.ensureDelta(leases)
+}
 
+// adopt reads the active chains into the model of the programmed rules, the
+// rules are mapped back to the leases by their comment. It fails when a chain
+// base does not jump to exactly one existing chain.
+func (i *IPTablesManager) adopt() error {
+	i.synced = false
+	var tables map[string]*savedTable
+	if i.restore != nil {
+		var err error
+		if tables, err = i.restore.save(); err != nil {
+			return err
+		}
+	}
+	active := make(map[string]string)
+	programmed := make(map[string]ruleModel)
+	for _, c := range i.managedChains() {
+		var chain string
+		var rules [][]string
+		if tables != nil {
+			if table := tables[c.table]; table != nil {
+				chain = jumpTarget(table.rules[c.chainBase])
+				if !contains(table.chains, chain) {
+					chain = ""
+				}
+				rules = table.rules[chain]
+			}
+		} else {
+			chain, rules = i.listCurrentChain(c.table, c.chainBase)
+		}
+		if !strings.HasPrefix(chain, c.chainBase+"-") {
+			return fmt.Errorf("chain %s %s does not jump to an active chain", c.table, c.chainBase)
+		}
+		active[c.chainBase] = chain
+		programmed[c.chainBase] = commentModel(rules)
+	}
+	i.active = active
+	i.programmed = programmed
+	i.synced = true
+	return nil
+}
+
+// ensureDelta only deletes and appends the rules of removed, added and changed
+// leases in the active chains. Without a model known to match the kernel it
+// resyncs, when applying the delta fails it falls back to EnsureMappings.
+func (i *IPTablesManager) ensureDelta(leases []*PortMappingLease) error {
+	if !i.synced {
+		return i.resync(leases)
+	}
+
+	deltas := make([]chainDelta, 0, 3)
+	changes := 0
+	for _, c := range i.managedChains() {
+		desired := newRuleModel(leases, leaseId, c.fn)
+		removed, added := i.programmed[c.chainBase].delta(desired)
+		changes += len(removed) + len(added)
+		deltas = append(deltas, chainDelta{managedChain: c, desired: desired, removed: removed, added: added})
+	}
+	if changes == 0 {
+		i.l.Debug("no new changes to chains")
+		return nil
+	}
+
+	start := time.Now()
+	sp := i.span.child("iptables.apply_delta")
+	sp.set(zap.Int("iptables.changes", changes))
+	var err error
+	if i.restore != nil {
+		err = i.applyDeltaRestore(deltas)
+	} else {
+		err = i.applyDeltaExec(deltas)
+	}
+	sp.end()
+	metricEnsureDuration.observe(start, mapping_engine_iptables, "delta", "all")
+	if err != nil {
+		i.l.With(zap.Error(err)).Warn("failed to apply rule changes, rebuilding chains")
+		return i.EnsureMappings(leases)
+	}
+	for _, d := range deltas {
+		i.programmed[d.chainBase] = d.desired
+	}
+	i.l.Debugf("applied %d rule changes", changes)
+	return nil
+}
+
+func (i *IPTablesManager) applyDeltaExec(deltas []chainDelta) error {
+	for _, d := range deltas {
+		chain := i.active[d.chainBase]
+		for _, rule := range d.removed {
+			if err := i.iptables().Delete(d.table, chain, rule...); err != nil {
+				return err
+			}
+		}
+		for _, rule := range d.added {
+			if err := i.iptables().Append(d.table, chain, rule...); err != nil {
+				return err
+			}
+		}
+	}
+	return nil
+}
+
+func (i *IPTablesManager) applyDeltaRestore(deltas []chainDelta) error {
+	tables := make(map[string]*strings.Builder)
+	for _, d := range deltas {
+		if len(d.removed)+len(d.added) == 0 {
+			continue
+		}
+		b, ok := tables[d.table]
+		if !ok {
+			b = &strings.Builder{}
+			tables[d.table] = b
+		}
+		chain := i.active[d.chainBase]
+		for _, rule := range d.removed {
+			b.WriteString(restoreRule("-D", chain, rule))
+		}
+		for _, rule := range d.added {
+			b.WriteString(restoreRule("-A", chain, rule))
+		}
+	}
+
+	var payload strings.Builder
+	for _, table := range []string{table_filter, table_nat} {
+		if b, ok := tables[table]; ok {
+			payload.WriteString("*" + table + "\n" + b.String() + "COMMIT\n")
+		}
+	}
+	return i.restore.apply(payload.String())
 }
 
 func forwardRule(lease *PortMappingLease) []string {
@@ -161,21 +416,29 @@ func forwardRule(lease *PortMappingLease) []string {
 }
 
 func preroutingRule(lease *PortMappingLease) []string {
-	return []string{
+	var rule []string
+	if lease.ExternalIP != nil {
+		rule = append(rule, "-d", fmt.Sprintf("%s/32", lease.ExternalIP.To4().String()))
+	}
+	return append(rule,
 		"-p", lease.Protocol.String(),
 		"-m", lease.Protocol.String(), "--dport", strconv.Itoa(int(lease.ExternalPort)),
 		"-m", "comment", "--comment", lease.Id,
 		"-j", "DNAT", "--to-destination", fmt.Sprintf("%s:%d", lease.ClientIP, lease.ClientPort),
-	}
+	)
 }
 
 func (i *IPTablesManager) postroutingRule(lease *PortMappingLease) []string {
+	ip := i.externalIP
+	if lease.ExternalIP != nil {
+		ip = lease.ExternalIP
+	}
 	return []string{
 		"-s", fmt.Sprintf("%s/32", lease.ClientIP.String()),
 		"-p", lease.Protocol.String(),
 		"-m", lease.Protocol.String(), "--sport", strconv.Itoa(int(lease.ClientPort)),
 		"-m", "comment", "--comment", lease.Id,
-		"-j", "SNAT", "--to-source", fmt.Sprintf("%s:%d", i.externalIP.To4().String(), lease.ExternalPort),
+		"-j", "SNAT", "--to-source", fmt.Sprintf("%s:%d", ip.To4().String(), lease.ExternalPort),
 	}
 }
 
@@ -183,96 +446,193 @@ func (i *IPTablesManager) ensureIn(table, chainBase, postFix string, leases []*P
 	chain := chainBase + "-" + postFix
 
 	// Generate rules
-	newRules := make([][]string, 0)
-	for _, lease := range leases {
-		newRules = append(newRules, fn(lease))
-	}
-	currentRules := i.listCurrentChain(table, chainBase)
+	desired := newRuleModel(leases, leaseId, fn)
+	active, currentRules := i.listCurrentChain(table, chainBase)
 
-	if cmp.Diff(newRules, currentRules) == "" {
-		i.l.Debugf("no new changes to chain %s %s", table, chain)
+	if active != "" && desired.equal(commentModel(currentRules)) {
+		i.l.Debugf("no new changes to chain %s %s", table, active)
+		i.programmed[chainBase] = desired
+		i.active[chainBase] = active
 		return nil
 	}
 
-	if ok, _ := i.ipt.ChainExists(table, chain); ok {
-		err := i.ipt.ClearChain(table, chain)
+	if ok, _ := i.iptables().ChainExists(table, chain); ok {
+		err := i.iptables().ClearChain(table, chain)
 		if err != nil {
 			return err
 		}
 	} else {
-		err := i.ipt.NewChain(table, chain)
+		err := i.iptables().NewChain(table, chain)
 		if err != nil {
 			return err
 		}
 	}
-	for _, rule := range newRules {
-		if err := i.ipt.AppendUnique(table, chain, rule...); err != nil {
+	for _, lease := range leases {
+		rule := desired[lease.Id]
+		if err := i.iptables().AppendUnique(table, chain, rule...); err != nil {
 			i.l.With(zap.Error(err)).Errorf("failed to ensure rule %s", rule)
+			delete(desired, lease.Id)
 			continue
 		}
 	}
 
-	i.setActiveChain(table, chainBase, postFix)
+	if err := i.setActiveChain(table, chainBase, postFix); err != nil {
+		return err
+	}
+	i.programmed[chainBase] = desired
+	i.active[chainBase] = chain
 
 	return nil
 }
 
-func (i *IPTablesManager) listCurrentChain(table, chain string) [][]string {
-	list, err := i.ipt.List(table, chain)
+// ensureRestore writes the changed chains of both tables, including the jump
+// swap and removal of the old chains, as one iptables-restore transaction.
+func (i *IPTablesManager) ensureRestore(postFix string, leases []*PortMappingLease) error {
+	tables, err := i.restore.save()
 	if err != nil {
-		i.l.With(zap.Error(err)).Error("failed to list chain")
-		return nil
+		return err
 	}
-	rules2 := rulesToArgs(list)
-	if len(rules2) != 1 {
-		return nil
+
+	tableChains := make(map[string]string)
+	active := make(map[string]string)
+	programmed := make(map[string]ruleModel)
+	for _, c := range i.managedChains() {
+		desired := newRuleModel(leases, leaseId, c.fn)
+		chains, activeChain := i.restoreChainSwap(tables[c.table], c.table, c.chainBase, postFix, leases, desired)
+		tableChains[c.table] += chains
+		active[c.chainBase] = activeChain
+		programmed[c.chainBase] = desired
+	}
+
+	var payload strings.Builder
+	for _, table := range []string{table_filter, table_nat} {
+		if tableChains[table] != "" {
+			payload.WriteString("*" + table + "\n" + tableChains[table] + "COMMIT\n")
+		}
 	}
-	currentChain := ""
-	for j, r := range rules2[0] {
-		if r == "-j" {
-			currentChain = rules2[0][j+1]
-			break
+
+	if payload.Len() > 0 {
+		if err := i.restore.apply(payload.String()); err != nil {
+			return err
 		}
 	}
+	i.active = active
+	i.programmed = programmed
+	return nil
+}
+
+// restoreChainSwap returns the restore lines replacing the active chain, if it
+// differs from desired, and the chain active afterwards.
+func (i *IPTablesManager) restoreChainSwap(table *savedTable, tableName, chainBase, postFix string, leases []*PortMappingLease, desired ruleModel) (string, string) {
+	chain := chainBase + "-" + postFix
+	if table == nil {
+		table = &savedTable{rules: make(map[string][][]string)}
+	}
+
+	active := jumpTarget(table.rules[chainBase])
+	if active != "" && desired.equal(commentModel(table.rules[active])) {
+		i.l.Debugf("no new changes to chain %s %s", tableName, active)
+		return "", active
+	}
+
+	var b strings.Builder
+	b.WriteString(":" + chain + " - [0:0]\n")
+	for _, lease := range leases {
+		b.WriteString(restoreRule("-A", chain, desired[lease.Id]))
+	}
+	b.WriteString(restoreRule("-I", chainBase, []string{"1", "-j", chain}))
+	for _, rule := range table.rules[chainBase] {
+		b.WriteString(restoreRule("-D", chainBase, rule))
+	}
+	for _, c := range table.chains {
+		if strings.HasPrefix(c, chainBase+"-") && c != chain {
+			b.WriteString("-F " + c + "\n-X " + c + "\n")
+		}
+	}
+	return b.String(), chain
+}
+
+// commentModel keys rules by their comment, which holds the lease Id. Rules
+// without comment and repeated comments get keys of no lease, they are
+// removed by a delta.
+func commentModel(rules [][]string) ruleModel {
+	m := make(ruleModel, len(rules))
+	for j, rule := range rules {
+		key := fmt.Sprintf("#%d", j)
+		for k, arg := range rule {
+			if arg == "--comment" && k+1 < len(rule) {
+				if _, ok := m[rule[k+1]]; !ok {
+					key = rule[k+1]
+				}
+				break
+			}
+		}
+		m[key] = rule
+	}
+	return m
+}
+
+// jumpTarget returns the chain jumped to, when the chain holds exactly one jump
+func jumpTarget(rules [][]string) string {
+	if len(rules) != 1 {
+		return ""
+	}
+	for j, r := range rules[0] {
+		if r == "-j" && j+1 < len(rules[0]) {
+			return rules[0][j+1]
+		}
+	}
+	return ""
+}
+
+// listCurrentChain returns the chain jumped to from chain, and its rules
+func (i *IPTablesManager) listCurrentChain(table, chain string) (string, [][]string) {
+	list, err := i.iptables().List(table, chain)
+	if err != nil {
+		i.l.With(zap.Error(err)).Error("failed to list chain")
+		return "", nil
+	}
+	currentChain := jumpTarget(rulesToArgs(list))
 	if currentChain == "" {
-		return nil
+		return "", nil
 	}
 
-	list, err = i.ipt.List(table, currentChain)
+	list, err = i.iptables().List(table, currentChain)
 	if err != nil {
 		i.l.With(zap.Error(err)).Error("failed to list chain")
-		return nil
+		return "", nil
 	}
 
-	return rulesToArgs(list)
+	return currentChain, rulesToArgs(list)
 }
 
-func (i *IPTablesManager) setActiveChain(table, chainBase, postFix string) {
-	err := i.ipt.Insert(table, chainBase, 1, []string{"-j", chainBase + "-" + postFix}...)
+func (i *IPTablesManager) setActiveChain(table, chainBase, postFix string) error {
+	err := i.iptables().Insert(table, chainBase, 1, []string{"-j", chainBase + "-" + postFix}...)
 	if err != nil {
 		i.l.With(zap.Error(err)).Errorf("failed to add jump to new chain")
-		return
+		return err
 	}
-	rules, err := i.ipt.List(table, chainBase)
+	rules, err := i.iptables().List(table, chainBase)
 	if err != nil {
 		i.l.With(zap.Error(err)).Errorf("failed to list chain %s %s", table, chainBase)
-		return
+		return err
 	}
 	for j, args := range rulesToArgs(rules) {
 		if j == 0 {
 			continue
 		}
-		err := i.ipt.Delete(table, chainBase, args...)
+		err := i.iptables().Delete(table, chainBase, args...)
 		if err != nil {
 			i.l.With(zap.Error(err)).Errorf("failed to delete rule from %s %s", table, chainBase)
-			return
+			return err
 		}
 	}
 	i.removeUsedChains(table, chainBase, postFix)
+	return nil
 }
 
 func (i *IPTablesManager) removeUsedChains(table, chainBase, postFix string) {
-	chains, err := i.ipt.ListChains(table)
+	chains, err := i.iptables().ListChains(table)
 	if err != nil {
 		i.l.With(zap.Error(err)).Errorf("failed to list chains in %s", table)
 		return
@@ -281,7 +641,7 @@ func (i *IPTablesManager) removeUsedChains(table, chainBase, postFix string) {
 	for _, chain := range chains {
 		if strings.HasPrefix(chain, chainBase+"-") && chain != chainBase+"-"+postFix {
 			i.l.Debugf("flushing and deleting chain %s %s", table, chain)
-			err := i.ipt.ClearAndDeleteChain(table, chain)
+			err := i.iptables().ClearAndDeleteChain(table, chain)
 			if err != nil {
 				i.l.With(zap.Error(err)).Errorf("failed to failed to flush and delete chain %s %s", table, chain)
 				continue
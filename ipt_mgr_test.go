@@ -0,0 +1,395 @@
+package main
+
+import (
+	"fmt"
+	"go.uber.org/zap"
+	"net"
+	"strings"
+	"testing"
+	"time"
+)
+
+// fakeIPTables keeps the chains in memory and lists them like iptables -S
+type fakeIPTables struct {
+	tables map[string]map[string][][]string
+}
+
+func newFakeIPTables() *fakeIPTables {
+	f := &fakeIPTables{tables: make(map[string]map[string][][]string)}
+	for _, table := range []string{table_filter, table_nat} {
+		f.tables[table] = make(map[string][][]string)
+	}
+	for _, c := range []struct{ table, chain string }{
+		{table_filter, chain_port_mapping},
+		{table_nat, chain_port_mapping_prerouting},
+		{table_nat, chain_port_mapping_postrouting},
+	} {
+		f.tables[c.table][c.chain] = nil
+	}
+	return f
+}
+
+func (f *fakeIPTables) chain(table, chain string) ([][]string, error) {
+	rules, ok := f.tables[table][chain]
+	if !ok {
+		return nil, fmt.Errorf("chain %s %s does not exist", table, chain)
+	}
+	return rules, nil
+}
+
+func (f *fakeIPTables) List(table, chain string) ([]string, error) {
+	rules, err := f.chain(table, chain)
+	if err != nil {
+		return nil, err
+	}
+	list := []string{"-N " + chain}
+	for _, rule := range rules {
+		list = append(list, "-A "+chain+" "+strings.Join(rule, " "))
+	}
+	return list, nil
+}
+
+func (f *fakeIPTables) ListChains(table string) ([]string, error) {
+	chains := make([]string, 0, len(f.tables[table]))
+	for chain := range f.tables[table] {
+		chains = append(chains, chain)
+	}
+	return chains, nil
+}
+
+func (f *fakeIPTables) ChainExists(table, chain string) (bool, error) {
+	_, ok := f.tables[table][chain]
+	return ok, nil
+}
+
+func (f *fakeIPTables) NewChain(table, chain string) error {
+	if _, ok := f.tables[table][chain]; ok {
+		return fmt.Errorf("chain %s %s already exists", table, chain)
+	}
+	f.tables[table][chain] = nil
+	return nil
+}
+
+func (f *fakeIPTables) ClearChain(table, chain string) error {
+	if _, err := f.chain(table, chain); err != nil {
+		return err
+	}
+	f.tables[table][chain] = nil
+	return nil
+}
+
+func (f *fakeIPTables) ClearAndDeleteChain(table, chain string) error {
+	delete(f.tables[table], chain)
+	return nil
+}
+
+func (f *fakeIPTables) find(rules [][]string, rulespec []string) int {
+	for j, rule := range rules {
+		if equalArgs(rule, rulespec) {
+			return j
+		}
+	}
+	return -1
+}
+
+func (f *fakeIPTables) Append(table, chain string, rulespec ...string) error {
+	rules, err := f.chain(table, chain)
+	if err != nil {
+		return err
+	}
+	f.tables[table][chain] = append(rules, append([]string(nil), rulespec...))
+	return nil
+}
+
+func (f *fakeIPTables) AppendUnique(table, chain string, rulespec ...string) error {
+	rules, err := f.chain(table, chain)
+	if err != nil {
+		return err
+	}
+	if f.find(rules, rulespec) >= 0 {
+		return nil
+	}
+	return f.Append(table, chain, rulespec...)
+}
+
+func (f *fakeIPTables) Insert(table, chain string, pos int, rulespec ...string) error {
+	rules, err := f.chain(table, chain)
+	if err != nil {
+		return err
+	}
+	if pos < 1 || pos > len(rules)+1 {
+		return fmt.Errorf("index of insertion too big")
+	}
+	rules = append(rules, nil)
+	copy(rules[pos:], rules[pos-1:])
+	rules[pos-1] = append([]string(nil), rulespec...)
+	f.tables[table][chain] = rules
+	return nil
+}
+
+func (f *fakeIPTables) Delete(table, chain string, rulespec ...string) error {
+	rules, err := f.chain(table, chain)
+	if err != nil {
+		return err
+	}
+	j := f.find(rules, rulespec)
+	if j < 0 {
+		return fmt.Errorf("bad rule (does a matching rule exist in that chain?)")
+	}
+	f.tables[table][chain] = append(rules[:j], rules[j+1:]...)
+	return nil
+}
+
+// newFakeIPTablesManager returns a manager of the exec backend running fake
+func newFakeIPTablesManager(fake *fakeIPTables) *IPTablesManager {
+	return &IPTablesManager{
+		l:                zap.NewNop().Sugar(),
+		ipt:              fake,
+		trigger:          newReconcileTrigger(time.Millisecond, time.Millisecond),
+		externalIPCh:     make(chan net.IP, 1),
+		reconcileCloseCh: make(chan interface{}),
+		externalIP:       net.IPv4(203, 0, 113, 1),
+		programmed:       make(map[string]ruleModel),
+		active:           make(map[string]string),
+	}
+}
+
+// testLeases returns n leases of distinct clients with distinct external ports
+func testLeases(n int) []*PortMappingLease {
+	now := time.Now()
+	leases := make([]*PortMappingLease, n)
+	for j := range leases {
+		ip := net.IPv4(10, byte(j>>16), byte(j>>8), byte(j)).To4()
+		leases[j] = &PortMappingLease{
+			Id:           leaseHash(TCP, ip, 8080),
+			Created:      now,
+			LastSeen:     now,
+			ClientIP:     ip,
+			ClientPort:   8080,
+			Protocol:     TCP,
+			ExternalPort: uint16(10000 + j%50000),
+			Expires:      now.Add(time.Hour),
+		}
+	}
+	return leases
+}
+
+func BenchmarkForwardRule(b *testing.B) {
+	lease := testLeases(1)[0]
+	b.ReportAllocs()
+	for n := 0; n < b.N; n++ {
+		forwardRule(lease)
+	}
+}
+
+func BenchmarkPreroutingRule(b *testing.B) {
+	lease := testLeases(1)[0]
+	b.ReportAllocs()
+	for n := 0; n < b.N; n++ {
+		preroutingRule(lease)
+	}
+}
+
+func BenchmarkPostroutingRule(b *testing.B) {
+	i := newFakeIPTablesManager(newFakeIPTables())
+	lease := testLeases(1)[0]
+	b.ReportAllocs()
+	for n := 0; n < b.N; n++ {
+		i.postroutingRule(lease)
+	}
+}
+
+func BenchmarkNewRuleModel(b *testing.B) {
+	leases := testLeases(10000)
+	b.ReportAllocs()
+	b.ResetTimer()
+	for n := 0; n < b.N; n++ {
+		newRuleModel(leases, leaseId, preroutingRule)
+	}
+}
+
+// BenchmarkEnsureMappings rebuilds the chains, the leases differ by one lease
+// from one run to the next
+func BenchmarkEnsureMappings(b *testing.B) {
+	leases := testLeases(1001)
+	i := newFakeIPTablesManager(newFakeIPTables())
+	b.ReportAllocs()
+	b.ResetTimer()
+	for n := 0; n < b.N; n++ {
+		i.EnsureMappings(leases[n%2 : 1000+n%2])
+	}
+}
+
+// BenchmarkEnsureDelta adds and removes one lease per reconcile
+func BenchmarkEnsureDelta(b *testing.B) {
+	leases := testLeases(1001)
+	i := newFakeIPTablesManager(newFakeIPTables())
+	i.EnsureMappings(leases[:1000])
+	if !i.synced {
+		b.Fatal("initial mappings were not applied")
+	}
+	b.ReportAllocs()
+	b.ResetTimer()
+	for n := 0; n < b.N; n++ {
+		if n%2 == 0 {
+			i.ensureDelta(leases[1:])
+		} else {
+			i.ensureDelta(leases[:1000])
+		}
+	}
+}
+
+// checkChains fails when the active chains do not hold exactly the rules of
+// the leases, or are not jumped to from their chain base
+func checkChains(t *testing.T, fake *fakeIPTables, i *IPTablesManager, leases []*PortMappingLease) {
+	t.Helper()
+	for _, c := range i.managedChains() {
+		chain := i.active[c.chainBase]
+		if got := jumpTarget(fake.tables[c.table][c.chainBase]); got != chain {
+			t.Errorf("chain %s %s jumps to %q, want %q", c.table, c.chainBase, got, chain)
+		}
+		rules := fake.tables[c.table][chain]
+		if want := newRuleModel(leases, leaseId, c.fn); len(rules) != len(want) || !want.equal(commentModel(rules)) {
+			t.Errorf("chain %s %s holds %q, want the rules of %d leases", c.table, chain, rules, len(leases))
+		}
+	}
+}
+
+func activeChains(i *IPTablesManager) map[string]string {
+	active := make(map[string]string, len(i.active))
+	for chainBase, chain := range i.active {
+		active[chainBase] = chain
+	}
+	return active
+}
+
+// withExternal returns a copy of lease on another external port and ip
+func withExternal(lease *PortMappingLease, ip net.IP, port uint16) *PortMappingLease {
+	changed := *lease
+	changed.ExternalIP = ip
+	changed.ExternalPort = port
+	return &changed
+}
+
+func TestEnsureDelta(t *testing.T) {
+	leases := testLeases(3)
+	tests := []struct {
+		name    string
+		next    []*PortMappingLease
+		tamper  func(fake *fakeIPTables, i *IPTablesManager)
+		rebuilt bool
+	}{
+		{name: "added lease", next: leases},
+		{name: "removed lease", next: leases[:1]},
+		{name: "changed external port", next: []*PortMappingLease{leases[0], withExternal(leases[1], nil, 20000)}},
+		{name: "changed external ip", next: []*PortMappingLease{leases[0], withExternal(leases[1], net.IPv4(198, 51, 100, 7).To4(), leases[1].ExternalPort)}},
+		{
+			name: "unknown model adopted",
+			next: leases,
+			tamper: func(fake *fakeIPTables, i *IPTablesManager) {
+				i.synced = false
+				i.programmed = make(map[string]ruleModel)
+			},
+		},
+		{
+			name: "unknown model without active chain",
+			next: leases,
+			tamper: func(fake *fakeIPTables, i *IPTablesManager) {
+				i.synced = false
+				fake.tables[table_filter][chain_port_mapping] = nil
+			},
+			rebuilt: true,
+		},
+		{
+			name: "rule deleted outside",
+			next: leases[1:],
+			tamper: func(fake *fakeIPTables, i *IPTablesManager) {
+				chain := i.active[chain_port_mapping]
+				fake.tables[table_filter][chain] = fake.tables[table_filter][chain][1:]
+			},
+			rebuilt: true,
+		},
+	}
+	for _, tt := range tests {
+		t.Run(tt.name, func(t *testing.T) {
+			fake := newFakeIPTables()
+			i := newFakeIPTablesManager(fake)
+			if err := i.EnsureMappings(leases[:2]); err != nil {
+				t.Fatal(err)
+			}
+			checkChains(t, fake, i, leases[:2])
+			before := activeChains(i)
+			if tt.tamper != nil {
+				tt.tamper(fake, i)
+			}
+
+			if err := i.ensureDelta(tt.next); err != nil {
+				t.Fatal(err)
+			}
+			checkChains(t, fake, i, tt.next)
+			if !i.synced {
+				t.Error("model is not synced after the reconcile")
+			}
+			if rebuilt := before[chain_port_mapping] != i.active[chain_port_mapping]; rebuilt != tt.rebuilt {
+				t.Errorf("chains rebuilt = %v, want %v", rebuilt, tt.rebuilt)
+			}
+		})
+	}
+}
+
+// TestResyncAdopt restarts the manager on the chains programmed by the one before
+func TestResyncAdopt(t *testing.T) {
+	leases := testLeases(3)
+	tests := []struct {
+		name    string
+		tamper  func(fake *fakeIPTables, active map[string]string)
+		rebuilt bool
+	}{
+		{name: "unchanged chains"},
+		{
+			name: "rule of no lease",
+			tamper: func(fake *fakeIPTables, active map[string]string) {
+				chain := active[chain_port_mapping_prerouting]
+				fake.tables[table_nat][chain] = append(fake.tables[table_nat][chain], []string{"-p", "udp", "-j", "ACCEPT"})
+			},
+		},
+		{
+			name: "rule of a removed lease",
+			tamper: func(fake *fakeIPTables, active map[string]string) {
+				chain := active[chain_port_mapping]
+				fake.tables[table_filter][chain] = append(fake.tables[table_filter][chain], forwardRule(testLeases(4)[3]))
+			},
+		},
+		{
+			name: "chain base jumping elsewhere",
+			tamper: func(fake *fakeIPTables, active map[string]string) {
+				fake.tables[table_nat][chain_port_mapping_postrouting] = [][]string{{"-j", "RETURN"}}
+			},
+			rebuilt: true,
+		},
+	}
+	for _, tt := range tests {
+		t.Run(tt.name, func(t *testing.T) {
+			fake := newFakeIPTables()
+			before := newFakeIPTablesManager(fake)
+			if err := before.EnsureMappings(leases[:2]); err != nil {
+				t.Fatal(err)
+			}
+			active := activeChains(before)
+			if tt.tamper != nil {
+				tt.tamper(fake, active)
+			}
+
+			i := newFakeIPTablesManager(fake)
+			if err := i.ensureDelta(leases); err != nil {
+				t.Fatal(err)
+			}
+			checkChains(t, fake, i, leases)
+			for chainBase, chain := range active {
+				if rebuilt := i.active[chainBase] != chain; rebuilt != tt.rebuilt {
+					t.Errorf("chain %s rebuilt = %v, want %v", chainBase, rebuilt, tt.rebuilt)
+				}
+			}
+		})
+	}
+}
@@ -0,0 +1,143 @@
+package main
+
+import (
+	"bufio"
+	"bytes"
+	"fmt"
+	"github.com/google/shlex"
+	"os/exec"
+	"strings"
+)
+
+const (
+	iptables_backend_exec    = "exec"
+	iptables_backend_restore = "restore"
+)
+
+// iptablesRestore reads and writes whole tables through iptables-save and
+// iptables-restore, so the number of process spawns does not depend on the
+// number of rules.
+type iptablesRestore struct {
+	sudo        bool
+	savePath    string
+	restorePath string
+}
+
+// savedTable is the parsed state of one table from iptables-save.
+type savedTable struct {
+	chains []string
+	rules  map[string][][]string
+}
+
+func newIPTablesRestore(sudo bool) (*iptablesRestore, error) {
+	savePath, err := lookupBinary("iptables-save", sudo)
+	if err != nil {
+		return nil, err
+	}
+	restorePath, err := lookupBinary("iptables-restore", sudo)
+	if err != nil {
+		return nil, err
+	}
+	return &iptablesRestore{sudo: sudo, savePath: savePath, restorePath: restorePath}, nil
+}
+
+func lookupBinary(name string, sudo bool) (string, error) {
+	path, err := exec.LookPath(name)
+	if err != nil {
+		if sudo {
+			// sbin might not be in path for the user, let sudo resolve it
+			return name, nil
+		}
+		return "", fmt.Errorf("failed to find %s, %v", name, err)
+	}
+	return path, nil
+}
+
+func (r *iptablesRestore) command(path string, args ...string) *exec.Cmd {
+	if r.sudo {
+		return exec.Command("sudo", append([]string{path}, args...)...)
+	}
+	return exec.Command(path, args...)
+}
+
+// save returns the current rules of all tables
+func (r *iptablesRestore) save() (map[string]*savedTable, error) {
+	metricEngineCommands.with("iptables-save").Add(1)
+	var stderr bytes.Buffer
+	cmd := r.command(r.savePath)
+	cmd.Stderr = &stderr
+	out, err := cmd.Output()
+	if err != nil {
+		return nil, fmt.Errorf("iptables-save failed: %v: %s", err, stderr.String())
+	}
+	return parseSave(out)
+}
+
+// apply runs the payload as a single iptables-restore transaction, leaving
+// chains not mentioned in the payload untouched.
+func (r *iptablesRestore) apply(payload string) error {
+	metricEngineCommands.with("iptables-restore").Add(1)
+	var stderr bytes.Buffer
+	cmd := r.command(r.restorePath, "--noflush", "--wait")
+	cmd.Stdin = strings.NewReader(payload)
+	cmd.Stderr = &stderr
+	if err := cmd.Run(); err != nil {
+		return fmt.Errorf("iptables-restore failed: %v: %s", err, stderr.String())
+	}
+	return nil
+}
+
+func parseSave(out []byte) (map[string]*savedTable, error) {
+	tables := make(map[string]*savedTable)
+	var current *savedTable
+
+	scanner := bufio.NewScanner(bytes.NewReader(out))
+	scanner.Buffer(make([]byte, 64*1024), 1024*1024)
+	for scanner.Scan() {
+		line := strings.TrimSpace(scanner.Text())
+		switch {
+		case line == "" || strings.HasPrefix(line, "#"):
+			continue
+		case strings.HasPrefix(line, "*"):
+			current = &savedTable{rules: make(map[string][][]string)}
+			tables[line[1:]] = current
+		case line == "COMMIT":
+			current = nil
+		case current == nil:
+			return nil, fmt.Errorf("unexpected line outside table: %s", line)
+		case strings.HasPrefix(line, ":"):
+			fields := strings.Fields(line[1:])
+			if len(fields) > 0 {
+				current.chains = append(current.chains, fields[0])
+			}
+		case strings.HasPrefix(line, "-A "):
+			args, err := shlex.Split(line)
+			if err != nil || len(args) < 2 {
+				continue
+			}
+			current.rules[args[1]] = append(current.rules[args[1]], args[2:])
+		}
+	}
+	if err := scanner.Err(); err != nil {
+		return nil, err
+	}
+	return tables, nil
+}
+
+// restoreRule formats a rule as a line for iptables-restore input
+func restoreRule(op, chain string, args []string) string {
+	var b strings.Builder
+	b.WriteString(op)
+	b.WriteString(" ")
+	b.WriteString(chain)
+	for _, a := range args {
+		b.WriteString(" ")
+		if a == "" || strings.ContainsAny(a, " \t\"'") {
+			b.WriteString(`"` + strings.ReplaceAll(a, `"`, `\"`) + `"`)
+		} else {
+			b.WriteString(a)
+		}
+	}
+	b.WriteString("\n")
+	return b.String()
+}
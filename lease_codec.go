@@ -0,0 +1,279 @@
+package main
+
+import (
+	"bufio"
+	"bytes"
+	"encoding/binary"
+	"encoding/gob"
+	"encoding/hex"
+	"fmt"
+	"io"
+	"mime"
+	"net"
+	"strconv"
+	"strings"
+	"time"
+)
+
+// leaseContentType is the media type of leases in the binary encoding. Its
+// version parameter, 1 without one, is the newest layout in a Content-Type
+// and the newest layout read in an Accept, so a peer knowing version 1 only
+// keeps getting version 1.
+const (
+	leaseContentType   = "application/x-dynport-leases"
+	leaseContentTypeV2 = leaseContentType + "; version=2"
+)
+
+// The binary encoding of a lease starts with a magic, which never starts a
+// gob stream, and the version of the layout. Version 1 is
+//
+//	magic(2) version(1) flags(1) id(16 or 1+n) ip(4 or 16)
+//	client port(2) external port(2) protocol(1)
+//	created(8) last seen(8) expires(8) version(8)
+//
+// in network order, times are unix nanoseconds with 0 for the zero time. The
+// id is 16 bytes when it is lower case hex, as produced by leaseHash. Version 2
+// appends the external ip(4), it is only used for leases with one, so peers
+// knowing version 1 only still read the leases of the primary external ip.
+const (
+	leaseMagic0       = 0xd7
+	leaseMagic1       = 'L'
+	leaseCodecVersion = 1
+	leaseCodecV2      = 2
+
+	leaseFlagHexId = 1 << 0
+	leaseFlagIPv6  = 1 << 1
+)
+
+// leaseMediaVersion returns the layout version of the binary lease media type
+// in the media types of an Accept or Content-Type header, 0 without it
+func leaseMediaVersion(header string) byte {
+	for _, part := range strings.Split(header, ",") {
+		mediaType, params, err := mime.ParseMediaType(part)
+		if err != nil || mediaType != leaseContentType {
+			continue
+		}
+		if v, err := strconv.Atoi(params["version"]); err == nil && v >= leaseCodecV2 {
+			return leaseCodecV2
+		}
+		return leaseCodecVersion
+	}
+	return 0
+}
+
+// leaseMediaType returns the media type of leases encoded up to version
+func leaseMediaType(version byte) string {
+	if version >= leaseCodecV2 {
+		return leaseContentTypeV2
+	}
+	return leaseContentType
+}
+
+// appendLease encodes the lease in the newest layout
+func appendLease(b []byte, lease *PortMappingLease) []byte {
+	return appendLeaseVersion(b, lease, leaseCodecV2)
+}
+
+// appendLeaseVersion encodes the lease in a layout up to version, version 1
+// leaves out the external ip
+func appendLeaseVersion(b []byte, lease *PortMappingLease, version byte) []byte {
+	var flags byte
+	id, err := hex.DecodeString(lease.Id)
+	if err == nil && len(id) == 16 && hex.EncodeToString(id) == lease.Id {
+		flags |= leaseFlagHexId
+	} else {
+		id = []byte(lease.Id)
+	}
+	ip := lease.ClientIP.To4()
+	if ip == nil {
+		ip = lease.ClientIP.To16()
+		flags |= leaseFlagIPv6
+	}
+
+	external := lease.ExternalIP.To4()
+	if version < leaseCodecV2 || external == nil {
+		version, external = leaseCodecVersion, nil
+	}
+	b = append(b, leaseMagic0, leaseMagic1, version, flags)
+	if flags&leaseFlagHexId == 0 {
+		b = append(b, byte(len(id)))
+	}
+	b = append(b, id...)
+	if ip == nil {
+		ip = make(net.IP, net.IPv6len)
+	}
+	b = append(b, ip...)
+	b = binary.BigEndian.AppendUint16(b, lease.ClientPort)
+	b = binary.BigEndian.AppendUint16(b, lease.ExternalPort)
+	b = append(b, byte(lease.Protocol))
+	b = binary.BigEndian.AppendUint64(b, uint64(unixNano(lease.Created)))
+	b = binary.BigEndian.AppendUint64(b, uint64(unixNano(lease.LastSeen)))
+	b = binary.BigEndian.AppendUint64(b, uint64(unixNano(lease.Expires)))
+	b = binary.BigEndian.AppendUint64(b, lease.Version)
+	if external != nil {
+		b = append(b, external...)
+	}
+	return b
+}
+
+// readLease decodes the lease at the start of b, returning the rest of b
+func readLease(b []byte, lease *PortMappingLease) ([]byte, error) {
+	if len(b) < 4 || b[0] != leaseMagic0 || b[1] != leaseMagic1 {
+		return nil, fmt.Errorf("not a binary lease")
+	}
+	version := b[2]
+	if version != leaseCodecVersion && version != leaseCodecV2 {
+		return nil, fmt.Errorf("unsupported lease encoding version %d", version)
+	}
+	flags := b[3]
+	b = b[4:]
+
+	take := func(n int) []byte {
+		if len(b) < n {
+			b = nil
+			return nil
+		}
+		v := b[:n:n]
+		b = b[n:]
+		return v
+	}
+	if flags&leaseFlagHexId != 0 {
+		id := take(16)
+		if id == nil {
+			return nil, fmt.Errorf("truncated lease")
+		}
+		lease.Id = hex.EncodeToString(id)
+	} else {
+		n := take(1)
+		if n == nil {
+			return nil, fmt.Errorf("truncated lease")
+		}
+		id := take(int(n[0]))
+		if id == nil {
+			return nil, fmt.Errorf("truncated lease")
+		}
+		lease.Id = string(id)
+	}
+	ipLen := net.IPv4len
+	if flags&leaseFlagIPv6 != 0 {
+		ipLen = net.IPv6len
+	}
+	ip := take(ipLen)
+	fixed := take(2 + 2 + 1 + 4*8)
+	if ip == nil || fixed == nil {
+		return nil, fmt.Errorf("truncated lease")
+	}
+	lease.ClientIP = append(net.IP(nil), ip...)
+	lease.ClientPort = binary.BigEndian.Uint16(fixed[0:2])
+	lease.ExternalPort = binary.BigEndian.Uint16(fixed[2:4])
+	lease.Protocol = PROTOCOL(fixed[4])
+	lease.Created = fromUnixNano(int64(binary.BigEndian.Uint64(fixed[5:13])))
+	lease.LastSeen = fromUnixNano(int64(binary.BigEndian.Uint64(fixed[13:21])))
+	lease.Expires = fromUnixNano(int64(binary.BigEndian.Uint64(fixed[21:29])))
+	lease.Version = binary.BigEndian.Uint64(fixed[29:37])
+	lease.ExternalIP = nil
+	if version == leaseCodecV2 {
+		external := take(net.IPv4len)
+		if external == nil {
+			return nil, fmt.Errorf("truncated lease")
+		}
+		lease.ExternalIP = append(net.IP(nil), external...)
+	}
+	return b, nil
+}
+
+func unixNano(t time.Time) int64 {
+	if t.IsZero() {
+		return 0
+	}
+	return t.UnixNano()
+}
+
+func fromUnixNano(n int64) time.Time {
+	if n == 0 {
+		return time.Time{}
+	}
+	return time.Unix(0, n)
+}
+
+func decodeLeases(b []byte) ([]PortMappingLease, error) {
+	leases := make([]PortMappingLease, 0, len(b)/64)
+	for len(b) > 0 {
+		var lease PortMappingLease
+		var err error
+		if b, err = readLease(b, &lease); err != nil {
+			return nil, err
+		}
+		leases = append(leases, lease)
+	}
+	return leases, nil
+}
+
+// leaseReader decodes binary encoded leases one at a time from a stream
+type leaseReader struct {
+	r *bufio.Reader
+}
+
+func newLeaseReader(r io.Reader) *leaseReader {
+	return &leaseReader{r: bufio.NewReader(r)}
+}
+
+// next decodes the next lease, io.EOF ends the stream
+func (lr *leaseReader) next(lease *PortMappingLease) error {
+	header, err := lr.r.Peek(5)
+	if len(header) == 0 && err == io.EOF {
+		return io.EOF
+	}
+	if len(header) < 5 {
+		return fmt.Errorf("truncated lease")
+	}
+	// The length follows from the flags and the id length
+	n := 4 + net.IPv4len + 2 + 2 + 1 + 4*8
+	if header[3]&leaseFlagHexId != 0 {
+		n += 16
+	} else {
+		n += 1 + int(header[4])
+	}
+	if header[3]&leaseFlagIPv6 != 0 {
+		n += net.IPv6len - net.IPv4len
+	}
+	if header[2] == leaseCodecV2 {
+		n += net.IPv4len
+	}
+	b, err := lr.r.Peek(n)
+	if err != nil {
+		return fmt.Errorf("truncated lease")
+	}
+	if _, err := readLease(b, lease); err != nil {
+		return err
+	}
+	_, err = lr.r.Discard(n)
+	return err
+}
+
+// storeEncode is the badgerhold encoder, leases are stored in the binary
+// encoding and everything else, like keys and indexes, as gob.
+func storeEncode(value interface{}) ([]byte, error) {
+	switch v := value.(type) {
+	case *PortMappingLease:
+		return appendLease(nil, v), nil
+	case PortMappingLease:
+		return appendLease(nil, &v), nil
+	}
+	var buf bytes.Buffer
+	err := gob.NewEncoder(&buf).Encode(value)
+	return buf.Bytes(), err
+}
+
+// storeDecode is the badgerhold decoder, values stored as gob before the
+// binary encoding are still decoded.
+func storeDecode(data []byte, value interface{}) error {
+	if lease, ok := value.(*PortMappingLease); ok && len(data) > 0 && data[0] == leaseMagic0 {
+		rest, err := readLease(data, lease)
+		if err == nil && len(rest) > 0 {
+			err = fmt.Errorf("%d bytes after lease", len(rest))
+		}
+		return err
+	}
+	return gob.NewDecoder(bytes.NewReader(data)).Decode(value)
+}
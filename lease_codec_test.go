@@ -0,0 +1,47 @@
+package main
+
+import (
+	"net"
+	"testing"
+)
+
+func TestAppendLeaseVersion(t *testing.T) {
+	lease := testLeases(1)[0]
+	lease.ExternalIP = net.IPv4(203, 0, 113, 2).To4()
+	for _, tc := range []struct {
+		version byte
+		want    net.IP
+	}{
+		{leaseCodecVersion, nil},
+		{leaseCodecV2, lease.ExternalIP},
+	} {
+		b := appendLeaseVersion(nil, lease, tc.version)
+		if b[2] != tc.version {
+			t.Errorf("version %d: encoded as version %d", tc.version, b[2])
+		}
+		var decoded PortMappingLease
+		rest, err := readLease(b, &decoded)
+		if err != nil || len(rest) != 0 {
+			t.Fatalf("version %d: readLease() = %d bytes left, %v", tc.version, len(rest), err)
+		}
+		if !decoded.ExternalIP.Equal(tc.want) || decoded.ExternalPort != lease.ExternalPort || decoded.Id != lease.Id {
+			t.Errorf("version %d: decoded %+v", tc.version, decoded)
+		}
+	}
+}
+
+func TestLeaseMediaVersion(t *testing.T) {
+	for header, want := range map[string]byte{
+		"":                                       0,
+		"application/json":                       0,
+		leaseContentType:                         leaseCodecVersion,
+		leaseContentTypeV2:                       leaseCodecV2,
+		"application/x-dynport-leases;version=3": leaseCodecV2,
+		leaseContentTypeV2 + ", application/json;q=0.9": leaseCodecV2,
+		"application/json, " + leaseContentType:         leaseCodecVersion,
+	} {
+		if got := leaseMediaVersion(header); got != want {
+			t.Errorf("leaseMediaVersion(%q) = %d, want %d", header, got, want)
+		}
+	}
+}
@@ -0,0 +1,217 @@
+package main
+
+import (
+	"container/heap"
+	"net"
+	"net/netip"
+	"time"
+)
+
+// clientKey identifies the lease of a client ip, internal port and protocol
+type clientKey struct {
+	ip       netip.Addr
+	port     uint16
+	protocol PROTOCOL
+}
+
+func newClientKey(ip net.IP, port uint16, protocol PROTOCOL) clientKey {
+	addr, _ := netip.AddrFromSlice(ip)
+	return clientKey{ip: addr.Unmap(), port: port, protocol: protocol}
+}
+
+// externalKey identifies the lease of an external port on an external ip
+type externalKey struct {
+	protocol PROTOCOL
+	ip       netip.Addr
+	port     uint16
+}
+
+// digestBuckets is the number of buckets the lease digest is split into
+const digestBuckets = 256
+
+// leaseDigest has per bucket the xor of the hashes of the Id, Version and
+// external address of its leases, two stores with equal buckets hold the same
+// leases in them.
+type leaseDigest [digestBuckets]uint64
+
+// FNV-1a, inlined so hashing does not allocate
+const (
+	fnvOffset64 = 14695981039346656037
+	fnvPrime64  = 1099511628211
+)
+
+func leaseBucket(id string) int {
+	h := uint64(fnvOffset64)
+	for i := 0; i < len(id); i++ {
+		h = (h ^ uint64(id[i])) * fnvPrime64
+	}
+	return int(h % digestBuckets)
+}
+
+func leaseDigestHash(lease *PortMappingLease) uint64 {
+	h := uint64(fnvOffset64)
+	for i := 0; i < len(lease.Id); i++ {
+		h = (h ^ uint64(lease.Id[i])) * fnvPrime64
+	}
+	for shift := 56; shift >= 0; shift -= 8 {
+		h = (h ^ (lease.Version >> shift & 0xff)) * fnvPrime64
+	}
+	for _, b := range lease.ExternalIP.To4() {
+		h = (h ^ uint64(b)) * fnvPrime64
+	}
+	h = (h ^ uint64(lease.ExternalPort>>8)) * fnvPrime64
+	h = (h ^ uint64(lease.ExternalPort&0xff)) * fnvPrime64
+	return h
+}
+
+// leaseIndex holds the leases of a store shard in memory, indexed by the
+// fields leases are looked up by. It is not safe for concurrent use, the
+// shard guards it.
+type leaseIndex struct {
+	byId     map[string]*leaseEntry
+	byClient map[clientKey]*leaseEntry
+	byExpiry expiryHeap
+	digest   leaseDigest
+}
+
+type leaseEntry struct {
+	lease     *PortMappingLease
+	expires   time.Time
+	heapIndex int
+}
+
+func newLeaseIndex() *leaseIndex {
+	return &leaseIndex{
+		byId:     make(map[string]*leaseEntry),
+		byClient: make(map[clientKey]*leaseEntry),
+	}
+}
+
+func (x *leaseIndex) len() int {
+	return len(x.byId)
+}
+
+func (x *leaseIndex) get(id string) *PortMappingLease {
+	if e, ok := x.byId[id]; ok {
+		return e.lease
+	}
+	return nil
+}
+
+func (x *leaseIndex) getByClient(key clientKey) *PortMappingLease {
+	if e, ok := x.byClient[key]; ok {
+		return e.lease
+	}
+	return nil
+}
+
+// put inserts or replaces the lease with the same Id
+func (x *leaseIndex) put(lease *PortMappingLease) {
+	x.remove(lease.Id)
+
+	e := &leaseEntry{lease: lease, expires: lease.ExpiresAt()}
+	x.byId[lease.Id] = e
+	x.byClient[newClientKey(lease.ClientIP, lease.ClientPort, lease.Protocol)] = e
+	heap.Push(&x.byExpiry, e)
+	x.digest[leaseBucket(lease.Id)] ^= leaseDigestHash(lease)
+}
+
+// update sets the times and version of the lease in place
+func (x *leaseIndex) update(id string, lastSeen, expires time.Time, version uint64) {
+	e, ok := x.byId[id]
+	if !ok {
+		return
+	}
+	bucket := leaseBucket(id)
+	x.digest[bucket] ^= leaseDigestHash(e.lease)
+	e.lease.LastSeen = lastSeen
+	e.lease.Expires = expires
+	e.lease.Version = version
+	x.digest[bucket] ^= leaseDigestHash(e.lease)
+	e.expires = e.lease.ExpiresAt()
+	heap.Fix(&x.byExpiry, e.heapIndex)
+}
+
+func (x *leaseIndex) remove(id string) {
+	e, ok := x.byId[id]
+	if !ok {
+		return
+	}
+	delete(x.byId, id)
+	key := newClientKey(e.lease.ClientIP, e.lease.ClientPort, e.lease.Protocol)
+	if x.byClient[key] == e {
+		delete(x.byClient, key)
+	}
+	heap.Remove(&x.byExpiry, e.heapIndex)
+	x.digest[leaseBucket(id)] ^= leaseDigestHash(e.lease)
+}
+
+// popExpired removes and returns the leases expiring at or before now
+func (x *leaseIndex) popExpired(now time.Time) []*PortMappingLease {
+	var expired []*PortMappingLease
+	for len(x.byExpiry) > 0 && !x.byExpiry[0].expires.After(now) {
+		lease := x.byExpiry[0].lease
+		x.remove(lease.Id)
+		expired = append(expired, lease)
+	}
+	return expired
+}
+
+// expiredCount returns the number of leases expired at now, not removed yet
+func (x *leaseIndex) expiredCount(now time.Time) int {
+	n := 0
+	for _, e := range x.byExpiry {
+		if !e.expires.After(now) {
+			n++
+		}
+	}
+	return n
+}
+
+// active returns copies of the leases not expired at now
+func (x *leaseIndex) active(now time.Time) []*PortMappingLease {
+	leases := make([]*PortMappingLease, 0, len(x.byId))
+	for _, e := range x.byId {
+		if e.expires.After(now) {
+			c := *e.lease
+			leases = append(leases, &c)
+		}
+	}
+	return leases
+}
+
+// all returns copies of all leases
+func (x *leaseIndex) all() []*PortMappingLease {
+	leases := make([]*PortMappingLease, 0, len(x.byId))
+	for _, e := range x.byId {
+		c := *e.lease
+		leases = append(leases, &c)
+	}
+	return leases
+}
+
+// expiryHeap is a min-heap of entries by expiry, implementing heap.Interface
+type expiryHeap []*leaseEntry
+
+func (h expiryHeap) Len() int           { return len(h) }
+func (h expiryHeap) Less(i, j int) bool { return h[i].expires.Before(h[j].expires) }
+func (h expiryHeap) Swap(i, j int) {
+	h[i], h[j] = h[j], h[i]
+	h[i].heapIndex = i
+	h[j].heapIndex = j
+}
+
+func (h *expiryHeap) Push(x interface{}) {
+	e := x.(*leaseEntry)
+	e.heapIndex = len(*h)
+	*h = append(*h, e)
+}
+
+func (h *expiryHeap) Pop() interface{} {
+	old := *h
+	e := old[len(old)-1]
+	old[len(old)-1] = nil
+	*h = old[:len(old)-1]
+	e.heapIndex = -1
+	return e
+}
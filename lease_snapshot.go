@@ -0,0 +1,239 @@
+package main
+
+import (
+	"bufio"
+	"encoding/binary"
+	"fmt"
+	"hash/crc32"
+	"io"
+	"os"
+	"path/filepath"
+)
+
+// The leases are loaded at startup from a snapshot file and a journal of the
+// commits since, instead of decoding every lease out of badger. Badger stays
+// the source of truth: every commit stores its sequence number along, and the
+// snapshot and journal are only used when they reach the stored sequence.
+//
+// The snapshot is
+//
+//	magic(2) version(1) seq(8) count(4) leases crc32(4)
+//
+// and a journal record, appended after each commit,
+//
+//	length(4) crc32(4) seq(8) (op(1) lease)...
+//
+// with leases in the binary lease encoding and op 1 for a deleted lease.
+const (
+	snapshotFile    = "leases.snapshot"
+	journalFile     = "leases.journal"
+	snapshotMagic0  = 0xd7
+	snapshotMagic1  = 'S'
+	snapshotVersion = 1
+
+	// storeMetaKey is the badgerhold key of the storeMeta
+	storeMetaKey = "store-meta"
+)
+
+// storeMeta is stored with every commit
+type storeMeta struct {
+	Seq uint64
+}
+
+// leaseJournal appends the commits to the journal file, it is only used by
+// the flusher.
+type leaseJournal struct {
+	dir  string
+	file *os.File
+	buf  []byte
+	// Bytes in the journal and in the last snapshot
+	size         int
+	snapshotSize int
+}
+
+// snapshotDue tells whether replaying the journal costs more than loading a
+// snapshot of its own size.
+func (j *leaseJournal) snapshotDue() bool {
+	return j.size > j.snapshotSize && j.size > 1<<20
+}
+
+// hasRecords tells whether the journal file holds commits
+func (j *leaseJournal) hasRecords() bool {
+	info, err := os.Stat(filepath.Join(j.dir, journalFile))
+	return err == nil && info.Size() > 0
+}
+
+func (j *leaseJournal) append(seq uint64, writes []pendingWrite) error {
+	if j.file == nil {
+		f, err := os.OpenFile(filepath.Join(j.dir, journalFile), os.O_CREATE|os.O_WRONLY|os.O_APPEND, 0600)
+		if err != nil {
+			return err
+		}
+		j.file = f
+	}
+	b := append(j.buf[:0], make([]byte, 8)...)
+	b = binary.BigEndian.AppendUint64(b, seq)
+	for i := range writes {
+		var op byte
+		if writes[i].deleted {
+			op = 1
+		}
+		b = append(b, op)
+		b = appendLease(b, &writes[i].lease)
+	}
+	binary.BigEndian.PutUint32(b[0:4], uint32(len(b)-8))
+	binary.BigEndian.PutUint32(b[4:8], crc32.ChecksumIEEE(b[8:]))
+	j.buf = b
+	n, err := j.file.Write(b)
+	j.size += n
+	return err
+}
+
+// writeSnapshot replaces the snapshot with the leases as of the commit seq
+// and truncates the journal.
+func (j *leaseJournal) writeSnapshot(seq uint64, leases []PortMappingLease) error {
+	b := make([]byte, 0, 32+len(leases)*64)
+	b = append(b, snapshotMagic0, snapshotMagic1, snapshotVersion)
+	b = binary.BigEndian.AppendUint64(b, seq)
+	b = binary.BigEndian.AppendUint32(b, uint32(len(leases)))
+	for i := range leases {
+		b = appendLease(b, &leases[i])
+	}
+	b = binary.BigEndian.AppendUint32(b, crc32.ChecksumIEEE(b))
+
+	tmp := filepath.Join(j.dir, snapshotFile+".tmp")
+	f, err := os.OpenFile(tmp, os.O_CREATE|os.O_WRONLY|os.O_TRUNC, 0600)
+	if err != nil {
+		return err
+	}
+	if _, err = f.Write(b); err == nil {
+		err = f.Sync()
+	}
+	if closeErr := f.Close(); err == nil {
+		err = closeErr
+	}
+	if err == nil {
+		err = os.Rename(tmp, filepath.Join(j.dir, snapshotFile))
+	}
+	if err != nil {
+		os.Remove(tmp)
+		return err
+	}
+
+	j.snapshotSize = len(b)
+	if j.file != nil {
+		j.file.Close()
+		j.file = nil
+	}
+	j.size = 0
+	if err := os.Truncate(filepath.Join(j.dir, journalFile), 0); err != nil && !os.IsNotExist(err) {
+		return err
+	}
+	return nil
+}
+
+func (j *leaseJournal) close() error {
+	if j.file == nil {
+		return nil
+	}
+	return j.file.Close()
+}
+
+// readSnapshot returns the leases of the snapshot with the journal replayed
+// up to the commit seq, it fails when they do not reach seq.
+func readSnapshot(dir string, seq uint64) ([]*PortMappingLease, error) {
+	b, err := os.ReadFile(filepath.Join(dir, snapshotFile))
+	if err != nil {
+		return nil, err
+	}
+	if len(b) < 19 || b[0] != snapshotMagic0 || b[1] != snapshotMagic1 || b[2] != snapshotVersion {
+		return nil, fmt.Errorf("not a lease snapshot")
+	}
+	if crc32.ChecksumIEEE(b[:len(b)-4]) != binary.BigEndian.Uint32(b[len(b)-4:]) {
+		return nil, fmt.Errorf("snapshot checksum mismatch")
+	}
+	at := binary.BigEndian.Uint64(b[3:11])
+	if at > seq {
+		return nil, fmt.Errorf("snapshot at %d is ahead of the store at %d", at, seq)
+	}
+	count := binary.BigEndian.Uint32(b[11:15])
+	body := b[15 : len(b)-4]
+
+	leases := make(map[string]*PortMappingLease, count)
+	for len(body) > 0 {
+		lease := &PortMappingLease{}
+		if body, err = readLease(body, lease); err != nil {
+			return nil, err
+		}
+		leases[lease.Id] = lease
+	}
+	if len(leases) != int(count) {
+		return nil, fmt.Errorf("snapshot holds %d leases instead of %d", len(leases), count)
+	}
+
+	if at < seq {
+		if at, err = replayJournal(dir, at, seq, leases); err != nil {
+			return nil, err
+		}
+		if at != seq {
+			return nil, fmt.Errorf("journal ends at %d before the store at %d", at, seq)
+		}
+	}
+
+	result := make([]*PortMappingLease, 0, len(leases))
+	for _, lease := range leases {
+		result = append(result, lease)
+	}
+	return result, nil
+}
+
+// replayJournal applies the records after the commit from up to the commit to,
+// returning the last commit applied. A torn record ends the journal.
+func replayJournal(dir string, from, to uint64, leases map[string]*PortMappingLease) (uint64, error) {
+	f, err := os.Open(filepath.Join(dir, journalFile))
+	if err != nil {
+		return from, err
+	}
+	defer f.Close()
+
+	r := bufio.NewReader(f)
+	var header [8]byte
+	var record []byte
+	for from < to {
+		if _, err := io.ReadFull(r, header[:]); err != nil {
+			break
+		}
+		n := binary.BigEndian.Uint32(header[0:4])
+		if n < 8 {
+			break
+		}
+		if cap(record) < int(n) {
+			record = make([]byte, n)
+		}
+		record = record[:n]
+		if _, err := io.ReadFull(r, record); err != nil || crc32.ChecksumIEEE(record) != binary.BigEndian.Uint32(header[4:8]) {
+			break
+		}
+		seq := binary.BigEndian.Uint64(record[0:8])
+		if seq <= from {
+			continue
+		}
+		if seq != from+1 {
+			return from, fmt.Errorf("journal skips from %d to %d", from, seq)
+		}
+		for body := record[8:]; len(body) > 0; {
+			op := body[0]
+			lease := &PortMappingLease{}
+			if body, err = readLease(body[1:], lease); err != nil {
+				return from, err
+			}
+			if op == 1 {
+				delete(leases, lease.Id)
+			} else {
+				leases[lease.Id] = lease
+			}
+		}
+		from = seq
+	}
+	return from, nil
+}
@@ -2,6 +2,7 @@ package main
 
 import (
 	"fmt"
+	"github.com/spf13/cobra"
 	"go.uber.org/zap"
 	"net"
 	"os"
@@ -14,7 +15,7 @@ type PROTOCOL uint8
 
 const (
 	TCP PROTOCOL = 0
-	UDP          = 1
+	UDP PROTOCOL = 1
 )
 
 func (p PROTOCOL) String() string {
@@ -34,7 +35,22 @@ type PortMappingLease struct {
 	ClientIP     net.IP
 	ClientPort   uint16
 	Protocol     PROTOCOL
-	ExternalPort uint16 `badgerhold:"unique"`
+	ExternalPort uint16
+	// ExternalIP is the external ip of the port, nil for the primary external ip
+	ExternalIP net.IP `json:",omitempty"`
+	Expires    time.Time
+	// Hybrid logical clock of the last change, replicated leases keep the version of the peer
+	Version uint64
+}
+
+// legacyLeaseLifetime is how long a lease stored without expiry stays active
+const legacyLeaseLifetime = 5 * time.Minute
+
+func (l *PortMappingLease) ExpiresAt() time.Time {
+	if l.Expires.IsZero() {
+		return l.LastSeen.Add(legacyLeaseLifetime)
+	}
+	return l.Expires
 }
 
 var config Configuration
@@ -46,28 +62,38 @@ func main() {
 	}
 }
 
-func start() {
+func start(cmd *cobra.Command) {
 	var err error
-	logger := getLogger()
+	logger, spans := getLogger()
 	defer logger.Sync() // flushes buffer, if any
+	tracer.configure(spans, config.TraceSampleRatio)
 
 	if config.ReplicationListenAddr != "" && config.ReplicationSecret == "" {
 		logger.Fatal("you have enabled replication, but not specified a replication secret")
 	}
 
-	var externalIP net.IP
-	if config.ExternalIP != "" {
-		externalIP = net.ParseIP(config.ExternalIP)
-	} else {
-		externalIP, err = GetOutboundIP()
+	// The configured external ips, the first one is the primary ip
+	var externalIPs []net.IP
+	for _, ip := range config.ExternalIPs {
+		externalIPs = append(externalIPs, net.ParseIP(ip))
+	}
+	if len(externalIPs) == 0 && config.ExternalIP != "" {
+		externalIPs = []net.IP{net.ParseIP(config.ExternalIP)}
+	}
+	poolIPs := externalIPs
+	if len(externalIPs) == 0 {
+		guessed, err := GetOutboundIP()
 		if err != nil {
 			logger.With(zap.Error(err)).Fatal("failed to guess external ip")
 		}
+		externalIPs = []net.IP{guessed}
 	}
+	externalIP := externalIPs[0]
 
-	ipt, err := NewIPTablesManager(logger, externalIP)
+	trigger := newReconcileTrigger(config.ReconcileDebounce, config.ReconcileMaxDelay)
+	ipt, err := NewMappingEngine(logger, config.MappingEngine, externalIP, trigger, config.IPTablesBackend, config.NFTablesTable, config.NFTablesForwardMark)
 	if err != nil {
-		logger.With(zap.Error(err)).Fatal("failed to create IPTablesManager")
+		logger.With(zap.Error(err)).Fatal("failed to create mapping engine")
 	}
 	defer ipt.Close()
 
@@ -75,33 +101,79 @@ func start() {
 		logger.With(zap.Error(err)).Fatal("prerequisite check failed")
 	}
 
-	store, err := NewDataStore(logger, config.DataDir)
+	ports, err := NewPortAllocator(config.PortRange, poolIPs, config.PortReuseDelay)
+	if err != nil {
+		logger.With(zap.Error(err)).Fatal("failed to create port allocator")
+	}
+	if index, count, err := portPartition(&config); err != nil {
+		logger.With(zap.Error(err)).Fatal("failed to partition port range")
+	} else if count > 1 {
+		if err := ports.Partition(index, count); err != nil {
+			logger.With(zap.Error(err)).Fatal("failed to partition port range")
+		}
+		logger.Sugar().Infof("allocating new ports from slice %d of %d of the port range", index+1, count)
+	}
+
+	store, err := NewDataStore(logger, config.DataDir, ports, PersistOptions{
+		Interval:      config.StoreFlushInterval,
+		Size:          config.StoreFlushSize,
+		Sync:          config.StoreDurability == "sync",
+		RenewalMargin: config.RenewalPublishMargin,
+	})
 	if err != nil {
 		logger.With(zap.Error(err)).Fatal("failed to start datastore")
 	}
 	defer store.Close()
 
 	go ipt.StartReconcile(store.GetActiveLeases)
+	go store.StartExpiry(time.Second, func(expired []*PortMappingLease) {
+		ipt.Reconcile()
+	})
 
-	ipt.Reconcile()
+	// Requests are served from the loaded leases while the rules are applied
+	ready := newReadiness(logger)
+	go func() {
+		waitRulesApplied(logger, ipt)
+		ready.rulesApplied()
+	}()
 
-	replication := NewReplication(logger, store, config.ReplicationListenAddr, config.ReplicationSecret, config.ReplicationPeers)
+	replication := NewReplication(logger, store, config.ReplicationListenAddr, advertiseAddr(&config), config.ReplicationSecret, replicationPeers(&config), config.ReplicationQueueSize, config.ReplicationBatchSize, config.ReplicationChangeLogSize, config.ReplicationHeartbeat)
 	replication.RegisterUpdateListener(ipt.Reconcile)
 	replication.Start()
 
+	if config.MetricsListenAddr != "" {
+		registerStateMetrics(store, ports, trigger, replication, ready)
+		StartMetrics(logger, config.MetricsListenAddr, ready)
+	}
+	if config.DebugListenAddr != "" {
+		StartDebug(logger, config.DebugListenAddr)
+	}
+
 	go func() {
-		replication.RunFullSync()
+		replication.RunSync()
+		waitRulesApplied(logger, ipt)
+		ready.peersSynced()
 
-		t := time.NewTimer(5 * time.Minute)
+		t := time.NewTicker(config.ReplicationSyncInterval)
 		for {
 			select {
 			case <-t.C:
-				replication.RunFullSync()
+				replication.RunSync()
 			}
 		}
 	}()
 
-	dynPortServer, err := NewDynPortServer(logger, ipt, store, config.ListenAddrs, externalIP, config.ACL, config.ACLAllowDefault)
+	dynPortServer, err := NewDynPortServer(logger, ipt, store, ports, config.HonorSuggestedPort, config.ListenAddrs, externalIPs, config.ACL, config.ACLAllowDefault, config.ReconcileWait, config.MaxLeaseLifetime, ReceiveOptions{
+		Sockets:   config.ListenSockets,
+		Workers:   config.Workers,
+		QueueSize: config.WorkerQueueSize,
+		BatchSize: config.ReceiveBatchSize,
+	}, RateLimitOptions{
+		Rate:    config.RateLimit,
+		Burst:   config.RateLimitBurst,
+		Clients: config.RateLimitClients,
+		Reject:  config.RateLimitAction == "reject",
+	})
 	if err != nil {
 		logger.With(zap.Error(err)).Fatal("failed to create new dynPortServer server")
 	}
@@ -116,7 +188,16 @@ func start() {
 		}
 	}()
 
+	reloader := &configReloader{l: logger, cmd: cmd, server: dynPortServer, ports: ports, store: store, replication: replication}
+	go reloader.run()
+
 	dynPortServer.RegisterListener(replication.PortMappingLeaseListener)
+	if len(poolIPs) == 0 && config.ExternalIPCheckInterval > 0 {
+		go watchExternalIP(logger, config.ExternalIPCheckInterval, externalIP, func(ip net.IP) {
+			ipt.SetExternalIP(ip)
+			dynPortServer.SetExternalIP(ip)
+		})
+	}
 	err = dynPortServer.Start()
 	if err != nil {
 		logger.With(zap.Error(err)).Error("failed to start dynPortServer server")
@@ -134,3 +215,21 @@ func GetOutboundIP() (net.IP, error) {
 
 	return localAddr.IP, nil
 }
+
+// watchExternalIP guesses the external ip every interval, calling fn when it
+// differs from the last one
+func watchExternalIP(l *zap.Logger, interval time.Duration, current net.IP, fn func(ip net.IP)) {
+	ticker := time.NewTicker(interval)
+	defer ticker.Stop()
+	for range ticker.C {
+		ip, err := GetOutboundIP()
+		if err != nil {
+			l.With(zap.Error(err)).Warn("failed to guess external ip")
+			continue
+		}
+		if !ip.Equal(current) {
+			current = ip
+			fn(ip)
+		}
+	}
+}
@@ -0,0 +1,41 @@
+package main
+
+import (
+	"fmt"
+	"go.uber.org/zap"
+	"net"
+)
+
+const (
+	mapping_engine_iptables = "iptables"
+	mapping_engine_nftables = "nftables"
+)
+
+// MappingEngine programs the kernel with the forward and nat rules for the active leases.
+type MappingEngine interface {
+	CheckPrerequisite(createChains, skipJumpCheck bool) error
+	StartReconcile(leasesFn func() ([]*PortMappingLease, error))
+	Reconcile()
+	ReconcileAndWait() <-chan error
+	EnsureMappings(leases []*PortMappingLease) error
+	SetExternalIP(ip net.IP)
+	Close()
+}
+
+func NewMappingEngine(l *zap.Logger, engine string, externalIP net.IP, trigger *reconcileTrigger, iptablesBackend, nftablesTable string, nftablesForwardMark uint32) (MappingEngine, error) {
+	switch engine {
+	case mapping_engine_iptables:
+		ipt, err := NewIPTablesManager(l, externalIP, trigger, iptablesBackend)
+		if err != nil {
+			return nil, err
+		}
+		return ipt, nil
+	case mapping_engine_nftables:
+		nft, err := NewNFTablesManager(l, externalIP, trigger, nftablesTable, nftablesForwardMark)
+		if err != nil {
+			return nil, err
+		}
+		return nft, nil
+	}
+	return nil, fmt.Errorf("unknown mapping engine %s", engine)
+}
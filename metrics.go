@@ -0,0 +1,359 @@
+package main
+
+import (
+	"bufio"
+	"fmt"
+	"go.uber.org/zap"
+	"math"
+	"net/http"
+	"net/http/pprof"
+	"sort"
+	"strconv"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// Metrics are exposed in the Prometheus text format. Counters and histograms
+// are atomics, so updating them on the request path does not lock or
+// allocate once the label values have been seen.
+
+var metricsRegistry = &registry{}
+
+var (
+	metricRequests = metricsRegistry.counterVec("dynport_requests_total",
+		"NAT-PMP requests handled by opcode and result code", "opcode", "result")
+	metricRequestDuration = metricsRegistry.histogramVec("dynport_request_duration_seconds",
+		"Time handling NAT-PMP requests by opcode", "opcode")
+	metricStoreUpsertDuration = metricsRegistry.histogramVec("dynport_store_upsert_duration_seconds",
+		"Time storing a lease change", "source")
+	metricEnsureDuration = metricsRegistry.histogramVec("dynport_ensure_mappings_duration_seconds",
+		"Time programming the mappings by engine, mode (full/delta) and table", "engine", "mode", "table")
+	metricEngineCommands = metricsRegistry.counterVec("dynport_engine_commands_total",
+		"Commands run to program the mappings", "command")
+	metricDuplicateRequests = metricsRegistry.counterVec("dynport_duplicate_requests_total",
+		"Retransmitted mapping requests dropped while in flight or answered from the request cache", "state")
+	metricRateLimited = metricsRegistry.counterVec("dynport_rate_limited_requests_total",
+		"Requests of clients over their rate limit by action (dropped/rejected)", "action")
+	metricAnnouncements = metricsRegistry.counterVec("dynport_announcements_total",
+		"External address announcements multicast by outcome (sent/failed)", "outcome")
+	metricRenewals = metricsRegistry.counterVec("dynport_renewals_total",
+		"Renewals handled in memory (renewed) and published to disk and peers (published)", "state")
+	metricReplicationRejected = metricsRegistry.counterVec("dynport_replication_rejected_leases_total",
+		"Leases of peers not merged by reason", "reason")
+	metricReplicationDuration = metricsRegistry.histogramVec("dynport_replication_request_duration_seconds",
+		"Time of replication requests to peers by operation and outcome", "operation", "outcome")
+)
+
+var durationBuckets = []float64{.0001, .00025, .0005, .001, .0025, .005, .01, .025, .05, .1, .25, .5, 1, 2.5, 5, 10}
+
+// labelValues are the values of up to three labels, comparable to be a map key
+type labelValues [3]string
+
+type registry struct {
+	mu      sync.Mutex
+	metrics []metric
+}
+
+type metric interface {
+	name() string
+	write(w *bufio.Writer)
+}
+
+func (r *registry) register(m metric) {
+	r.mu.Lock()
+	defer r.mu.Unlock()
+	r.metrics = append(r.metrics, m)
+}
+
+func (r *registry) counterVec(name, help string, labels ...string) *counterVec {
+	v := &counterVec{metricName: name, help: help, labels: labels, children: make(map[labelValues]*atomic.Uint64)}
+	r.register(v)
+	return v
+}
+
+func (r *registry) histogramVec(name, help string, labels ...string) *histogramVec {
+	v := &histogramVec{metricName: name, help: help, labels: labels, buckets: durationBuckets, children: make(map[labelValues]*histogram)}
+	r.register(v)
+	return v
+}
+
+// gaugeFunc registers a gauge, or a counter maintained elsewhere, read when scraped
+func (r *registry) gaugeFunc(name, help, kind string, labels []string, fn func() map[labelValues]float64) {
+	r.register(&funcMetric{metricName: name, help: help, kind: kind, labels: labels, fn: fn})
+}
+
+// WriteTo writes all metrics in the text format, sorted by name
+func (r *registry) WriteTo(w *bufio.Writer) {
+	r.mu.Lock()
+	metrics := append([]metric(nil), r.metrics...)
+	r.mu.Unlock()
+	sort.Slice(metrics, func(i, j int) bool { return metrics[i].name() < metrics[j].name() })
+	for _, m := range metrics {
+		m.write(w)
+	}
+}
+
+func (r *registry) ServeHTTP(w http.ResponseWriter, req *http.Request) {
+	w.Header().Set("Content-Type", "text/plain; version=0.0.4; charset=utf-8")
+	b := bufio.NewWriter(w)
+	r.WriteTo(b)
+	b.Flush()
+}
+
+type counterVec struct {
+	metricName string
+	help       string
+	labels     []string
+
+	mu       sync.RWMutex
+	children map[labelValues]*atomic.Uint64
+}
+
+func (v *counterVec) name() string { return v.metricName }
+
+func (v *counterVec) with(values ...string) *atomic.Uint64 {
+	var key labelValues
+	copy(key[:], values)
+	v.mu.RLock()
+	c, ok := v.children[key]
+	v.mu.RUnlock()
+	if ok {
+		return c
+	}
+	v.mu.Lock()
+	defer v.mu.Unlock()
+	if c, ok = v.children[key]; !ok {
+		c = &atomic.Uint64{}
+		v.children[key] = c
+	}
+	return c
+}
+
+func (v *counterVec) write(w *bufio.Writer) {
+	writeHeader(w, v.metricName, v.help, "counter")
+	v.mu.RLock()
+	defer v.mu.RUnlock()
+	for _, key := range sortedKeys(v.children) {
+		writeSample(w, v.metricName, v.labels, key, "", "", float64(v.children[key].Load()))
+	}
+}
+
+type histogramVec struct {
+	metricName string
+	help       string
+	labels     []string
+	buckets    []float64
+
+	mu       sync.RWMutex
+	children map[labelValues]*histogram
+}
+
+type histogram struct {
+	counts []atomic.Uint64
+	count  atomic.Uint64
+	sum    atomic.Int64
+}
+
+func (v *histogramVec) name() string { return v.metricName }
+
+func (v *histogramVec) with(values ...string) *histogram {
+	var key labelValues
+	copy(key[:], values)
+	v.mu.RLock()
+	h, ok := v.children[key]
+	v.mu.RUnlock()
+	if ok {
+		return h
+	}
+	v.mu.Lock()
+	defer v.mu.Unlock()
+	if h, ok = v.children[key]; !ok {
+		h = &histogram{counts: make([]atomic.Uint64, len(v.buckets))}
+		v.children[key] = h
+	}
+	return h
+}
+
+// observe records the time passed since start in the histogram of the label values
+func (v *histogramVec) observe(start time.Time, values ...string) {
+	d := time.Since(start)
+	h := v.with(values...)
+	seconds := d.Seconds()
+	for i, b := range v.buckets {
+		if seconds <= b {
+			h.counts[i].Add(1)
+			break
+		}
+	}
+	h.count.Add(1)
+	h.sum.Add(int64(d))
+}
+
+func (v *histogramVec) write(w *bufio.Writer) {
+	writeHeader(w, v.metricName, v.help, "histogram")
+	v.mu.RLock()
+	defer v.mu.RUnlock()
+	for _, key := range sortedKeys(v.children) {
+		h := v.children[key]
+		var cumulative uint64
+		for i, b := range v.buckets {
+			cumulative += h.counts[i].Load()
+			writeSample(w, v.metricName+"_bucket", v.labels, key, "le", strconv.FormatFloat(b, 'g', -1, 64), float64(cumulative))
+		}
+		count := h.count.Load()
+		writeSample(w, v.metricName+"_bucket", v.labels, key, "le", "+Inf", float64(count))
+		writeSample(w, v.metricName+"_sum", v.labels, key, "", "", time.Duration(h.sum.Load()).Seconds())
+		writeSample(w, v.metricName+"_count", v.labels, key, "", "", float64(count))
+	}
+}
+
+type funcMetric struct {
+	metricName string
+	help       string
+	kind       string
+	labels     []string
+	fn         func() map[labelValues]float64
+}
+
+func (m *funcMetric) name() string { return m.metricName }
+
+func (m *funcMetric) write(w *bufio.Writer) {
+	writeHeader(w, m.metricName, m.help, m.kind)
+	values := m.fn()
+	for _, key := range sortedKeys(values) {
+		writeSample(w, m.metricName, m.labels, key, "", "", values[key])
+	}
+}
+
+func sortedKeys[V interface{}](m map[labelValues]V) []labelValues {
+	keys := make([]labelValues, 0, len(m))
+	for k := range m {
+		keys = append(keys, k)
+	}
+	sort.Slice(keys, func(i, j int) bool {
+		for n := range keys[i] {
+			if keys[i][n] != keys[j][n] {
+				return keys[i][n] < keys[j][n]
+			}
+		}
+		return false
+	})
+	return keys
+}
+
+func writeHeader(w *bufio.Writer, name, help, kind string) {
+	fmt.Fprintf(w, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, kind)
+}
+
+func writeSample(w *bufio.Writer, name string, labels []string, values labelValues, extraLabel, extraValue string, value float64) {
+	w.WriteString(name)
+	pairs := make([]string, 0, len(labels)+1)
+	for i, l := range labels {
+		pairs = append(pairs, l+`="`+escapeLabel(values[i])+`"`)
+	}
+	if extraLabel != "" {
+		pairs = append(pairs, extraLabel+`="`+extraValue+`"`)
+	}
+	if len(pairs) > 0 {
+		w.WriteString("{" + strings.Join(pairs, ",") + "}")
+	}
+	w.WriteString(" ")
+	switch {
+	case math.IsInf(value, 1):
+		w.WriteString("+Inf")
+	case value == math.Trunc(value) && math.Abs(value) < 1e15:
+		w.WriteString(strconv.FormatInt(int64(value), 10))
+	default:
+		w.WriteString(strconv.FormatFloat(value, 'g', -1, 64))
+	}
+	w.WriteString("\n")
+}
+
+var labelEscaper = strings.NewReplacer(`\`, `\\`, `"`, `\"`, "\n", `\n`)
+
+func escapeLabel(s string) string {
+	return labelEscaper.Replace(s)
+}
+
+// opcodeLabels and resultLabels are the label values of the request metrics,
+// formatted once so counting a request does not allocate.
+var opcodeLabels, resultLabels [256]string
+
+func init() {
+	for i := range opcodeLabels {
+		opcodeLabels[i] = strconv.Itoa(i)
+		resultLabels[i] = strconv.Itoa(i)
+	}
+}
+
+// StartMetrics serves the metrics on /metrics and the readiness on /ready of listenAddr
+func StartMetrics(l *zap.Logger, listenAddr string, ready *readiness) {
+	mux := http.NewServeMux()
+	mux.Handle("/metrics", metricsRegistry)
+	mux.Handle("/ready", ready)
+	go func() {
+		if err := http.ListenAndServe(listenAddr, mux); err != nil {
+			l.With(zap.Error(err)).Error("failed to serve metrics")
+		}
+	}()
+}
+
+// StartDebug serves the pprof profiles on /debug/pprof/
+func StartDebug(l *zap.Logger, listenAddr string) {
+	mux := http.NewServeMux()
+	mux.HandleFunc("/debug/pprof/", pprof.Index)
+	mux.HandleFunc("/debug/pprof/cmdline", pprof.Cmdline)
+	mux.HandleFunc("/debug/pprof/profile", pprof.Profile)
+	mux.HandleFunc("/debug/pprof/symbol", pprof.Symbol)
+	mux.HandleFunc("/debug/pprof/trace", pprof.Trace)
+	go func() {
+		if err := http.ListenAndServe(listenAddr, mux); err != nil {
+			l.With(zap.Error(err)).Error("failed to serve debug requests")
+		}
+	}()
+}
+
+// registerStateMetrics registers the gauges read from the state when scraped
+func registerStateMetrics(store *DataStore, ports *PortAllocator, trigger *reconcileTrigger, replication *Replication, ready *readiness) {
+	metricsRegistry.gaugeFunc("dynport_ready", "1 once the rules are in sync after start", "gauge", nil, func() map[labelValues]float64 {
+		if ready.ready() {
+			return map[labelValues]float64{{}: 1}
+		}
+		return map[labelValues]float64{{}: 0}
+	})
+	metricsRegistry.gaugeFunc("dynport_leases", "Leases held by state", "gauge", []string{"state"}, func() map[labelValues]float64 {
+		held, active := store.Stats()
+		return map[labelValues]float64{{"active"}: float64(active), {"expired"}: float64(held - active)}
+	})
+	poolMetric := func(name, help, kind string, fn func(PortPoolStats) float64) {
+		metricsRegistry.gaugeFunc(name, help, kind, []string{"protocol"}, func() map[labelValues]float64 {
+			values := make(map[labelValues]float64)
+			for protocol, stats := range ports.Stats() {
+				values[labelValues{protocol.String()}] = fn(stats)
+			}
+			return values
+		})
+	}
+	poolMetric("dynport_port_pool_size", "External ports in the range by protocol", "gauge",
+		func(s PortPoolStats) float64 { return float64(s.Size) })
+	poolMetric("dynport_port_pool_owned", "External ports of the range new mappings are allocated from by protocol", "gauge",
+		func(s PortPoolStats) float64 { return float64(s.Owned) })
+	poolMetric("dynport_port_pool_in_use", "External ports allocated by protocol", "gauge",
+		func(s PortPoolStats) float64 { return float64(s.InUse) })
+	poolMetric("dynport_port_pool_cooling", "Released external ports cooling down by protocol", "gauge",
+		func(s PortPoolStats) float64 { return float64(s.Cooling) })
+	poolMetric("dynport_port_pool_exhausted_total", "Allocations failed for lack of a free port by protocol", "counter",
+		func(s PortPoolStats) float64 { return float64(s.Exhausted) })
+	metricsRegistry.gaugeFunc("dynport_reconcile_pending", "Reconcile requests not covered by a finished run", "gauge", nil, func() map[labelValues]float64 {
+		return map[labelValues]float64{{}: float64(trigger.pending())}
+	})
+	metricsRegistry.gaugeFunc("dynport_replication_queue_depth", "Lease updates queued to be pushed by peer", "gauge", []string{"peer"}, func() map[labelValues]float64 {
+		values := make(map[labelValues]float64)
+		for _, q := range replication.peerQueues() {
+			values[labelValues{q.peer}] = float64(q.len())
+		}
+		return values
+	})
+}
@@ -0,0 +1,433 @@
+package main
+
+import (
+	"bytes"
+	"fmt"
+	"go.uber.org/zap"
+	"net"
+	"os/exec"
+	"strings"
+	"time"
+)
+
+const (
+	nft_set_forward  = "forward_set"
+	nft_map_dnat     = "dnat_map"
+	nft_map_dnat_ip  = "dnat_addr_map"
+	nft_map_snat     = "snat_map"
+	nft_element_page = 1000
+
+	chain_port_mapping_mark = chain_port_mapping + "-mark"
+)
+
+// NFTablesManager keeps all leases in one set and maps of an nftables table,
+// so the kernel does a single lookup per packet regardless of the number of
+// leases. Leases of an external ip are translated by its address, the others
+// by port only. Every update is written as one atomic nft transaction.
+//
+// The accept of the forward chain only ends the chains of this table, a
+// forward chain of another table still drops what it drops. With a forward
+// mark the connections translated to a lease get the ct mark, for those
+// chains to accept.
+type NFTablesManager struct {
+	l                *zap.SugaredLogger
+	nftPath          string
+	table            string
+	forwardMark      uint32
+	trigger          *reconcileTrigger
+	reconcileCloseCh chan interface{}
+	externalIP       net.IP
+	externalIPCh     chan net.IP
+
+	// Model of the programmed elements per set or map, keyed by element key,
+	// only touched from the reconcile goroutine.
+	synced     bool
+	programmed map[string]ruleModel
+	// span is the span of the running reconcile
+	span *span
+}
+
+// nftElements describes the elements of one set or map
+type nftElements struct {
+	name    string
+	keyFn   func(*PortMappingLease) string
+	valueFn func(*PortMappingLease) string
+}
+
+// NewNFTablesManager creates a manager for table, given as "<family> <name>",
+// a forward mark of 0 sets no mark
+func NewNFTablesManager(l *zap.Logger, externalIP net.IP, trigger *reconcileTrigger, table string, forwardMark uint32) (*NFTablesManager, error) {
+	fields := strings.Fields(table)
+	if len(fields) != 2 || (fields[0] != "ip" && fields[0] != "inet") {
+		return nil, fmt.Errorf("nftables table needs to be `ip <name>` or `inet <name>`, got `%s`", table)
+	}
+	nftPath, err := lookupBinary("nft", true)
+	if err != nil {
+		return nil, err
+	}
+	return &NFTablesManager{
+		l:                l.Sugar(),
+		nftPath:          nftPath,
+		table:            fields[0] + " " + fields[1],
+		forwardMark:      forwardMark,
+		trigger:          trigger,
+		externalIPCh:     make(chan net.IP, 1),
+		reconcileCloseCh: make(chan interface{}),
+		externalIP:       externalIP,
+		programmed:       make(map[string]ruleModel),
+	}, nil
+}
+
+func (n *NFTablesManager) CheckPrerequisite(createChains, skipJumpCheck bool) error {
+	var b strings.Builder
+	if createChains {
+		// Our own table with base chains, no jumps are needed
+		b.WriteString(fmt.Sprintf("add table %s\n", n.table))
+		b.WriteString(fmt.Sprintf("add chain %s %s { type filter hook forward priority filter; policy accept; }\n", n.table, chain_port_mapping))
+		b.WriteString(fmt.Sprintf("add chain %s %s { type nat hook prerouting priority dstnat; policy accept; }\n", n.table, chain_port_mapping_prerouting))
+		b.WriteString(fmt.Sprintf("add chain %s %s { type nat hook postrouting priority srcnat; policy accept; }\n", n.table, chain_port_mapping_postrouting))
+		if n.forwardMark != 0 {
+			// After the dnat, so it sees the translated destination
+			b.WriteString(fmt.Sprintf("add chain %s %s { type filter hook prerouting priority dstnat + 1; policy accept; }\n", n.table, chain_port_mapping_mark))
+		}
+	} else {
+		ruleset, err := n.run("", "list", "table", n.table)
+		if err != nil {
+			return fmt.Errorf("%s table is missing: %v", n.table, err)
+		}
+		chains := []string{chain_port_mapping, chain_port_mapping_prerouting, chain_port_mapping_postrouting}
+		if n.forwardMark != 0 {
+			chains = append(chains, chain_port_mapping_mark)
+		}
+		for _, chain := range chains {
+			if !strings.Contains(ruleset, "chain "+chain+" {") {
+				return fmt.Errorf("%s table is missing %s chain", n.table, chain)
+			}
+			// The mark chain is a base chain of its own
+			if !skipJumpCheck && chain != chain_port_mapping_mark && !strings.Contains(ruleset, "jump "+chain) && !strings.Contains(ruleset, "goto "+chain) {
+				return fmt.Errorf("table %s is missing jump to %s", n.table, chain)
+			}
+		}
+	}
+	if n.forwardMark == 0 && !skipJumpCheck {
+		ruleset, err := n.run("", "list", "ruleset")
+		if err != nil {
+			return fmt.Errorf("failed to list ruleset: %v", err)
+		}
+		if dropping := forwardDropChains(ruleset, n.table); len(dropping) > 0 {
+			return fmt.Errorf("forward chains %s of other tables drop the mapped connections accepted by table %s, set a forward mark and accept it there", strings.Join(dropping, ", "), n.table)
+		}
+	}
+
+	b.WriteString(fmt.Sprintf("add set %s %s { type ipv4_addr . inet_proto . inet_service; }\n", n.table, nft_set_forward))
+	b.WriteString(fmt.Sprintf("add map %s %s { type inet_proto . inet_service : ipv4_addr . inet_service; }\n", n.table, nft_map_dnat))
+	b.WriteString(fmt.Sprintf("add map %s %s { type ipv4_addr . inet_proto . inet_service : ipv4_addr . inet_service; }\n", n.table, nft_map_dnat_ip))
+	b.WriteString(fmt.Sprintf("add map %s %s { type ipv4_addr . inet_proto . inet_service : ipv4_addr . inet_service; }\n", n.table, nft_map_snat))
+	b.WriteString(fmt.Sprintf("flush chain %s %s\n", n.table, chain_port_mapping))
+	b.WriteString(fmt.Sprintf("add rule %s %s meta l4proto { tcp, udp } ip daddr . meta l4proto . th dport @%s accept\n", n.table, chain_port_mapping, nft_set_forward))
+	b.WriteString(fmt.Sprintf("flush chain %s %s\n", n.table, chain_port_mapping_prerouting))
+	b.WriteString(fmt.Sprintf("add rule %s %s meta l4proto { tcp, udp } dnat ip addr . port to ip daddr . meta l4proto . th dport map @%s\n", n.table, chain_port_mapping_prerouting, nft_map_dnat_ip))
+	b.WriteString(fmt.Sprintf("add rule %s %s meta l4proto { tcp, udp } dnat ip addr . port to meta l4proto . th dport map @%s\n", n.table, chain_port_mapping_prerouting, nft_map_dnat))
+	b.WriteString(fmt.Sprintf("flush chain %s %s\n", n.table, chain_port_mapping_postrouting))
+	b.WriteString(fmt.Sprintf("add rule %s %s meta l4proto { tcp, udp } snat ip addr . port to ip saddr . meta l4proto . th sport map @%s\n", n.table, chain_port_mapping_postrouting, nft_map_snat))
+	if n.forwardMark != 0 {
+		b.WriteString(fmt.Sprintf("flush chain %s %s\n", n.table, chain_port_mapping_mark))
+		b.WriteString(fmt.Sprintf("add rule %s %s meta l4proto { tcp, udp } ct status dnat ip daddr . meta l4proto . th dport @%s ct mark set ct mark or 0x%x\n", n.table, chain_port_mapping_mark, nft_set_forward, n.forwardMark))
+	}
+
+	if _, err := n.run(b.String(), "-f", "-"); err != nil {
+		return fmt.Errorf("failed to prepare %s table: %v", n.table, err)
+	}
+	return nil
+}
+
+// forwardDropChains returns the forward base chains with a drop policy of the
+// tables other than table in ruleset, the output of nft list ruleset
+func forwardDropChains(ruleset, table string) []string {
+	var dropping []string
+	var current, chain string
+	for _, line := range strings.Split(ruleset, "\n") {
+		fields := strings.Fields(line)
+		switch {
+		case len(fields) >= 3 && fields[0] == "table":
+			current, chain = fields[1]+" "+fields[2], ""
+		case len(fields) >= 2 && fields[0] == "chain":
+			chain = fields[1]
+		case current != table && strings.Contains(line, "hook forward") && strings.Contains(line, "policy drop"):
+			dropping = append(dropping, current+" "+chain)
+		}
+	}
+	return dropping
+}
+
+func (n *NFTablesManager) StartReconcile(leasesFn func() ([]*PortMappingLease, error)) {
+	timer := time.NewTicker(2 * time.Minute)
+	reconcileFn := func(full bool) {
+		n.l.Debug("reconcile nftables")
+		generation := n.trigger.begin()
+		n.span = tracer.start("reconcile.nftables")
+		defer n.span.end()
+		n.span.set(zap.Bool("reconcile.full", full))
+		leases, err := leasesFn()
+		if err == nil && full {
+			err = n.resync(leases)
+		} else if err == nil {
+			err = n.ensureDelta(leases)
+		}
+		n.trigger.done(generation, err)
+	}
+	for {
+		select {
+		case <-timer.C:
+			reconcileFn(true)
+		case <-n.trigger.C():
+			n.trigger.settle()
+			reconcileFn(false)
+		case ip := <-n.externalIPCh:
+			// The nat rules of every lease change
+			n.externalIP = ip
+			reconcileFn(false)
+		case <-n.reconcileCloseCh:
+			return
+		}
+	}
+}
+
+func (n *NFTablesManager) Close() {
+	n.reconcileCloseCh <- true
+}
+
+// Reconcile requests a reconcile without waiting for it
+func (n *NFTablesManager) Reconcile() {
+	n.trigger.Trigger()
+}
+
+// ReconcileAndWait requests a reconcile, the returned channel receives its error
+func (n *NFTablesManager) ReconcileAndWait() <-chan error {
+	return n.trigger.TriggerAndWait()
+}
+
+// SetExternalIP changes the ip the leases are translated to, the rules follow
+// with the reconcile it runs
+func (n *NFTablesManager) SetExternalIP(ip net.IP) {
+	select {
+	case <-n.externalIPCh:
+	default:
+	}
+	n.externalIPCh <- ip
+}
+
+func (n *NFTablesManager) managedElements() []nftElements {
+	return []nftElements{
+		{name: nft_set_forward, keyFn: forwardKey, valueFn: forwardKey},
+		{name: nft_map_dnat, keyFn: dnatKey, valueFn: dnatValue},
+		{name: nft_map_dnat_ip, keyFn: dnatIPKey, valueFn: dnatValue},
+		{name: nft_map_snat, keyFn: snatKey, valueFn: n.snatValue},
+	}
+}
+
+// EnsureMappings replaces the content of the set and the maps in one transaction
+func (n *NFTablesManager) EnsureMappings(leases []*PortMappingLease) error {
+	defer metricEnsureDuration.observe(time.Now(), mapping_engine_nftables, "full", n.table)
+	n.synced = false
+	programmed := make(map[string]ruleModel)
+	var b strings.Builder
+	for _, e := range n.managedElements() {
+		desired := newRuleModel(leases, e.keyFn, e.element)
+		if e.name == nft_set_forward {
+			b.WriteString(fmt.Sprintf("flush set %s %s\n", n.table, e.name))
+		} else {
+			b.WriteString(fmt.Sprintf("flush map %s %s\n", n.table, e.name))
+		}
+		n.writeElements(&b, "add", e.name, desired, 0)
+		programmed[e.name] = desired
+	}
+
+	sp := n.span.child("nftables.replace")
+	_, err := n.run(b.String(), "-f", "-")
+	sp.end()
+	if err != nil {
+		n.l.With(zap.Error(err)).Error("failed to update nftables mappings")
+		return err
+	}
+	n.programmed = programmed
+	n.synced = true
+	return nil
+}
+
+// resync adopts the elements in the kernel as the programmed state and applies
+// only the elements differing from the leases, replacing all elements when
+// they cannot be listed.
+func (n *NFTablesManager) resync(leases []*PortMappingLease) error {
+	if err := n.adopt(); err != nil {
+		n.l.With(zap.Error(err)).Info("not adopting the programmed elements, replacing all elements")
+		return n.EnsureMappings(leases)
+	}
+	return n.ensureDelta(leases)
+}
+
+// adopt lists the set and the maps into the model of the programmed elements
+func (n *NFTablesManager) adopt() error {
+	n.synced = false
+	programmed := make(map[string]ruleModel)
+	for _, e := range n.managedElements() {
+		kind := "map"
+		if e.name == nft_set_forward {
+			kind = "set"
+		}
+		args := append([]string{"list", kind}, strings.Fields(n.table)...)
+		out, err := n.run("", append(args, e.name)...)
+		if err != nil {
+			return err
+		}
+		programmed[e.name] = parseElements(out)
+	}
+	n.programmed = programmed
+	n.synced = true
+	return nil
+}
+
+// parseElements returns the elements listed by nft list set or map, keyed like
+// the elements of the leases
+func parseElements(out string) ruleModel {
+	m := make(ruleModel)
+	start := strings.Index(out, "elements = {")
+	if start < 0 {
+		return m
+	}
+	list := out[start+len("elements = {"):]
+	if end := strings.Index(list, "}"); end >= 0 {
+		list = list[:end]
+	}
+	for _, element := range strings.Split(list, ",") {
+		element = strings.Join(strings.Fields(element), " ")
+		if element == "" {
+			continue
+		}
+		key := element
+		if k := strings.Index(element, " : "); k >= 0 {
+			key = element[:k]
+		}
+		m[key] = []string{element, key}
+	}
+	return m
+}
+
+// ensureDelta only deletes and adds the elements of removed, added and changed
+// leases. Without a model known to match the kernel it resyncs, when applying
+// the delta fails it falls back to EnsureMappings.
+func (n *NFTablesManager) ensureDelta(leases []*PortMappingLease) error {
+	if !n.synced {
+		return n.resync(leases)
+	}
+
+	programmed := make(map[string]ruleModel)
+	changes := 0
+	var deletes, adds strings.Builder
+	for _, e := range n.managedElements() {
+		desired := newRuleModel(leases, e.keyFn, e.element)
+		removed, added := n.programmed[e.name].delta(desired)
+		// The key identifies the element to delete
+		n.writeElements(&deletes, "delete", e.name, removed, 1)
+		n.writeElements(&adds, "add", e.name, added, 0)
+		changes += len(removed) + len(added)
+		programmed[e.name] = desired
+	}
+	if changes == 0 {
+		n.l.Debug("no new changes to nftables mappings")
+		return nil
+	}
+
+	start := time.Now()
+	sp := n.span.child("nftables.apply_delta")
+	sp.set(zap.Int("nftables.changes", changes))
+	_, err := n.run(deletes.String()+adds.String(), "-f", "-")
+	sp.end()
+	metricEnsureDuration.observe(start, mapping_engine_nftables, "delta", n.table)
+	if err != nil {
+		n.l.With(zap.Error(err)).Warn("failed to apply element changes, replacing all elements")
+		return n.EnsureMappings(leases)
+	}
+	n.programmed = programmed
+	n.l.Debugf("applied %d element changes", changes)
+	return nil
+}
+
+// writeElements writes field of the elements in m, in pages
+func (n *NFTablesManager) writeElements(b *strings.Builder, op, name string, m ruleModel, field int) {
+	elements := make([]string, 0, nft_element_page)
+	flush := func() {
+		if len(elements) > 0 {
+			b.WriteString(fmt.Sprintf("%s element %s %s { %s }\n", op, n.table, name, strings.Join(elements, ", ")))
+			elements = elements[:0]
+		}
+	}
+	for _, element := range m {
+		elements = append(elements, element[field])
+		if len(elements) == nft_element_page {
+			flush()
+		}
+	}
+	flush()
+}
+
+// element returns the full element and its key
+func (e nftElements) element(lease *PortMappingLease) []string {
+	key := e.keyFn(lease)
+	value := e.valueFn(lease)
+	if key == value {
+		return []string{key, key}
+	}
+	return []string{key + " : " + value, key}
+}
+
+func forwardKey(lease *PortMappingLease) string {
+	return fmt.Sprintf("%s . %s . %d", lease.ClientIP.To4().String(), lease.Protocol.String(), lease.ClientPort)
+}
+
+// dnatKey is the key of the leases of the primary external ip, dnatIPKey the
+// one of the leases with an external ip
+func dnatKey(lease *PortMappingLease) string {
+	if lease.ExternalIP != nil {
+		return ""
+	}
+	return fmt.Sprintf("%s . %d", lease.Protocol.String(), lease.ExternalPort)
+}
+
+func dnatIPKey(lease *PortMappingLease) string {
+	if lease.ExternalIP == nil {
+		return ""
+	}
+	return fmt.Sprintf("%s . %s . %d", lease.ExternalIP.To4().String(), lease.Protocol.String(), lease.ExternalPort)
+}
+
+func dnatValue(lease *PortMappingLease) string {
+	return fmt.Sprintf("%s . %d", lease.ClientIP.To4().String(), lease.ClientPort)
+}
+
+func snatKey(lease *PortMappingLease) string {
+	return fmt.Sprintf("%s . %s . %d", lease.ClientIP.To4().String(), lease.Protocol.String(), lease.ClientPort)
+}
+
+func (n *NFTablesManager) snatValue(lease *PortMappingLease) string {
+	ip := n.externalIP
+	if lease.ExternalIP != nil {
+		ip = lease.ExternalIP
+	}
+	return fmt.Sprintf("%s . %d", ip.To4().String(), lease.ExternalPort)
+}
+
+func (n *NFTablesManager) run(stdin string, args ...string) (string, error) {
+	metricEngineCommands.with("nft").Add(1)
+	var stdout, stderr bytes.Buffer
+	cmd := exec.Command("sudo", append([]string{n.nftPath}, args...)...)
+	if stdin != "" {
+		cmd.Stdin = strings.NewReader(stdin)
+	}
+	cmd.Stdout = &stdout
+	cmd.Stderr = &stderr
+	if err := cmd.Run(); err != nil {
+		return "", fmt.Errorf("nft %s failed: %v: %s", strings.Join(args, " "), err, stderr.String())
+	}
+	return stdout.String(), nil
+}
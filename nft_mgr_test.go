@@ -0,0 +1,75 @@
+package main
+
+import (
+	"net"
+	"strings"
+	"testing"
+)
+
+func TestForwardDropChains(t *testing.T) {
+	ruleset := `table ip dynport {
+	chain port-mapping {
+		type filter hook forward priority filter; policy accept;
+	}
+}
+table inet filter {
+	chain input {
+		type filter hook input priority filter; policy drop;
+	}
+	chain forward {
+		type filter hook forward priority filter; policy drop;
+		ct state established,related accept
+	}
+}
+table ip nat {
+	chain forward {
+		type filter hook forward priority filter; policy accept;
+	}
+}
+`
+	if got := strings.Join(forwardDropChains(ruleset, "ip dynport"), ", "); got != "inet filter forward" {
+		t.Errorf("forwardDropChains() = %q, want %q", got, "inet filter forward")
+	}
+	if got := forwardDropChains(ruleset, "inet filter"); len(got) != 0 {
+		t.Errorf("forwardDropChains() of own table = %q, want none", got)
+	}
+}
+
+// listElements returns the output of nft list set or map holding the elements
+// of m, wrapped over lines like nft does
+func listElements(name string, m ruleModel) string {
+	var elements []string
+	for _, element := range m {
+		elements = append(elements, element[0])
+	}
+	out := "table ip dynport {\n\tmap " + name + " {\n\t\ttype inet_proto . inet_service : ipv4_addr . inet_service\n"
+	if len(elements) > 0 {
+		out += "\t\telements = { " + strings.Join(elements, ",\n\t\t\t     ") + " }\n"
+	}
+	return out + "\t}\n}\n"
+}
+
+func TestParseElements(t *testing.T) {
+	n := &NFTablesManager{externalIP: net.IPv4(203, 0, 113, 1)}
+	leases := testLeases(3)
+	leases[2] = withExternal(leases[2], net.IPv4(198, 51, 100, 7).To4(), 20000)
+	tests := []struct {
+		name   string
+		leases []*PortMappingLease
+	}{
+		{name: "no elements"},
+		{name: "one element", leases: leases[:1]},
+		{name: "elements over lines", leases: leases},
+	}
+	for _, tt := range tests {
+		t.Run(tt.name, func(t *testing.T) {
+			for _, e := range n.managedElements() {
+				want := newRuleModel(tt.leases, e.keyFn, e.element)
+				got := parseElements(listElements(e.name, want))
+				if len(got) != len(want) || !want.equal(got) {
+					t.Errorf("parseElements() of %s = %q, want %q", e.name, got, want)
+				}
+			}
+		})
+	}
+}
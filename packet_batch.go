@@ -0,0 +1,158 @@
+package main
+
+import (
+	"fmt"
+	"golang.org/x/net/ipv4"
+	"net"
+	"sync"
+)
+
+const receiveBufferSize = 1500
+
+var receiveBufferPool = sync.Pool{
+	New: func() interface{} {
+		b := make([]byte, receiveBufferSize)
+		return &b
+	},
+}
+
+// packetWriter is where responses are written to, the connection itself or a
+// batch of responses sent together.
+type packetWriter interface {
+	WriteTo(b []byte, addr net.Addr) (int, error)
+}
+
+type receivedPacket struct {
+	buf  *[]byte
+	n    int
+	addr net.Addr
+}
+
+// requestBatch is the packets of one read from a socket, handled by one worker
+type requestBatch struct {
+	conn    *ipv4.PacketConn
+	packets []receivedPacket
+}
+
+var requestBatchPool = sync.Pool{
+	New: func() interface{} {
+		return &requestBatch{}
+	},
+}
+
+// release returns the buffers and the batch to their pools
+func (b *requestBatch) release() {
+	for i, pkt := range b.packets {
+		receiveBufferPool.Put(pkt.buf)
+		b.packets[i] = receivedPacket{}
+	}
+	b.packets = b.packets[:0]
+	b.conn = nil
+	requestBatchPool.Put(b)
+}
+
+// batchReader reads up to a batch of packets per syscall (recvmmsg on linux)
+type batchReader struct {
+	conn *ipv4.PacketConn
+	msgs []ipv4.Message
+	bufs []*[]byte
+}
+
+func newBatchReader(conn net.PacketConn, size int) *batchReader {
+	if size < 1 {
+		size = 1
+	}
+	r := &batchReader{
+		conn: ipv4.NewPacketConn(conn),
+		msgs: make([]ipv4.Message, size),
+		bufs: make([]*[]byte, size),
+	}
+	for i := range r.msgs {
+		r.bufs[i] = receiveBufferPool.Get().(*[]byte)
+		r.msgs[i].Buffers = [][]byte{*r.bufs[i]}
+	}
+	return r
+}
+
+// read returns the next batch, the buffers of the batch are owned by the caller until released
+func (r *batchReader) read() (*requestBatch, error) {
+	n, err := r.conn.ReadBatch(r.msgs, 0)
+	if err != nil {
+		return nil, err
+	}
+	batch := requestBatchPool.Get().(*requestBatch)
+	batch.conn = r.conn
+	for i := 0; i < n; i++ {
+		if r.msgs[i].N > 0 {
+			batch.packets = append(batch.packets, receivedPacket{buf: r.bufs[i], n: r.msgs[i].N, addr: r.msgs[i].Addr})
+			r.bufs[i] = receiveBufferPool.Get().(*[]byte)
+			r.msgs[i].Buffers[0] = *r.bufs[i]
+		}
+		r.msgs[i].N = 0
+		r.msgs[i].Addr = nil
+	}
+	return batch, nil
+}
+
+// responseBatch collects the responses of a request batch, sending them with
+// one syscall (sendmmsg on linux) when flushed. A worker reuses its batch, so
+// the messages and response buffers are only allocated while they grow.
+type responseBatch struct {
+	conn  *ipv4.PacketConn
+	msgs  []ipv4.Message
+	arena []byte
+}
+
+// responseBuffer returns a buffer for a response of n bytes to be written to conn
+func responseBuffer(conn packetWriter, n int) []byte {
+	r, ok := conn.(*responseBatch)
+	if !ok {
+		return make([]byte, n)
+	}
+	if len(r.arena)+n > cap(r.arena) {
+		// Buffers handed out before keep the old arena
+		r.arena = make([]byte, 0, 2*cap(r.arena)+n)
+	}
+	b := r.arena[len(r.arena) : len(r.arena)+n : len(r.arena)+n]
+	r.arena = r.arena[:len(r.arena)+n]
+	for i := range b {
+		b[i] = 0
+	}
+	return b
+}
+
+func (r *responseBatch) WriteTo(b []byte, addr net.Addr) (int, error) {
+	if n := len(r.msgs); n < cap(r.msgs) {
+		r.msgs = r.msgs[:n+1]
+		m := &r.msgs[n]
+		m.Buffers = append(m.Buffers[:0], b)
+		m.Addr = addr
+		m.N = 0
+	} else {
+		r.msgs = append(r.msgs, ipv4.Message{Buffers: [][]byte{b}, Addr: addr})
+	}
+	return len(b), nil
+}
+
+func (r *responseBatch) flush() error {
+	msgs := r.msgs
+	defer func() {
+		for i := range r.msgs {
+			r.msgs[i].Addr = nil
+			r.msgs[i].Buffers[0] = nil
+		}
+		r.msgs = r.msgs[:0]
+		r.arena = r.arena[:0]
+	}()
+	for len(msgs) > 0 {
+		n, err := r.conn.WriteBatch(msgs, 0)
+		if err != nil {
+			return err
+		}
+		if n == 0 {
+			return fmt.Errorf("no responses written")
+		}
+		msgs = msgs[n:]
+	}
+	return nil
+}
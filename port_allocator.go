@@ -0,0 +1,476 @@
+package main
+
+import (
+	"fmt"
+	"math/bits"
+	"net"
+	"net/netip"
+	"sort"
+	"strconv"
+	"strings"
+	"sync"
+	"time"
+)
+
+// PortAllocator hands out external ports from the configured range on the
+// external ips. Each protocol and ip has a bitmap of used ports searched word
+// by word from where the last allocation ended. Released ports cool down
+// before they are reused, so a port is not handed to a new client while an
+// old flow may still use it. New ports are taken from the owned part of the
+// range only, see Partition.
+type PortAllocator struct {
+	mu       sync.Mutex
+	start    uint16
+	end      uint16
+	cooldown time.Duration
+	// ips are the external ips, the first one is used by leases without an
+	// external ip. Without ips there is a single pool of the primary ip.
+	ips []netip.Addr
+	// pools are per protocol the pools of the ips, in the order of ips
+	pools map[PROTOCOL][]*portPool
+	// Offsets of the first and last owned port
+	ownedLo int
+	ownedHi int
+}
+
+type portPool struct {
+	used    []uint64
+	inUse   int
+	cursor  int
+	cooling []coolingPort
+	// Release time per cooling port, a queued entry only frees a port with the same release time
+	coolingUntil map[uint16]time.Time
+	exhausted    uint64
+}
+
+type coolingPort struct {
+	port      uint16
+	releaseAt time.Time
+}
+
+// PortPoolStats describes the state of the pools of one protocol over all ips
+type PortPoolStats struct {
+	Size      int
+	Owned     int
+	InUse     int
+	Cooling   int
+	Exhausted uint64
+}
+
+func NewPortAllocator(portRange string, ips []net.IP, cooldown time.Duration) (*PortAllocator, error) {
+	start, end, err := parsePortRange(portRange)
+	if err != nil {
+		return nil, err
+	}
+	a := &PortAllocator{start: start, end: end, cooldown: cooldown, pools: make(map[PROTOCOL][]*portPool)}
+	for _, ip := range ips {
+		addr, ok := netip.AddrFromSlice(ip)
+		if !ok {
+			return nil, fmt.Errorf("invalid external ip %s", ip)
+		}
+		a.ips = append(a.ips, addr.Unmap())
+	}
+	a.ownedHi = a.size() - 1
+	for _, protocol := range []PROTOCOL{TCP, UDP} {
+		for n := 0; n < a.poolCount(); n++ {
+			a.pools[protocol] = append(a.pools[protocol], a.newPool())
+		}
+	}
+	return a, nil
+}
+
+func (a *PortAllocator) poolCount() int {
+	if len(a.ips) == 0 {
+		return 1
+	}
+	return len(a.ips)
+}
+
+// poolIndex returns the pool of the external ip of a lease, -1 for an ip not
+// in the pool
+func (a *PortAllocator) poolIndex(ip net.IP) int {
+	if len(ip) == 0 {
+		return 0
+	}
+	addr, _ := netip.AddrFromSlice(ip)
+	addr = addr.Unmap()
+	for i := range a.ips {
+		if a.ips[i] == addr {
+			return i
+		}
+	}
+	if len(a.ips) == 0 {
+		return 0
+	}
+	return -1
+}
+
+// CanonicalIP returns the external ip of a lease, the primary ip when the
+// lease has none. It is the zero address when the primary ip is detected.
+func (a *PortAllocator) CanonicalIP(ip net.IP) netip.Addr {
+	if len(ip) == 0 {
+		if len(a.ips) == 0 {
+			return netip.Addr{}
+		}
+		return a.ips[0]
+	}
+	addr, _ := netip.AddrFromSlice(ip)
+	return addr.Unmap()
+}
+
+// LeaseIP returns the external ip a lease records. With more than one ip in
+// the pool every lease records its ip, otherwise leases without one follow
+// the primary ip.
+func (a *PortAllocator) LeaseIP(ip net.IP) net.IP {
+	if len(ip) == 0 && len(a.ips) > 1 {
+		return net.IP(a.ips[0].AsSlice())
+	}
+	return ip
+}
+
+// PreferredIP returns the external ip a client without leases is placed on,
+// spreading the clients evenly over the ips by a hash of the client ip. It is
+// the zero address with a single ip.
+func (a *PortAllocator) PreferredIP(client netip.Addr) netip.Addr {
+	if len(a.ips) < 2 {
+		return netip.Addr{}
+	}
+	best, bestHash := 0, uint64(0)
+	c := client.As16()
+	for i, ip := range a.ips {
+		// FNV-1a of the client and the external ip, inline as it is on the
+		// request path
+		h := uint64(fnvOffset64)
+		for _, x := range c {
+			h = (h ^ uint64(x)) * fnvPrime64
+		}
+		for _, x := range ip.As16() {
+			h = (h ^ uint64(x)) * fnvPrime64
+		}
+		if i == 0 || h > bestHash {
+			best, bestHash = i, h
+		}
+	}
+	return a.ips[best]
+}
+
+func parsePortRange(portRange string) (uint16, uint16, error) {
+	r := strings.Split(portRange, "-")
+	if len(r) != 2 {
+		return 0, 0, fmt.Errorf("invalid port range %s", portRange)
+	}
+	start, err := strconv.ParseUint(r[0], 10, 16)
+	if err != nil {
+		return 0, 0, fmt.Errorf("invalid port range %s: %v", portRange, err)
+	}
+	end, err := strconv.ParseUint(r[1], 10, 16)
+	if err != nil {
+		return 0, 0, fmt.Errorf("invalid port range %s: %v", portRange, err)
+	}
+	if start == 0 || start > end {
+		return 0, 0, fmt.Errorf("invalid port range %s", portRange)
+	}
+	return uint16(start), uint16(end), nil
+}
+
+// Partition restricts new allocations to the index-th of count equal slices
+// of the range, so peers each allocating from their own slice never hand out
+// the same port. Ports of all slices are still reserved and released for the
+// leases replicated from peers.
+func (a *PortAllocator) Partition(index, count int) error {
+	a.mu.Lock()
+	defer a.mu.Unlock()
+	return a.partition(index, count)
+}
+
+func (a *PortAllocator) partition(index, count int) error {
+	size := a.size()
+	if count < 1 || index < 0 || index >= count || count > size {
+		return fmt.Errorf("can not partition %d ports into slice %d of %d", size, index, count)
+	}
+	a.ownedLo = size * index / count
+	a.ownedHi = size*(index+1)/count - 1
+	for _, pools := range a.pools {
+		for _, p := range pools {
+			p.cursor = a.ownedLo / 64
+		}
+	}
+	return nil
+}
+
+// Reconfigure changes the range to portRange, owning the slice index of count.
+// Ports used before stay used while in the range, inUse tells the other ports
+// used by leases. Released ports keep cooling down. On error nothing changes.
+// The external ips stay as they are.
+func (a *PortAllocator) Reconfigure(portRange string, index, count int, inUse func(protocol PROTOCOL, ip netip.Addr, port uint16) bool) error {
+	start, end, err := parsePortRange(portRange)
+	if err != nil {
+		return err
+	}
+	a.mu.Lock()
+	defer a.mu.Unlock()
+
+	next := &PortAllocator{start: start, end: end, cooldown: a.cooldown, ips: a.ips, pools: make(map[PROTOCOL][]*portPool)}
+	if err := next.partition(index, count); err != nil {
+		return err
+	}
+	for protocol, pools := range a.pools {
+		for i, old := range pools {
+			var ip netip.Addr
+			if len(a.ips) > 0 {
+				ip = a.ips[i]
+			}
+			p := next.newPool()
+			for port := int(start); port <= int(end); port++ {
+				used := a.inRange(uint16(port)) && old.isUsed(port-int(a.start))
+				if used || inUse(protocol, ip, uint16(port)) {
+					p.set(port - int(start))
+				}
+			}
+			for _, c := range old.cooling {
+				if next.inRange(c.port) {
+					p.cooling = append(p.cooling, c)
+				}
+			}
+			for port, until := range old.coolingUntil {
+				if next.inRange(port) {
+					p.coolingUntil[port] = until
+				}
+			}
+			p.exhausted = old.exhausted
+			p.cursor = next.ownedLo / 64
+			next.pools[protocol] = append(next.pools[protocol], p)
+		}
+	}
+	a.start, a.end, a.pools = next.start, next.end, next.pools
+	a.ownedLo, a.ownedHi = next.ownedLo, next.ownedHi
+	return nil
+}
+
+// partitionIndex returns the slice of the range owned by self and the number
+// of slices, one per node ordered by address, see PortAllocator.Partition.
+func partitionIndex(self string, peers []string) (int, int) {
+	nodes := append([]string{self}, peers...)
+	sort.Strings(nodes)
+	nodes = dedupSorted(nodes)
+	return sort.SearchStrings(nodes, self), len(nodes)
+}
+
+func dedupSorted(s []string) []string {
+	n := 0
+	for i := range s {
+		if i == 0 || s[i] != s[n-1] {
+			s[n] = s[i]
+			n++
+		}
+	}
+	return s[:n]
+}
+
+func (a *PortAllocator) size() int {
+	return int(a.end) - int(a.start) + 1
+}
+
+func (a *PortAllocator) newPool() *portPool {
+	size := a.size()
+	p := &portPool{used: make([]uint64, (size+63)/64), coolingUntil: make(map[uint16]time.Time)}
+	// Bits after the end of the range are marked used, so they are never found free
+	if rest := size % 64; rest != 0 {
+		p.used[len(p.used)-1] = ^uint64(0) << rest
+	}
+	return p
+}
+
+// Allocate returns a free port for protocol and the external ip the lease
+// records, see LeaseIP. The port is taken on the preferred ip while it has
+// one free, otherwise on the ip with the fewest ports in use. suggested is
+// used when it is free on the preferred ip and honorSuggested is set.
+func (a *PortAllocator) Allocate(protocol PROTOCOL, preferred net.IP, suggested uint16, honorSuggested bool) (net.IP, uint16, error) {
+	a.mu.Lock()
+	defer a.mu.Unlock()
+
+	pools := a.pools[protocol]
+	if pools == nil {
+		return nil, 0, fmt.Errorf("unknown protocol %d", protocol)
+	}
+	now := time.Now()
+	for _, p := range pools {
+		a.expireCooling(p, now)
+	}
+	first := a.poolIndex(preferred)
+	if first < 0 {
+		first = 0
+	}
+
+	p := pools[first]
+	if honorSuggested && a.owns(suggested) && !p.isUsed(int(suggested-a.start)) {
+		p.set(int(suggested - a.start))
+		return a.leaseIP(first), suggested, nil
+	}
+	if port, ok := a.allocateIn(p); ok {
+		return a.leaseIP(first), port, nil
+	}
+	// Most free ports first
+	order := make([]int, 0, len(pools))
+	for i := range pools {
+		if i != first {
+			order = append(order, i)
+		}
+	}
+	sort.Slice(order, func(i, j int) bool { return pools[order[i]].inUse < pools[order[j]].inUse })
+	for _, i := range order {
+		if port, ok := a.allocateIn(pools[i]); ok {
+			return a.leaseIP(i), port, nil
+		}
+	}
+
+	cooling := 0
+	for _, p := range pools {
+		p.exhausted++
+		cooling += len(p.coolingUntil)
+	}
+	return nil, 0, fmt.Errorf("no %s port is free in %d-%d on %d ips, %d are cooling down", protocol, int(a.start)+a.ownedLo, int(a.start)+a.ownedHi, len(pools), cooling)
+}
+
+func (a *PortAllocator) leaseIP(pool int) net.IP {
+	if len(a.ips) < 2 {
+		return nil
+	}
+	return net.IP(a.ips[pool].AsSlice())
+}
+
+// allocateIn takes the next free owned port of the pool
+func (a *PortAllocator) allocateIn(p *portPool) (uint16, bool) {
+	first, last := a.ownedLo/64, a.ownedHi/64
+	words := last - first + 1
+	for n := 0; n < words; n++ {
+		w := first + (p.cursor-first+n)%words
+		free := ^p.used[w] & a.ownedMask(w)
+		if free == 0 {
+			continue
+		}
+		bit := bits.TrailingZeros64(free)
+		p.set(w*64 + bit)
+		p.cursor = w
+		return a.start + uint16(w*64+bit), true
+	}
+	return 0, false
+}
+
+// ownedMask returns the bits of the owned ports in word w of a bitmap
+func (a *PortAllocator) ownedMask(w int) uint64 {
+	mask := ^uint64(0)
+	if w == a.ownedLo/64 {
+		mask <<= a.ownedLo % 64
+	}
+	if w == a.ownedHi/64 {
+		mask &= ^uint64(0) >> (63 - a.ownedHi%64)
+	}
+	return mask
+}
+
+// Reserve marks a port used by an existing lease, ports outside the range or
+// on other ips are ignored
+func (a *PortAllocator) Reserve(protocol PROTOCOL, ip net.IP, port uint16) {
+	a.mu.Lock()
+	defer a.mu.Unlock()
+
+	p := a.pool(protocol, ip)
+	if p == nil || !a.inRange(port) {
+		return
+	}
+	if _, ok := p.coolingUntil[port]; ok {
+		// Still marked used, it just should not be freed anymore
+		delete(p.coolingUntil, port)
+		return
+	}
+	if !p.isUsed(int(port - a.start)) {
+		p.set(int(port - a.start))
+	}
+}
+
+// Release returns the port to the pool once it has cooled down
+func (a *PortAllocator) Release(protocol PROTOCOL, ip net.IP, port uint16) {
+	a.mu.Lock()
+	defer a.mu.Unlock()
+
+	p := a.pool(protocol, ip)
+	if p == nil || !a.inRange(port) || !p.isUsed(int(port-a.start)) {
+		return
+	}
+	if _, ok := p.coolingUntil[port]; ok {
+		return
+	}
+	now := time.Now()
+	if a.cooldown <= 0 {
+		p.clear(int(port - a.start))
+		return
+	}
+	p.cooling = append(p.cooling, coolingPort{port: port, releaseAt: now.Add(a.cooldown)})
+	p.coolingUntil[port] = now.Add(a.cooldown)
+	a.expireCooling(p, now)
+}
+
+func (a *PortAllocator) Stats() map[PROTOCOL]PortPoolStats {
+	a.mu.Lock()
+	defer a.mu.Unlock()
+
+	stats := make(map[PROTOCOL]PortPoolStats, len(a.pools))
+	for protocol, pools := range a.pools {
+		s := PortPoolStats{Size: a.size() * len(pools), Owned: (a.ownedHi - a.ownedLo + 1) * len(pools)}
+		for _, p := range pools {
+			a.expireCooling(p, time.Now())
+			s.InUse += p.inUse
+			s.Cooling += len(p.coolingUntil)
+			s.Exhausted += p.exhausted
+		}
+		stats[protocol] = s
+	}
+	return stats
+}
+
+func (a *PortAllocator) pool(protocol PROTOCOL, ip net.IP) *portPool {
+	i := a.poolIndex(ip)
+	if i < 0 || a.pools[protocol] == nil {
+		return nil
+	}
+	return a.pools[protocol][i]
+}
+
+func (a *PortAllocator) inRange(port uint16) bool {
+	return port >= a.start && port <= a.end
+}
+
+func (a *PortAllocator) owns(port uint16) bool {
+	return a.inRange(port) && int(port-a.start) >= a.ownedLo && int(port-a.start) <= a.ownedHi
+}
+
+// expireCooling frees the ports which have cooled down, they are queued in release order
+func (a *PortAllocator) expireCooling(p *portPool, now time.Time) {
+	n := 0
+	for n < len(p.cooling) && !p.cooling[n].releaseAt.After(now) {
+		c := p.cooling[n]
+		if until, ok := p.coolingUntil[c.port]; ok && until.Equal(c.releaseAt) {
+			delete(p.coolingUntil, c.port)
+			p.clear(int(c.port - a.start))
+		}
+		n++
+	}
+	if n > 0 {
+		p.cooling = append(p.cooling[:0], p.cooling[n:]...)
+	}
+}
+
+func (p *portPool) isUsed(i int) bool {
+	return p.used[i/64]&(1<<(i%64)) != 0
+}
+
+func (p *portPool) set(i int) {
+	p.used[i/64] |= 1 << (i % 64)
+	p.inUse++
+}
+
+func (p *portPool) clear(i int) {
+	p.used[i/64] &^= 1 << (i % 64)
+	p.inUse--
+}
@@ -0,0 +1,115 @@
+package main
+
+import (
+	"net"
+	"net/netip"
+	"sync"
+	"time"
+)
+
+const rateLimitShards = 16
+
+// RateLimitOptions limit the requests per client ip with a token bucket of
+// Burst tokens refilled at Rate per second, Rate 0 disables the limit. At most
+// Clients buckets are tracked.
+type RateLimitOptions struct {
+	Rate    float64
+	Burst   int
+	Clients int
+	// Reject answers over limit requests with result code 3 instead of dropping them
+	Reject bool
+}
+
+type tokenBucket struct {
+	tokens float64
+	last   time.Time
+}
+
+// rateLimiter holds the buckets of the clients. Like the request cache every
+// shard keeps two generations, rotated when the current one is full or once a
+// bucket would have refilled completely, so forgetting a bucket of the older
+// generation only forgets a full bucket, unless the table is full.
+type rateLimiter struct {
+	rate     float64
+	burst    float64
+	size     int
+	interval time.Duration
+	shards   [rateLimitShards]rateLimitShard
+}
+
+type rateLimitShard struct {
+	mu       sync.Mutex
+	current  map[netip.Addr]tokenBucket
+	previous map[netip.Addr]tokenBucket
+	rotated  time.Time
+}
+
+func newRateLimiter(o RateLimitOptions) *rateLimiter {
+	if o.Rate <= 0 {
+		return nil
+	}
+	if o.Burst < 1 {
+		o.Burst = 1
+	}
+	// Half of the clients per generation
+	size := o.Clients / rateLimitShards / 2
+	if size < 1 {
+		size = 1
+	}
+	interval := time.Duration(float64(o.Burst) / o.Rate * float64(time.Second))
+	if interval < time.Second {
+		interval = time.Second
+	}
+	return &rateLimiter{rate: o.Rate, burst: float64(o.Burst), size: size, interval: interval}
+}
+
+// allow takes a token from the bucket of the client ip of addr
+func (r *rateLimiter) allow(addr net.Addr, now time.Time) bool {
+	udpAddr, ok := addr.(*net.UDPAddr)
+	if !ok {
+		return true
+	}
+	ip := udpAddr.AddrPort().Addr().Unmap()
+	a := ip.As16()
+	s := &r.shards[(uint32(a[14])<<8|uint32(a[15]))%rateLimitShards]
+
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	r.rotate(s, now)
+	b, ok := s.current[ip]
+	if !ok {
+		if b, ok = s.previous[ip]; !ok {
+			b = tokenBucket{tokens: r.burst, last: now}
+		}
+	}
+	if elapsed := now.Sub(b.last); elapsed > 0 {
+		b.tokens += elapsed.Seconds() * r.rate
+		if b.tokens > r.burst {
+			b.tokens = r.burst
+		}
+		b.last = now
+	}
+	allowed := b.tokens >= 1
+	if allowed {
+		b.tokens--
+	}
+	s.current[ip] = b
+	return allowed
+}
+
+func (r *rateLimiter) rotate(s *rateLimitShard, now time.Time) {
+	if s.current == nil {
+		s.current = make(map[netip.Addr]tokenBucket)
+		s.previous = make(map[netip.Addr]tokenBucket)
+		s.rotated = now
+		return
+	}
+	if now.Sub(s.rotated) < r.interval && len(s.current) < r.size {
+		return
+	}
+	for k := range s.previous {
+		delete(s.previous, k)
+	}
+	s.current, s.previous = s.previous, s.current
+	s.rotated = now
+}
@@ -0,0 +1,70 @@
+package main
+
+import (
+	"go.uber.org/zap"
+	"net/http"
+	"sync/atomic"
+	"time"
+)
+
+// readiness tracks the startup work running in the background while requests
+// are already served from the loaded leases: the first reconcile of the rules,
+// and the first sync with the peers followed by a reconcile.
+type readiness struct {
+	l       *zap.Logger
+	started time.Time
+	rules   atomic.Bool
+	peers   atomic.Bool
+}
+
+func newReadiness(l *zap.Logger) *readiness {
+	return &readiness{l: l, started: time.Now()}
+}
+
+func (r *readiness) rulesApplied() {
+	r.rules.Store(true)
+	r.logReady()
+}
+
+func (r *readiness) peersSynced() {
+	r.peers.Store(true)
+	r.logReady()
+}
+
+func (r *readiness) ready() bool {
+	return r.rules.Load() && r.peers.Load()
+}
+
+func (r *readiness) logReady() {
+	if r.ready() {
+		r.l.Sugar().Infof("ready, rules are in sync %s after start", time.Since(r.started).Round(time.Millisecond))
+	}
+}
+
+// waitRulesApplied requests reconciles until one applies the rules, a failed
+// one is retried after a second
+func waitRulesApplied(l *zap.Logger, ipt MappingEngine) {
+	for {
+		err := <-ipt.ReconcileAndWait()
+		if err == nil {
+			return
+		}
+		l.With(zap.Error(err)).Warn("failed to apply rules, not ready")
+		time.Sleep(time.Second)
+	}
+}
+
+// ServeHTTP answers 200 once ready and 503 before
+func (r *readiness) ServeHTTP(w http.ResponseWriter, req *http.Request) {
+	w.Header().Set("Content-Type", "text/plain; charset=utf-8")
+	switch {
+	case r.ready():
+		w.Write([]byte("ready\n"))
+	case !r.rules.Load():
+		w.WriteHeader(http.StatusServiceUnavailable)
+		w.Write([]byte("applying rules\n"))
+	default:
+		w.WriteHeader(http.StatusServiceUnavailable)
+		w.Write([]byte("syncing with peers\n"))
+	}
+}
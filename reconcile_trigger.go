@@ -0,0 +1,127 @@
+package main
+
+import (
+	"sync"
+	"time"
+)
+
+// reconcileTrigger coalesces reconcile requests into runs of the reconcile
+// goroutine. Requesting never blocks, requests arriving within the debounce
+// window of each other are merged into one run, but a run is never delayed
+// more than maxDelay after the first pending request.
+type reconcileTrigger struct {
+	debounce time.Duration
+	maxDelay time.Duration
+	ch       chan struct{}
+
+	mu        sync.Mutex
+	requested uint64
+	applied   uint64
+	waiters   []reconcileWaiter
+}
+
+type reconcileWaiter struct {
+	generation uint64
+	ch         chan error
+}
+
+func newReconcileTrigger(debounce, maxDelay time.Duration) *reconcileTrigger {
+	if maxDelay < debounce {
+		maxDelay = debounce
+	}
+	return &reconcileTrigger{
+		debounce: debounce,
+		maxDelay: maxDelay,
+		ch:       make(chan struct{}, 1),
+	}
+}
+
+// Trigger marks the rules dirty
+func (t *reconcileTrigger) Trigger() {
+	t.mu.Lock()
+	t.requested++
+	t.mu.Unlock()
+	t.signal()
+}
+
+// TriggerAndWait marks the rules dirty, the returned channel receives the
+// error of the first reconcile started after the call, nil when it applied the
+// rules.
+func (t *reconcileTrigger) TriggerAndWait() <-chan error {
+	ch := make(chan error, 1)
+	t.mu.Lock()
+	t.requested++
+	t.waiters = append(t.waiters, reconcileWaiter{generation: t.requested, ch: ch})
+	t.mu.Unlock()
+	t.signal()
+	return ch
+}
+
+func (t *reconcileTrigger) signal() {
+	select {
+	case t.ch <- struct{}{}:
+	default:
+		// A run is already pending
+	}
+}
+
+// C is signaled when there is a pending request
+func (t *reconcileTrigger) C() <-chan struct{} {
+	return t.ch
+}
+
+// settle waits for the debounce window to pass without new requests, but no
+// longer than maxDelay in total.
+func (t *reconcileTrigger) settle() {
+	first := time.Now()
+	for {
+		wait := t.debounce
+		if remaining := t.maxDelay - time.Since(first); remaining < wait {
+			wait = remaining
+		}
+		if wait <= 0 {
+			return
+		}
+		timer := time.NewTimer(wait)
+		select {
+		case <-t.ch:
+			timer.Stop()
+		case <-timer.C:
+			return
+		}
+	}
+}
+
+// pending returns the number of requests not covered by a successful run
+func (t *reconcileTrigger) pending() uint64 {
+	t.mu.Lock()
+	defer t.mu.Unlock()
+	return t.requested - t.applied
+}
+
+// begin returns the generation of requests covered by a run starting now
+func (t *reconcileTrigger) begin() uint64 {
+	t.mu.Lock()
+	defer t.mu.Unlock()
+	return t.requested
+}
+
+// done releases the waiters covered by the run started at generation with its
+// error, only a successful run applies the requests
+func (t *reconcileTrigger) done(generation uint64, err error) {
+	t.mu.Lock()
+	defer t.mu.Unlock()
+	if err == nil && generation > t.applied {
+		t.applied = generation
+	}
+	pending := t.waiters[:0]
+	for _, w := range t.waiters {
+		if w.generation <= generation {
+			w.ch <- err
+			close(w.ch)
+		} else {
+			pending = append(pending, w)
+		}
+	}
+	t.waiters = pending
+}
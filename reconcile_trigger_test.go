@@ -0,0 +1,28 @@
+package main
+
+import (
+	"fmt"
+	"testing"
+	"time"
+)
+
+func TestReconcileTriggerFailedRun(t *testing.T) {
+	trigger := newReconcileTrigger(time.Millisecond, time.Millisecond)
+	failed := trigger.TriggerAndWait()
+	trigger.done(trigger.begin(), fmt.Errorf("iptables failed"))
+	if err := <-failed; err == nil {
+		t.Error("waiter of a failed reconcile got no error")
+	}
+	if pending := trigger.pending(); pending != 1 {
+		t.Errorf("pending() after a failed reconcile = %d, want 1", pending)
+	}
+
+	applied := trigger.TriggerAndWait()
+	trigger.done(trigger.begin(), nil)
+	if err := <-applied; err != nil {
+		t.Errorf("waiter of a successful reconcile got %v", err)
+	}
+	if pending := trigger.pending(); pending != 0 {
+		t.Errorf("pending() after a successful reconcile = %d, want 0", pending)
+	}
+}
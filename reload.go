@@ -0,0 +1,102 @@
+package main
+
+import (
+	"fmt"
+	"github.com/spf13/cobra"
+	"go.uber.org/zap"
+	"net"
+	"os"
+	"os/signal"
+	"syscall"
+)
+
+// configReloader applies a changed configuration on SIGHUP. Only the ACL, the
+// port range and the replication peers are reloaded, the sockets, the rules
+// and everything else keep the configuration the server started with.
+type configReloader struct {
+	l           *zap.Logger
+	cmd         *cobra.Command
+	server      *DynPortServer
+	ports       *PortAllocator
+	store       *DataStore
+	replication *Replication
+}
+
+func (c *configReloader) run() {
+	hup := make(chan os.Signal, 1)
+	signal.Notify(hup, syscall.SIGHUP)
+	for range hup {
+		if err := c.reload(); err != nil {
+			c.l.With(zap.Error(err)).Error("failed to reload configuration, keeping the current one")
+		}
+	}
+}
+
+// reload validates the whole configuration before swapping in any of it, an
+// invalid configuration changes nothing.
+func (c *configReloader) reload() error {
+	next, err := loadConfig(c.cmd)
+	if err != nil {
+		return fmt.Errorf("invalid configuration: %v", err)
+	}
+	if _, err := compileACL(next.ACL); err != nil {
+		return fmt.Errorf("invalid acl: %v", err)
+	}
+	index, count, err := portPartition(&next)
+	if err != nil {
+		return err
+	}
+
+	if err := c.ports.Reconfigure(next.PortRange, index, count, c.store.IsExternalPortInUse); err != nil {
+		return fmt.Errorf("invalid port range: %v", err)
+	}
+	if err := c.server.SetACL(next.ACL, next.ACLAllowDefault); err != nil {
+		return err
+	}
+	added, removed := c.replication.SetPeers(replicationPeers(&next))
+	c.l.Sugar().Infof("reloaded configuration, %d acl entries, port range %s slice %d of %d, peers added %v removed %v",
+		len(next.ACL), next.PortRange, index+1, count, added, removed)
+	return nil
+}
+
+// portPartition returns the slice of the port range this node owns and the
+// number of slices, see PortAllocator.Partition. Every node needs to find
+// itself at its own position, so the peers list all nodes the same way on
+// every node and the advertise address is one of them, as written there.
+func portPartition(c *Configuration) (int, int, error) {
+	if !c.PortPartitioning || len(c.ReplicationPeers) == 0 {
+		return 0, 1, nil
+	}
+	self := advertiseAddr(c)
+	host, _, err := net.SplitHostPort(self)
+	if err != nil || host == "" || host == "localhost" {
+		return 0, 0, fmt.Errorf("port partitioning needs the address peers know this node by, set replication-advertise-addr")
+	}
+	if ip := net.ParseIP(host); ip != nil && (ip.IsUnspecified() || ip.IsLoopback()) {
+		return 0, 0, fmt.Errorf("port partitioning needs the address peers know this node by, %s is not one, set replication-advertise-addr", self)
+	}
+	if !contains(c.ReplicationPeers, self) {
+		return 0, 0, fmt.Errorf("port partitioning needs the replication peers to list all nodes including this one, %s is not listed", self)
+	}
+	index, count := partitionIndex(self, c.ReplicationPeers)
+	return index, count, nil
+}
+
+func advertiseAddr(c *Configuration) string {
+	if c.ReplicationAdvertiseAddr != "" {
+		return c.ReplicationAdvertiseAddr
+	}
+	return c.ReplicationListenAddr
+}
+
+// replicationPeers returns the peers to replicate with, without this node
+func replicationPeers(c *Configuration) []string {
+	self := advertiseAddr(c)
+	peers := make([]string, 0, len(c.ReplicationPeers))
+	for _, peer := range c.ReplicationPeers {
+		if peer != self {
+			peers = append(peers, peer)
+		}
+	}
+	return peers
+}
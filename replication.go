@@ -1,18 +1,22 @@
 package main
 
 import (
-	"bytes"
 	"encoding/json"
 	"fmt"
 	"github.com/gin-gonic/gin"
 	"github.com/go-http-utils/headers"
 	"go.uber.org/zap"
 	"go.uber.org/zap/zapcore"
+	"io"
 	"net"
 	"net/http"
+	"net/url"
 	"os"
 	"runtime/debug"
+	"strconv"
 	"strings"
+	"sync"
+	"sync/atomic"
 	"time"
 )
 
@@ -23,24 +27,103 @@ type Replication struct {
 
 	client     http.Client
 	listenAddr string
-	peers      []string
-	secret     string
-	listeners  []func()
+	// advertiseAddr is this node as listed in the peers of the other nodes
+	advertiseAddr string
+	secret        string
+	listeners     []func()
+	// queues has one queue per peer, replaced as a whole by SetPeers
+	queues    atomic.Pointer[[]*peerQueue]
+	peersMu   sync.Mutex
+	started   bool
+	queueSize int
+	batchSize int
+
+	changes   *changeLog
+	heartbeat time.Duration
+	// Without timeout, change streams are long lived and end on missed heartbeats
+	streamClient http.Client
+	streamingMu  sync.Mutex
+	streaming    map[string]int
 }
 
-func NewReplication(l *zap.Logger, store *DataStore, listenAddr, secret string, peers []string) *Replication {
+func NewReplication(l *zap.Logger, store *DataStore, listenAddr, advertiseAddr, secret string, peers []string, queueSize, batchSize, changeLogSize int, heartbeat time.Duration) *Replication {
 	gin.SetMode("release")
 	g := gin.New()
+	// Peers connect directly, forwarded headers are not trusted
+	g.SetTrustedProxies(nil)
 	g.Use(ginzapWithRecovery(l, zapcore.DebugLevel))
 
 	g.Use(gin.BasicAuth(map[string]string{
 		"repl": secret,
 	}))
+	// Only authenticated requests continue the trace of a peer
+	g.Use(traceRequests())
 
+	transport := &http.Transport{
+		Proxy:               http.ProxyFromEnvironment,
+		MaxIdleConnsPerHost: 4,
+		IdleConnTimeout:     90 * time.Second,
+	}
 	client := http.Client{
-		Timeout: 5 * time.Second,
+		Timeout:   5 * time.Second,
+		Transport: transport,
+	}
+	r := &Replication{
+		l: l, g: g, store: store, client: client, listenAddr: listenAddr, advertiseAddr: advertiseAddr, secret: secret,
+		queueSize: queueSize, batchSize: batchSize,
+		changes:      newChangeLog(changeLogSize),
+		heartbeat:    heartbeat,
+		streamClient: http.Client{Transport: transport},
+		streaming:    make(map[string]int),
+	}
+	queues := make([]*peerQueue, 0, len(peers))
+	for _, peer := range peers {
+		queues = append(queues, newPeerQueue(r, peer, queueSize, batchSize))
 	}
-	return &Replication{l: l, g: g, store: store, client: client, listenAddr: listenAddr, peers: peers, secret: secret}
+	r.queues.Store(&queues)
+	return r
+}
+
+// peerQueues returns the queues of the current peers
+func (r *Replication) peerQueues() []*peerQueue {
+	return *r.queues.Load()
+}
+
+// SetPeers replaces the peers, the queues and change streams of removed peers
+// stop and new peers get theirs. Peers kept keep their queue and stream.
+func (r *Replication) SetPeers(peers []string) (added, removed []string) {
+	r.peersMu.Lock()
+	defer r.peersMu.Unlock()
+
+	current := make(map[string]*peerQueue)
+	for _, q := range r.peerQueues() {
+		current[q.peer] = q
+	}
+	queues := make([]*peerQueue, 0, len(peers))
+	for _, peer := range peers {
+		if q, ok := current[peer]; ok {
+			queues = append(queues, q)
+			delete(current, peer)
+			continue
+		}
+		q := newPeerQueue(r, peer, r.queueSize, r.batchSize)
+		queues = append(queues, q)
+		added = append(added, peer)
+		if r.started {
+			r.startPeer(q)
+		}
+	}
+	r.queues.Store(&queues)
+	for peer, q := range current {
+		close(q.stop)
+		removed = append(removed, peer)
+	}
+	return added, removed
+}
+
+func (r *Replication) startPeer(q *peerQueue) {
+	go q.run()
+	go r.followChanges(q.peer, q.stop)
 }
 
 func (r *Replication) Start() {
@@ -49,6 +132,12 @@ func (r *Replication) Start() {
 		return
 	}
 	r.setupHandlers()
+	r.peersMu.Lock()
+	r.started = true
+	for _, q := range r.peerQueues() {
+		r.startPeer(q)
+	}
+	r.peersMu.Unlock()
 	go func() {
 		err := r.g.Run(r.listenAddr)
 		if err != nil {
@@ -67,122 +156,282 @@ func (r *Replication) sendUpdate() {
 	}
 }
 
-func (r *Replication) RunFullSync() {
+// RunSync pulls from every peer the leases differing from the local ones, the
+// digests of the stores are compared to only transfer the differing buckets.
+// Listeners are only signaled when a lease changed.
+func (r *Replication) RunSync() {
 	if r.listenAddr == "" {
 		return
 	}
-	for _, peer := range r.peers {
-		u := fmt.Sprintf("http://%s/leases", peer)
-		req, err := http.NewRequest("GET", u, nil)
+	changed := false
+	for _, q := range r.peerQueues() {
+		if r.syncFrom(q.peer) {
+			changed = true
+		}
+	}
+	if changed {
+		r.sendUpdate()
+	}
+}
+
+func (r *Replication) syncFrom(peer string) bool {
+	sp := tracer.start("replication.sync")
+	defer sp.end()
+	sp.set(zap.String("replication.peer", peer))
+
+	u := fmt.Sprintf("http://%s/leases/digest", peer)
+	var digest leaseDigest
+	status, err := r.get(sp, u, &digest)
+	if err != nil {
+		r.l.With(zap.Error(err), zap.String("url.origin", u)).Warn("failed to get lease digest")
+		return false
+	}
+
+	query := url.Values{}
+	switch status {
+	case 200:
+		local := r.store.Digest()
+		buckets := make([]string, 0)
+		for i := range digest {
+			if digest[i] != local[i] {
+				buckets = append(buckets, strconv.Itoa(i))
+			}
+		}
+		if len(buckets) == 0 {
+			return false
+		}
+		r.l.Sugar().Debugf("%d lease buckets differ from %s", len(buckets), peer)
+		query.Set("buckets", strings.Join(buckets, ","))
+	case http.StatusNotFound:
+		// The peer does not support digests, pull all leases
+	default:
+		r.l.With(zap.String("url.origin", u), zap.Int("http.response.status_code", status)).Warn("unexpected response status code")
+		return false
+	}
+	return r.pullLeases(sp, peer, query)
+}
+
+// get decodes the json response to v when the status code is 200
+func (r *Replication) get(sp *span, u string, v interface{}) (status int, err error) {
+	sp = sp.child("replication.get")
+	defer sp.end()
+	start := time.Now()
+	defer func() {
+		outcome := strconv.Itoa(status)
 		if err != nil {
-			r.l.With(zap.Error(err), zap.String("url.origin", u)).Warn("failed to create request for getting leases")
-			continue
+			outcome = "error"
 		}
-		req.Header.Set(headers.Accept, "application/json")
-		req.SetBasicAuth("repl", r.secret)
+		metricReplicationDuration.observe(start, "sync", outcome)
+	}()
 
-		response, err := r.client.Do(req)
+	response, err := r.request(sp, u, "application/json")
+	if err != nil {
+		return 0, err
+	}
+	defer func() {
+		io.Copy(io.Discard, response.Body)
+		response.Body.Close()
+	}()
+
+	if response.StatusCode != 200 {
+		return response.StatusCode, nil
+	}
+	if err := json.NewDecoder(response.Body).Decode(v); err != nil {
+		return 0, err
+	}
+	return response.StatusCode, nil
+}
+
+// getLeases calls fn with every lease of the response as it is read when the
+// status code is 200, leases may be answered in the binary encoding. It
+// returns the cursor of the next page, if any.
+func (r *Replication) getLeases(sp *span, u string, fn func(lease *PortMappingLease)) (status int, next string, err error) {
+	sp = sp.child("replication.get_leases")
+	defer sp.end()
+	start := time.Now()
+	defer func() {
+		outcome := strconv.Itoa(status)
 		if err != nil {
-			r.l.With(zap.Error(err), zap.String("url.origin", u)).Warn("failed to get leases")
-			continue
+			outcome = "error"
 		}
-		defer response.Body.Close()
+		metricReplicationDuration.observe(start, "sync", outcome)
+	}()
 
-		if response.StatusCode != 200 {
-			r.l.With(zap.String("url.origin", u)).Warn("unexpected response status code")
-			continue
+	response, err := r.request(sp, u, leaseContentTypeV2+", application/json;q=0.9")
+	if err != nil {
+		return 0, "", err
+	}
+	defer func() {
+		io.Copy(io.Discard, response.Body)
+		response.Body.Close()
+	}()
+
+	if response.StatusCode != 200 {
+		return response.StatusCode, "", nil
+	}
+	next = response.Header.Get(nextCursorHeader)
+	if strings.HasPrefix(response.Header.Get(headers.ContentType), leaseContentType) {
+		lr := newLeaseReader(response.Body)
+		for {
+			var lease PortMappingLease
+			if err := lr.next(&lease); err == io.EOF {
+				return response.StatusCode, next, nil
+			} else if err != nil {
+				return 0, "", err
+			}
+			fn(&lease)
 		}
-		var leases []PortMappingLease
-		err = json.NewDecoder(response.Body).Decode(&leases)
-		if err != nil {
-			r.l.With(zap.Error(err), zap.String("url.origin", u)).Warn("failed to get leases")
-			continue
+	}
+	dec := json.NewDecoder(response.Body)
+	if _, err := dec.Token(); err != nil {
+		return 0, "", err
+	}
+	for dec.More() {
+		var lease PortMappingLease
+		if err := dec.Decode(&lease); err != nil {
+			return 0, "", err
 		}
-		for _, lease := range leases {
-			err := r.store.UpsertLease(&lease)
-			if err != nil {
-				r.l.With(zap.Error(err), zap.String("url.origin", u)).Warn("failed to upsert lease")
-				continue
+		fn(&lease)
+	}
+	return response.StatusCode, next, nil
+}
+
+// request runs a replication GET request to u as part of the trace of sp
+func (r *Replication) request(sp *span, u, accept string) (response *http.Response, err error) {
+	req, err := http.NewRequest("GET", u, nil)
+	if err != nil {
+		return nil, err
+	}
+	sp.set(zap.String("url.full", u))
+	sp.inject(req.Header)
+	req.Header.Set(headers.Accept, accept)
+	req.SetBasicAuth("repl", r.secret)
+	return r.client.Do(req)
+}
+
+// bindLeases parses a body of json or binary encoded leases, aborting the
+// request when it can not be parsed.
+func (r *Replication) bindLeases(c *gin.Context, v interface{}) ([]PortMappingLease, bool) {
+	if strings.HasPrefix(c.ContentType(), leaseContentType) {
+		body, err := io.ReadAll(c.Request.Body)
+		if err == nil {
+			var leases []PortMappingLease
+			if leases, err = decodeLeases(body); err == nil {
+				return leases, true
 			}
 		}
+		r.l.With(zap.Error(err)).Warn("failed to parse body to leases")
+		c.AbortWithStatus(400)
+		return nil, false
+	}
+	if !strings.HasPrefix(c.ContentType(), "application/json") {
+		c.AbortWithStatus(http.StatusUnsupportedMediaType)
+		return nil, false
+	}
+	if err := c.BindJSON(v); err != nil {
+		r.l.With(zap.Error(err)).Warn("failed to parse body to leases")
+		c.AbortWithStatus(400)
+		return nil, false
+	}
+	switch v := v.(type) {
+	case *PortMappingLease:
+		return []PortMappingLease{*v}, true
+	case *[]PortMappingLease:
+		return *v, true
 	}
-	r.sendUpdate()
+	return nil, false
 }
 
-func (r *Replication) setupHandlers() {
-	g := r.g
-	g.GET("/leases", func(c *gin.Context) {
-		leases, err := r.store.GetLeases()
+// mergeLeases merges replicated leases, signaling the listeners when any changed
+func (r *Replication) mergeLeases(c *gin.Context, leases []PortMappingLease) {
+	sp := requestSpan(c).child("store.merge")
+	defer sp.end()
+	changed := false
+	for i := range leases {
+		merged, err := r.store.MergeLease(&leases[i])
+		if _, ok := err.(*externalPortUsedError); ok {
+			// Pushing it again fails the same way, the batch goes on
+			metricReplicationRejected.with("external_port_used").Add(1)
+			r.l.With(zap.Error(err), zap.String("lease.id", leases[i].Id)).Warn("rejected lease of peer")
+			continue
+		}
 		if err != nil {
-			c.Error(err)
+			r.l.With(zap.Error(err)).Warn("failed to update lease")
 			c.AbortWithStatus(500)
 			return
 		}
+		changed = changed || merged
+	}
+	if changed {
+		r.sendUpdate()
+	}
+}
 
-		c.JSON(200, leases)
+func (r *Replication) setupHandlers() {
+	g := r.g
+	g.GET("/leases", r.exportLeases)
+	g.GET("/leases/digest", func(c *gin.Context) {
+		c.JSON(200, r.store.Digest())
 	})
+	g.GET("/leases/stream", r.streamChanges)
 	g.PUT("/leases/:id", func(c *gin.Context) {
-		if !strings.HasPrefix(c.ContentType(), "application/json") {
-			c.AbortWithStatus(400)
-			return
-		}
-
 		var lease PortMappingLease
-
-		err := c.BindJSON(&lease)
-		if err != nil {
-			r.l.With(zap.Error(err)).Warn("failed to parse body to lease")
-			c.AbortWithStatus(400)
+		leases, ok := r.bindLeases(c, &lease)
+		if !ok {
 			return
 		}
-
-		err = r.store.UpsertLease(&lease)
-		if err != nil {
-			r.l.With(zap.Error(err)).Warn("failed to update lease")
-			c.AbortWithStatus(500)
+		r.mergeLeases(c, leases)
+	})
+	g.POST("/leases/batch", func(c *gin.Context) {
+		// The pushing peer sends the newest layout read here from then on
+		c.Header(acceptPostHeader, leaseContentTypeV2+", application/json")
+		var batch []PortMappingLease
+		leases, ok := r.bindLeases(c, &batch)
+		if !ok {
 			return
 		}
-		r.sendUpdate()
+		r.mergeLeases(c, leases)
 	})
 }
 
-func (r *Replication) PortMappingLeaseListener(lease PortMappingLease) {
+// PortMappingLeaseListener adds the lease to the change stream and queues it to
+// be pushed to the peers not following the stream, it does not block. The push
+// continues the trace of the request.
+func (r *Replication) PortMappingLeaseListener(lease PortMappingLease, trace spanContext) {
 	if r.listenAddr == "" {
 		return
 	}
-	r.l.Sugar().Debug("received update for lease %s", lease.Id)
-	jsonBytes, err := json.Marshal(lease)
-	if err != nil {
-		r.l.With(zap.Error(err)).Warn("failed to marshal lease")
-		return
+	r.l.Sugar().Debugf("received update for lease %s", lease.Id)
+	r.changes.append(lease)
+	for _, q := range r.peerQueues() {
+		q.enqueue(lease, trace)
 	}
+}
 
-	for _, peer := range r.peers {
-
-		u := fmt.Sprintf("http://%s/leases/%s", peer, lease.Id)
-		req, err := http.NewRequest("PUT", u, bytes.NewReader(jsonBytes))
-		if err != nil {
-			r.l.With(zap.Error(err), zap.String("url.origin", u)).Warn("failed to create request for putting lease")
-			continue
-		}
-		req.Header.Set(headers.ContentType, "application/json")
-		req.SetBasicAuth("repl", r.secret)
-
-		response, err := r.client.Do(req)
-		if err != nil {
-			r.l.With(zap.Error(err), zap.String("url.origin", u)).Warn("failed to put lease")
-			continue
-		}
-		defer response.Body.Close()
+const spanKey = "span"
 
-		if response.StatusCode != 200 {
-			r.l.With(zap.String("url.origin", u), zap.Int("http.response.status_code", response.StatusCode)).
-				Warn("unexpected response status code")
-			continue
+// traceRequests gives every request a span, continuing the trace of the peer
+func traceRequests() gin.HandlerFunc {
+	return func(c *gin.Context) {
+		sp := tracer.startRemote("replication.serve", c.GetHeader(traceparentHeader))
+		if sp == nil {
+			c.Next()
+			return
 		}
+		c.Set(spanKey, sp)
+		c.Next()
+		sp.set(zap.String("http.request.method", c.Request.Method), zap.String("url.path", c.Request.URL.Path), zap.Int("http.response.status_code", c.Writer.Status()))
+		sp.end()
 	}
 }
 
+// requestSpan returns the span of the request, nil when it is not traced
+func requestSpan(c *gin.Context) *span {
+	v, _ := c.Get(spanKey)
+	sp, _ := v.(*span)
+	return sp
+}
+
 func ginzapWithRecovery(logger *zap.Logger, accessLogLevel zapcore.Level) gin.HandlerFunc {
 	return func(c *gin.Context) {
 		start := time.Now()
@@ -0,0 +1,208 @@
+package main
+
+import (
+	"bufio"
+	"encoding/json"
+	"fmt"
+	"github.com/gin-gonic/gin"
+	"github.com/go-http-utils/headers"
+	"go.uber.org/zap"
+	"net/http"
+	"net/url"
+	"strconv"
+	"strings"
+	"time"
+)
+
+const (
+	ndjsonContentType = "application/x-ndjson"
+	// acceptPostHeader tells the media types a peer reads from lease pushes
+	acceptPostHeader = "Accept-Post"
+	// nextCursorHeader tells the cursor of the next page of an export
+	nextCursorHeader = "X-Next-Cursor"
+	// exportBufferSize is the output buffered before it is written to the peer
+	exportBufferSize = 64 << 10
+	// syncPageSize is the leases pulled per request when syncing, so a sync
+	// of a large table is not bound by the request timeout
+	syncPageSize = 5000
+)
+
+// exportLeases serves GET /leases. The leases are written while they are
+// exported from the store, in the binary encoding, as newline delimited json
+// or as json array, so neither side holds all of them at once. The query
+// narrows the export:
+//
+//	buckets         digest buckets, comma separated
+//	modified_since  leases last seen at or after the time, RFC 3339
+//	limit, cursor   pages of up to limit leases, a page that may be followed
+//	                by another tells its cursor in the X-Next-Cursor header
+func (r *Replication) exportLeases(c *gin.Context) {
+	var filters []func(lease *PortMappingLease) bool
+	if q := c.Query("buckets"); q != "" {
+		buckets := make(map[int]bool)
+		for _, s := range strings.Split(q, ",") {
+			b, err := strconv.Atoi(s)
+			if err != nil || b < 0 || b >= digestBuckets {
+				c.AbortWithStatus(400)
+				return
+			}
+			buckets[b] = true
+		}
+		filters = append(filters, func(lease *PortMappingLease) bool { return buckets[leaseBucket(lease.Id)] })
+	}
+	if q := c.Query("modified_since"); q != "" {
+		since, err := time.Parse(time.RFC3339Nano, q)
+		if err != nil {
+			c.AbortWithStatus(400)
+			return
+		}
+		filters = append(filters, func(lease *PortMappingLease) bool { return !lease.LastSeen.Before(since) })
+	}
+	limit := 0
+	if q := c.Query("limit"); q != "" {
+		n, err := strconv.Atoi(q)
+		if err != nil || n < 1 {
+			c.AbortWithStatus(400)
+			return
+		}
+		limit = n
+	}
+	var cursor LeaseCursor
+	if q := c.Query("cursor"); q != "" {
+		var err error
+		if cursor, err = parseLeaseCursor(q); err != nil {
+			c.AbortWithStatus(400)
+			return
+		}
+	}
+	var filter func(lease *PortMappingLease) bool
+	if len(filters) > 0 {
+		filter = func(lease *PortMappingLease) bool {
+			for _, f := range filters {
+				if !f(lease) {
+					return false
+				}
+			}
+			return true
+		}
+	}
+
+	format := c.NegotiateFormat(leaseContentType, ndjsonContentType, "application/json")
+	if format == "" {
+		format = "application/json"
+	}
+	// Binary leases in the newest layout the peer reads
+	version := leaseMediaVersion(c.GetHeader(headers.Accept))
+	contentType := format
+	if format == leaseContentType {
+		contentType = leaseMediaType(version)
+	}
+	if limit > 0 {
+		// The page is collected first, its header tells the cursor of the next
+		page := make([]PortMappingLease, 0, limit)
+		next, more, _ := r.store.ExportLeases(cursor, limit, filter, func(lease *PortMappingLease) error {
+			page = append(page, *lease)
+			return nil
+		})
+		if more {
+			c.Header(nextCursorHeader, next.String())
+		}
+		c.Header(headers.ContentType, contentType)
+		c.Status(200)
+		enc := newLeaseEncoder(c.Writer, format, version)
+		for i := range page {
+			if err := enc.write(&page[i]); err != nil {
+				return
+			}
+		}
+		enc.close()
+		return
+	}
+
+	c.Header(headers.ContentType, contentType)
+	c.Status(200)
+	enc := newLeaseEncoder(c.Writer, format, version)
+	_, _, err := r.store.ExportLeases(cursor, 0, filter, enc.write)
+	if err == nil {
+		err = enc.close()
+	}
+	if err != nil {
+		r.l.With(zap.Error(err), zap.String("client.ip", c.ClientIP())).Debug("failed to export leases")
+	}
+}
+
+// leaseEncoder writes leases in the format of the export, binary leases in a
+// layout up to version
+type leaseEncoder struct {
+	w       *bufio.Writer
+	format  string
+	version byte
+	json    *json.Encoder
+	buf     []byte
+	n       int
+}
+
+func newLeaseEncoder(w http.ResponseWriter, format string, version byte) *leaseEncoder {
+	bw := bufio.NewWriterSize(w, exportBufferSize)
+	return &leaseEncoder{w: bw, format: format, version: version, json: json.NewEncoder(bw)}
+}
+
+func (e *leaseEncoder) write(lease *PortMappingLease) error {
+	e.n++
+	switch e.format {
+	case leaseContentType:
+		e.buf = appendLeaseVersion(e.buf[:0], lease, e.version)
+		_, err := e.w.Write(e.buf)
+		return err
+	case ndjsonContentType:
+		return e.json.Encode(lease)
+	}
+	sep := byte(',')
+	if e.n == 1 {
+		sep = '['
+	}
+	if err := e.w.WriteByte(sep); err != nil {
+		return err
+	}
+	return e.json.Encode(lease)
+}
+
+func (e *leaseEncoder) close() error {
+	if e.format == "application/json" {
+		if e.n == 0 {
+			e.w.WriteByte('[')
+		}
+		e.w.WriteByte(']')
+	}
+	return e.w.Flush()
+}
+
+// pullLeases pulls the leases of the query from the peer page by page,
+// merging them as they are read. It returns whether a lease changed.
+func (r *Replication) pullLeases(sp *span, peer string, query url.Values) bool {
+	query.Set("limit", strconv.Itoa(syncPageSize))
+	changed := false
+	for {
+		u := fmt.Sprintf("http://%s/leases?%s", peer, query.Encode())
+		status, next, err := r.getLeases(sp, u, func(lease *PortMappingLease) {
+			merged, err := r.store.MergeLease(lease)
+			if err != nil {
+				r.l.With(zap.Error(err), zap.String("url.origin", u)).Warn("failed to upsert lease")
+				return
+			}
+			changed = changed || merged
+		})
+		if err != nil {
+			r.l.With(zap.Error(err), zap.String("url.origin", u)).Warn("failed to get leases")
+			return changed
+		}
+		if status != 200 {
+			r.l.With(zap.String("url.origin", u), zap.Int("http.response.status_code", status)).Warn("unexpected response status code")
+			return changed
+		}
+		if next == "" {
+			return changed
+		}
+		query.Set("cursor", next)
+	}
+}
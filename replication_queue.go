@@ -0,0 +1,301 @@
+package main
+
+import (
+	"bytes"
+	"encoding/json"
+	"fmt"
+	"github.com/go-http-utils/headers"
+	"go.uber.org/zap"
+	"io"
+	"net/http"
+	"strconv"
+	"sync"
+	"time"
+)
+
+const (
+	replicationRetryMin = 100 * time.Millisecond
+	replicationRetryMax = 30 * time.Second
+)
+
+// peerQueue holds the lease updates not yet pushed to one peer. Updates of the
+// same lease are coalesced, so the queue holds at most one update per lease.
+// When it is full updates are dropped and the peer is marked dirty, it then
+// gets all leases pushed once it is reachable again.
+type peerQueue struct {
+	l         *zap.Logger
+	r         *Replication
+	peer      string
+	maxSize   int
+	batchSize int
+
+	mu      sync.Mutex
+	pending map[string]PortMappingLease
+	// trace is the first traced request of the pending updates
+	trace spanContext
+	dirty bool
+	// The peer does not know POST /leases/batch, it gets one PUT per lease
+	legacy bool
+	// The peer does not know the binary lease encoding, it gets json
+	jsonOnly bool
+	// leaseVersion is the newest binary layout the peer advertised, until it
+	// advertises version 2 leases with an external ip are sent as json
+	leaseVersion byte
+	signal       chan struct{}
+	// stop is closed once the peer is removed
+	stop chan struct{}
+}
+
+func newPeerQueue(r *Replication, peer string, maxSize, batchSize int) *peerQueue {
+	if batchSize < 1 {
+		batchSize = 1
+	}
+	return &peerQueue{
+		l:         r.l.With(zap.String("replication.peer", peer)),
+		r:         r,
+		peer:      peer,
+		maxSize:   maxSize,
+		batchSize: batchSize,
+		pending:   make(map[string]PortMappingLease),
+		signal:    make(chan struct{}, 1),
+		stop:      make(chan struct{}),
+	}
+}
+
+// enqueue never blocks, it replaces a pending update of the same lease
+func (q *peerQueue) enqueue(lease PortMappingLease, trace spanContext) {
+	if q.r.isStreaming(q.peer) {
+		// The peer gets the update from the change stream
+		return
+	}
+	q.mu.Lock()
+	if current, ok := q.pending[lease.Id]; ok {
+		if lease.Version >= current.Version {
+			q.pending[lease.Id] = lease
+		}
+	} else if len(q.pending) < q.maxSize {
+		q.pending[lease.Id] = lease
+	} else if !q.dirty {
+		q.dirty = true
+		q.l.Warn("replication queue is full, peer will get a full push")
+	}
+	if trace.valid() && !q.trace.valid() {
+		q.trace = trace
+	}
+	q.mu.Unlock()
+
+	select {
+	case q.signal <- struct{}{}:
+	default:
+	}
+}
+
+func (q *peerQueue) len() int {
+	q.mu.Lock()
+	defer q.mu.Unlock()
+	return len(q.pending)
+}
+
+// take removes up to a batch of pending updates, and the trace to push them in
+func (q *peerQueue) take() ([]PortMappingLease, spanContext) {
+	q.mu.Lock()
+	defer q.mu.Unlock()
+	trace := q.trace
+	q.trace = spanContext{}
+	batch := make([]PortMappingLease, 0, q.batchSize)
+	for id, lease := range q.pending {
+		if len(batch) == q.batchSize {
+			break
+		}
+		batch = append(batch, lease)
+		delete(q.pending, id)
+	}
+	return batch, trace
+}
+
+// requeue puts back a failed batch, keeping updates queued since
+func (q *peerQueue) requeue(batch []PortMappingLease) {
+	q.mu.Lock()
+	defer q.mu.Unlock()
+	for _, lease := range batch {
+		if _, ok := q.pending[lease.Id]; ok {
+			continue
+		}
+		if len(q.pending) >= q.maxSize {
+			q.dirty = true
+			continue
+		}
+		q.pending[lease.Id] = lease
+	}
+}
+
+func (q *peerQueue) run() {
+	retry := replicationRetryMin
+	for {
+		q.mu.Lock()
+		dirty := q.dirty
+		empty := len(q.pending) == 0
+		q.mu.Unlock()
+
+		if empty && !dirty {
+			select {
+			case <-q.signal:
+			case <-q.stop:
+				return
+			}
+			continue
+		}
+
+		var err error
+		if dirty {
+			err = q.pushAll()
+		} else {
+			batch, trace := q.take()
+			if err = q.push(batch, trace); err != nil {
+				q.requeue(batch)
+			}
+		}
+		if err != nil {
+			q.l.With(zap.Error(err)).Warn("failed to push leases")
+			select {
+			case <-time.After(retry):
+			case <-q.stop:
+				return
+			}
+			if retry *= 2; retry > replicationRetryMax {
+				retry = replicationRetryMax
+			}
+			continue
+		}
+		retry = replicationRetryMin
+	}
+}
+
+// pushAll pushes all leases of the store, after the queue has overflowed
+func (q *peerQueue) pushAll() error {
+	// Updates from now on are queued again, they are pushed once more at worst
+	q.mu.Lock()
+	q.dirty = false
+	q.mu.Unlock()
+
+	leases, err := q.r.store.GetLeases()
+	batch := make([]PortMappingLease, 0, q.batchSize)
+	for i := 0; err == nil && i < len(leases); i++ {
+		batch = append(batch, *leases[i])
+		if len(batch) == q.batchSize || i == len(leases)-1 {
+			err = q.push(batch, spanContext{})
+			batch = batch[:0]
+		}
+	}
+	if err != nil {
+		q.mu.Lock()
+		q.dirty = true
+		q.mu.Unlock()
+	}
+	return err
+}
+
+// push sends the leases to the peer, continuing the trace
+func (q *peerQueue) push(leases []PortMappingLease, trace spanContext) error {
+	if len(leases) == 0 {
+		return nil
+	}
+	sp := tracer.startFrom("replication.push", trace)
+	defer sp.end()
+	if sp != nil {
+		sp.set(zap.String("replication.peer", q.peer), zap.Int("replication.leases", len(leases)))
+	}
+	if !q.legacy && !q.jsonOnly && (q.leaseVersion >= leaseCodecV2 || !hasExternalIP(leases)) {
+		batch := make([]byte, 0, len(leases)*64)
+		for i := range leases {
+			batch = appendLeaseVersion(batch, &leases[i], q.leaseVersion)
+		}
+		status, err := q.send(sp, "POST", fmt.Sprintf("http://%s/leases/batch", q.peer), leaseMediaType(q.leaseVersion), batch)
+		if err != nil {
+			return err
+		}
+		if status == http.StatusBadRequest || status == http.StatusUnsupportedMediaType {
+			q.l.Info("peer does not support binary leases, falling back to json")
+			q.jsonOnly = true
+		} else if status != http.StatusNotFound {
+			if status != 200 {
+				return fmt.Errorf("unexpected response status code %d", status)
+			}
+			return nil
+		} else {
+			q.l.Info("peer does not support batches, falling back to one request per lease")
+			q.legacy = true
+		}
+	}
+	if !q.legacy {
+		jsonBytes, err := json.Marshal(leases)
+		if err != nil {
+			return fmt.Errorf("failed to marshal leases: %v", err)
+		}
+		status, err := q.send(sp, "POST", fmt.Sprintf("http://%s/leases/batch", q.peer), "application/json", jsonBytes)
+		if err != nil {
+			return err
+		}
+		if status != http.StatusNotFound {
+			if status != 200 {
+				return fmt.Errorf("unexpected response status code %d", status)
+			}
+			return nil
+		}
+		q.l.Info("peer does not support batches, falling back to one request per lease")
+		q.legacy = true
+	}
+	for _, lease := range leases {
+		jsonBytes, err := json.Marshal(lease)
+		if err != nil {
+			return fmt.Errorf("failed to marshal lease: %v", err)
+		}
+		status, err := q.send(sp, "PUT", fmt.Sprintf("http://%s/leases/%s", q.peer, lease.Id), "application/json", jsonBytes)
+		if err != nil {
+			return err
+		}
+		if status != 200 {
+			return fmt.Errorf("unexpected response status code %d", status)
+		}
+	}
+	return nil
+}
+
+// hasExternalIP returns whether a lease records an external ip
+func hasExternalIP(leases []PortMappingLease) bool {
+	for i := range leases {
+		if leases[i].ExternalIP != nil {
+			return true
+		}
+	}
+	return false
+}
+
+func (q *peerQueue) send(sp *span, method, u, contentType string, body []byte) (int, error) {
+	req, err := http.NewRequest(method, u, bytes.NewReader(body))
+	if err != nil {
+		return 0, fmt.Errorf("failed to create request for %s: %v", u, err)
+	}
+	sp.inject(req.Header)
+	req.Header.Set(headers.ContentType, contentType)
+	req.SetBasicAuth("repl", q.r.secret)
+
+	start := time.Now()
+	operation := "push"
+	if method == "PUT" {
+		operation = "push_single"
+	}
+	response, err := q.r.client.Do(req)
+	if err != nil {
+		metricReplicationDuration.observe(start, operation, "error")
+		return 0, err
+	}
+	if v := leaseMediaVersion(response.Header.Get(acceptPostHeader)); v > q.leaseVersion {
+		q.leaseVersion = v
+	}
+	metricReplicationDuration.observe(start, operation, strconv.Itoa(response.StatusCode))
+	// Drain the body, so the connection goes back to the pool
+	io.Copy(io.Discard, response.Body)
+	response.Body.Close()
+	return response.StatusCode, nil
+}
@@ -0,0 +1,252 @@
+package main
+
+import (
+	"context"
+	"encoding/json"
+	"errors"
+	"fmt"
+	"github.com/gin-gonic/gin"
+	"github.com/go-http-utils/headers"
+	"go.uber.org/zap"
+	"io"
+	"net"
+	"net/http"
+	"strconv"
+	"time"
+)
+
+// changeStreamBatch is the number of changes written per flush of a stream
+const changeStreamBatch = 256
+
+// peerHeader tells the address a follower is listed by in the peers
+const peerHeader = "X-Replication-Peer"
+
+var errStreamUnsupported = errors.New("peer does not support change streams")
+
+// streamChanges serves GET /leases/stream, streaming the local changes as
+// newline delimited json. Without since the stream starts at the current
+// sequence, the first line tells the epoch and sequence the stream starts at.
+// A since no longer in the change log, or of another epoch, is answered with
+// 410 Gone, the peer then has to sync before streaming from the current
+// sequence.
+func (r *Replication) streamChanges(c *gin.Context) {
+	seq := r.changes.last()
+	if s := c.Query("since"); s != "" {
+		since, err := strconv.ParseUint(s, 10, 64)
+		if err != nil {
+			c.AbortWithStatus(400)
+			return
+		}
+		if epoch, _ := strconv.ParseInt(c.Query("epoch"), 10, 64); epoch != r.changes.epoch {
+			c.AbortWithStatus(http.StatusGone)
+			return
+		}
+		if _, _, ok := r.changes.since(since, 0); !ok {
+			c.AbortWithStatus(http.StatusGone)
+			return
+		}
+		seq = since
+	}
+
+	host, _, err := net.SplitHostPort(c.Request.RemoteAddr)
+	if err != nil {
+		host = c.Request.RemoteAddr
+	}
+	follower := streamFollower(c.GetHeader(peerHeader), host)
+	r.streamStarted(follower)
+	defer r.streamEnded(follower)
+
+	c.Header(headers.ContentType, "application/x-ndjson")
+	c.Status(200)
+	first := &changeEntry{Epoch: r.changes.epoch, Seq: seq}
+	heartbeat := time.NewTicker(r.heartbeat)
+	defer heartbeat.Stop()
+	c.Stream(func(w io.Writer) bool {
+		enc := json.NewEncoder(w)
+		if first != nil {
+			err := enc.Encode(first)
+			first = nil
+			return err == nil
+		}
+		entries, notify, ok := r.changes.since(seq, changeStreamBatch)
+		if !ok {
+			// The peer fell behind the change log, it resumes with a 410
+			r.l.With(zap.String("client.ip", host)).Warn("change stream fell behind")
+			return false
+		}
+		if len(entries) == 0 {
+			select {
+			case <-notify:
+				return true
+			case <-heartbeat.C:
+				return enc.Encode(&changeEntry{Seq: seq}) == nil
+			case <-c.Request.Context().Done():
+				return false
+			}
+		}
+		for i := range entries {
+			if err := enc.Encode(&entries[i]); err != nil {
+				return false
+			}
+			seq = entries[i].Seq
+		}
+		return true
+	})
+}
+
+// streamFollower returns the address a follower is known by. That is the
+// address it tells in peerHeader, with the remote host when it only tells its
+// listen address, and just the remote host for followers of older versions.
+func streamFollower(advertised, host string) string {
+	h, port, err := net.SplitHostPort(advertised)
+	if err != nil {
+		return host
+	}
+	if ip := net.ParseIP(h); h == "" || (ip != nil && ip.IsUnspecified()) {
+		return net.JoinHostPort(host, port)
+	}
+	return advertised
+}
+
+func (r *Replication) streamStarted(follower string) {
+	r.streamingMu.Lock()
+	defer r.streamingMu.Unlock()
+	r.streaming[follower]++
+}
+
+func (r *Replication) streamEnded(follower string) {
+	r.streamingMu.Lock()
+	defer r.streamingMu.Unlock()
+	if r.streaming[follower]--; r.streaming[follower] <= 0 {
+		delete(r.streaming, follower)
+	}
+}
+
+// isStreaming returns whether the peer follows the change stream, so changes
+// do not have to be pushed to it. Followers without peerHeader are matched by
+// the host of the peer.
+func (r *Replication) isStreaming(peer string) bool {
+	host, _, err := net.SplitHostPort(peer)
+	if err != nil {
+		host = peer
+	}
+	r.streamingMu.Lock()
+	defer r.streamingMu.Unlock()
+	return r.streaming[peer] > 0 || r.streaming[host] > 0
+}
+
+// followChanges follows the change stream of the peer, reconnecting when it
+// breaks, until the peer turns out to not support streams or stop is closed.
+func (r *Replication) followChanges(peer string, stop <-chan struct{}) {
+	l := r.l.With(zap.String("replication.peer", peer))
+	ctx, cancel := context.WithCancel(context.Background())
+	defer cancel()
+	go func() {
+		select {
+		case <-stop:
+			cancel()
+		case <-ctx.Done():
+		}
+	}()
+	position := &streamPosition{}
+	retry := replicationRetryMin
+	for {
+		received, err := r.followStream(ctx, peer, position)
+		if err == errStreamUnsupported {
+			l.Info("peer does not support change streams, relying on push and sync")
+			return
+		}
+		if received {
+			retry = replicationRetryMin
+		}
+		l.With(zap.Error(err)).Sugar().Debugf("change stream ended, reconnecting in %s", retry)
+		select {
+		case <-time.After(retry):
+		case <-ctx.Done():
+			l.Debug("stopped following changes of removed peer")
+			return
+		}
+		if retry *= 2; retry > replicationRetryMax {
+			retry = replicationRetryMax
+		}
+	}
+}
+
+// streamPosition is the last change applied from a peer
+type streamPosition struct {
+	valid bool
+	epoch int64
+	seq   uint64
+}
+
+// followStream applies the changes of one stream connection, it returns
+// whether any line was received.
+func (r *Replication) followStream(ctx context.Context, peer string, position *streamPosition) (bool, error) {
+	u := fmt.Sprintf("http://%s/leases/stream", peer)
+	if position.valid {
+		u += fmt.Sprintf("?since=%d&epoch=%d", position.seq, position.epoch)
+	}
+	req, err := http.NewRequestWithContext(ctx, "GET", u, nil)
+	if err != nil {
+		return false, err
+	}
+	req.Header.Set(headers.Accept, "application/x-ndjson")
+	if r.advertiseAddr != "" {
+		req.Header.Set(peerHeader, r.advertiseAddr)
+	}
+	req.SetBasicAuth("repl", r.secret)
+
+	response, err := r.streamClient.Do(req)
+	if err != nil {
+		return false, err
+	}
+	defer response.Body.Close()
+
+	switch response.StatusCode {
+	case 200:
+	case http.StatusNotFound:
+		return false, errStreamUnsupported
+	case http.StatusGone:
+		// Missed changes, start over with a sync
+		position.valid = false
+		return true, fmt.Errorf("change stream position is gone")
+	default:
+		return false, fmt.Errorf("unexpected response status code %d", response.StatusCode)
+	}
+
+	// The peer sends heartbeats, a silent connection is dead
+	idle := time.AfterFunc(3*r.heartbeat, func() { response.Body.Close() })
+	defer idle.Stop()
+
+	received := false
+	dec := json.NewDecoder(response.Body)
+	for {
+		var entry changeEntry
+		if err := dec.Decode(&entry); err != nil {
+			return received, err
+		}
+		idle.Reset(3 * r.heartbeat)
+		received = true
+
+		if entry.Epoch != 0 {
+			if position.valid && entry.Epoch == position.epoch {
+				continue
+			}
+			// A new stream position, changes before it are pulled by a sync
+			*position = streamPosition{valid: true, epoch: entry.Epoch, seq: entry.Seq}
+			if r.syncFrom(peer) {
+				r.sendUpdate()
+			}
+			continue
+		}
+		if entry.Lease != nil {
+			changed, err := r.store.MergeLease(entry.Lease)
+			if err != nil {
+				r.l.With(zap.Error(err), zap.String("replication.peer", peer)).Warn("failed to upsert streamed lease")
+			} else if changed {
+				r.sendUpdate()
+			}
+		}
+		position.seq = entry.Seq
+	}
+}
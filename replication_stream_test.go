@@ -0,0 +1,36 @@
+package main
+
+import "testing"
+
+// TestIsStreaming matches followers listed in the peers by hostname, by ip and
+// followers of older versions telling no address
+func TestIsStreaming(t *testing.T) {
+	tests := []struct {
+		name       string
+		advertised string
+		remoteHost string
+		peer       string
+		want       bool
+	}{
+		{name: "hostname", advertised: "node-b.example:8081", remoteHost: "192.0.2.2", peer: "node-b.example:8081", want: true},
+		{name: "other port", advertised: "node-b.example:8081", remoteHost: "192.0.2.2", peer: "node-b.example:8082"},
+		{name: "listen address", advertised: ":8081", remoteHost: "192.0.2.2", peer: "192.0.2.2:8081", want: true},
+		{name: "unspecified listen address", advertised: "0.0.0.0:8081", remoteHost: "192.0.2.2", peer: "192.0.2.2:8081", want: true},
+		{name: "older follower", remoteHost: "192.0.2.2", peer: "192.0.2.2:8081", want: true},
+		{name: "older follower by hostname", remoteHost: "192.0.2.2", peer: "node-b.example:8081"},
+	}
+	for _, tt := range tests {
+		t.Run(tt.name, func(t *testing.T) {
+			r := &Replication{streaming: make(map[string]int)}
+			follower := streamFollower(tt.advertised, tt.remoteHost)
+			r.streamStarted(follower)
+			if got := r.isStreaming(tt.peer); got != tt.want {
+				t.Errorf("isStreaming(%q) of follower %q = %v, want %v", tt.peer, follower, got, tt.want)
+			}
+			r.streamEnded(follower)
+			if r.isStreaming(tt.peer) {
+				t.Errorf("isStreaming(%q) after the stream ended", tt.peer)
+			}
+		})
+	}
+}
@@ -0,0 +1,142 @@
+package main
+
+import (
+	"encoding/binary"
+	"net"
+	"net/netip"
+	"sync"
+	"time"
+)
+
+const (
+	requestCacheShards = 16
+	// requestCacheTTL covers the first retransmits of a client, 250ms to 2s
+	requestCacheTTL       = 2 * time.Second
+	requestCacheShardSize = 4096
+)
+
+type requestState int
+
+const (
+	requestNew requestState = iota
+	requestInFlight
+	requestAnswered
+)
+
+// requestKey identifies a mapping request by the client address and the
+// request itself, a retransmit is the same request from the same address.
+type requestKey struct {
+	addr netip.AddrPort
+	req  [12]byte
+}
+
+func newRequestKey(addr net.Addr, req []byte) (requestKey, bool) {
+	var key requestKey
+	udpAddr, ok := addr.(*net.UDPAddr)
+	if !ok || len(req) != len(key.req) {
+		return key, false
+	}
+	key.addr = udpAddr.AddrPort()
+	copy(key.req[:], req)
+	return key, true
+}
+
+type cachedRequest struct {
+	answered bool
+	result   mappingResult
+}
+
+// requestCache remembers the mapping requests in flight and the responses of
+// the ones just answered. Each shard keeps two generations of entries, the
+// older one is dropped once the current one is requestCacheTTL old or full,
+// so the cache is bounded without tracking entries one by one.
+type requestCache struct {
+	shards [requestCacheShards]requestCacheShard
+}
+
+type requestCacheShard struct {
+	mu       sync.Mutex
+	current  map[requestKey]cachedRequest
+	previous map[requestKey]cachedRequest
+	rotated  time.Time
+}
+
+// shard returns the shard of the client ip, so the requests of a client can be
+// evicted from one shard
+func (c *requestCache) shard(ip netip.Addr) *requestCacheShard {
+	b := ip.As16()
+	h := uint32(0)
+	for _, x := range b[12:] {
+		h = h*31 + uint32(x)
+	}
+	return &c.shards[h%requestCacheShards]
+}
+
+// begin returns the state of the request, a new request is marked in flight
+func (c *requestCache) begin(key *requestKey, now time.Time) (mappingResult, requestState) {
+	s := c.shard(key.addr.Addr())
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	s.rotate(now)
+	r, ok := s.current[*key]
+	if !ok {
+		r, ok = s.previous[*key]
+	}
+	if ok {
+		if r.answered {
+			return r.result, requestAnswered
+		}
+		return mappingResult{}, requestInFlight
+	}
+	s.current[*key] = cachedRequest{}
+	return mappingResult{}, requestNew
+}
+
+// finish stores the response of the request, without one a retransmit is
+// handled again
+func (c *requestCache) finish(key *requestKey, result mappingResult, answered bool) {
+	s := c.shard(key.addr.Addr())
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	if !answered {
+		delete(s.current, *key)
+		delete(s.previous, *key)
+		return
+	}
+	s.current[*key] = cachedRequest{answered: true, result: result}
+}
+
+// evict forgets the requests of the client ip with the opcode for the internal
+// port, all ports for 0, so retransmits of the requests creating mappings just
+// deleted create them again
+func (c *requestCache) evict(ip netip.Addr, op byte, internalPort uint16) {
+	ip = ip.Unmap()
+	s := c.shard(ip)
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	for _, m := range []map[requestKey]cachedRequest{s.current, s.previous} {
+		for key := range m {
+			if key.addr.Addr().Unmap() == ip && key.req[1] == op && (internalPort == 0 || binary.BigEndian.Uint16(key.req[4:6]) == internalPort) {
+				delete(m, key)
+			}
+		}
+	}
+}
+
+func (s *requestCacheShard) rotate(now time.Time) {
+	if s.current == nil {
+		s.current = make(map[requestKey]cachedRequest)
+		s.previous = make(map[requestKey]cachedRequest)
+		s.rotated = now
+		return
+	}
+	if now.Sub(s.rotated) < requestCacheTTL && len(s.current) < requestCacheShardSize {
+		return
+	}
+	// Reuse the map of the dropped generation
+	for k := range s.previous {
+		delete(s.previous, k)
+	}
+	s.current, s.previous = s.previous, s.current
+	s.rotated = now
+}
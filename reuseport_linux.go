@@ -0,0 +1,31 @@
+//go:build linux
+
+package main
+
+import (
+	"context"
+	"golang.org/x/sys/unix"
+	"net"
+	"syscall"
+)
+
+// listenPacket listens on addr with SO_REUSEPORT, so several sockets can share
+// the address and the kernel spreads the clients over them.
+func listenPacket(addr string, reusePort bool) (net.PacketConn, error) {
+	if !reusePort {
+		return net.ListenPacket("udp4", addr)
+	}
+	lc := net.ListenConfig{
+		Control: func(network, address string, c syscall.RawConn) error {
+			var sockErr error
+			err := c.Control(func(fd uintptr) {
+				sockErr = unix.SetsockoptInt(int(fd), unix.SOL_SOCKET, unix.SO_REUSEPORT, 1)
+			})
+			if err != nil {
+				return err
+			}
+			return sockErr
+		},
+	}
+	return lc.ListenPacket(context.Background(), "udp4", addr)
+}
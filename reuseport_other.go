@@ -0,0 +1,15 @@
+//go:build !linux
+
+package main
+
+import (
+	"fmt"
+	"net"
+)
+
+func listenPacket(addr string, reusePort bool) (net.PacketConn, error) {
+	if reusePort {
+		return nil, fmt.Errorf("multiple sockets per listen address is only supported on linux")
+	}
+	return net.ListenPacket("udp4", addr)
+}
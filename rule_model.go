@@ -0,0 +1,61 @@
+package main
+
+// ruleModel is the in-memory view of what is programmed in one chain, set or
+// map, keyed by the identity of the entry (the lease Id for iptables rules).
+type ruleModel map[string][]string
+
+// newRuleModel keys the entries of the leases by keyFn, leases with an empty
+// key have no entry
+func newRuleModel(leases []*PortMappingLease, keyFn func(*PortMappingLease) string, fn func(*PortMappingLease) []string) ruleModel {
+	m := make(ruleModel, len(leases))
+	for _, lease := range leases {
+		if key := keyFn(lease); key != "" {
+			m[key] = fn(lease)
+		}
+	}
+	return m
+}
+
+// delta returns the entries to remove from m and the entries to add to m to
+// end up with desired, a changed entry is in both.
+func (m ruleModel) delta(desired ruleModel) (removed, added ruleModel) {
+	removed = make(ruleModel)
+	added = make(ruleModel)
+	for key, current := range m {
+		rule, ok := desired[key]
+		if !ok || !equalArgs(rule, current) {
+			removed[key] = current
+		}
+	}
+	for key, rule := range desired {
+		current, ok := m[key]
+		if !ok || !equalArgs(rule, current) {
+			added[key] = rule
+		}
+	}
+	return removed, added
+}
+
+func (m ruleModel) equal(other ruleModel) bool {
+	if len(m) != len(other) {
+		return false
+	}
+	removed, _ := m.delta(other)
+	return len(removed) == 0
+}
+
+func equalArgs(a, b []string) bool {
+	if len(a) != len(b) {
+		return false
+	}
+	for i := range a {
+		if a[i] != b[i] {
+			return false
+		}
+	}
+	return true
+}
+
+func leaseId(lease *PortMappingLease) string {
+	return lease.Id
+}
@@ -0,0 +1,167 @@
+package main
+
+import (
+	"encoding/binary"
+	"encoding/hex"
+	"go.uber.org/zap"
+	"math/rand"
+	"net/http"
+	"time"
+)
+
+// Spans time the steps of a request like OpenTelemetry spans, without the
+// collector. A sampled request is a trace, each of its spans is logged when it
+// ends, and the trace goes along to the peers in the W3C traceparent header,
+// so the spans of all nodes of a request share its trace id. Requests not
+// sampled have a nil span, the span methods do nothing on nil.
+
+const traceparentHeader = "traceparent"
+
+// spanContext identifies a span in its trace
+type spanContext struct {
+	traceID [16]byte
+	spanID  [8]byte
+}
+
+func (c spanContext) valid() bool {
+	return c.traceID != [16]byte{} && c.spanID != [8]byte{}
+}
+
+// traceparent returns the header of the sampled span
+func (c spanContext) traceparent() string {
+	var b [55]byte
+	copy(b[:], "00-")
+	hex.Encode(b[3:35], c.traceID[:])
+	b[35] = '-'
+	hex.Encode(b[36:52], c.spanID[:])
+	copy(b[52:], "-01")
+	return string(b[:])
+}
+
+// parseTraceparent parses a traceparent header of version 00, only sampled
+// parents are continued
+func parseTraceparent(s string) (spanContext, bool) {
+	var c spanContext
+	if len(s) != 55 || s[:3] != "00-" || s[35] != '-' || s[52] != '-' {
+		return c, false
+	}
+	var flags [1]byte
+	if _, err := hex.Decode(c.traceID[:], []byte(s[3:35])); err != nil {
+		return c, false
+	}
+	if _, err := hex.Decode(c.spanID[:], []byte(s[36:52])); err != nil {
+		return c, false
+	}
+	if _, err := hex.Decode(flags[:], []byte(s[53:55])); err != nil || flags[0]&1 == 0 {
+		return c, false
+	}
+	return c, c.valid()
+}
+
+type spanTracer struct {
+	l     *zap.Logger
+	ratio float64
+}
+
+// tracer samples and logs the spans, it is disabled until configured
+var tracer = &spanTracer{}
+
+// configure logs the spans to l and samples ratio of the new traces, 0
+// disables tracing. It is called at start before any span.
+func (t *spanTracer) configure(l *zap.Logger, ratio float64) {
+	t.l = l
+	t.ratio = ratio
+}
+
+// start starts the root span of a new trace when it is sampled
+func (t *spanTracer) start(name string) *span {
+	if t.ratio <= 0 || rand.Float64() >= t.ratio {
+		return nil
+	}
+	var c spanContext
+	binary.BigEndian.PutUint64(c.traceID[:8], rand.Uint64())
+	binary.BigEndian.PutUint64(c.traceID[8:], rand.Uint64()|1)
+	return t.startChild(name, c)
+}
+
+// startFrom continues the trace of parent, without a sampled parent it may
+// start a new trace
+func (t *spanTracer) startFrom(name string, parent spanContext) *span {
+	if t.ratio <= 0 {
+		return nil
+	}
+	if !parent.valid() {
+		return t.start(name)
+	}
+	return t.startChild(name, parent)
+}
+
+// startRemote continues the trace of the traceparent header of a peer
+func (t *spanTracer) startRemote(name, traceparent string) *span {
+	parent, _ := parseTraceparent(traceparent)
+	return t.startFrom(name, parent)
+}
+
+func (t *spanTracer) startChild(name string, parent spanContext) *span {
+	s := &span{t: t, name: name, parent: parent.spanID, start: time.Now()}
+	s.ctx.traceID = parent.traceID
+	binary.BigEndian.PutUint64(s.ctx.spanID[:], rand.Uint64()|1)
+	return s
+}
+
+type span struct {
+	t      *spanTracer
+	name   string
+	ctx    spanContext
+	parent [8]byte
+	start  time.Time
+	fields []zap.Field
+}
+
+// child starts a span of a step of s
+func (s *span) child(name string) *span {
+	if s == nil {
+		return nil
+	}
+	return s.t.startChild(name, s.ctx)
+}
+
+// set adds fields to the span
+func (s *span) set(fields ...zap.Field) {
+	if s != nil {
+		s.fields = append(s.fields, fields...)
+	}
+}
+
+// context returns the context of the span, invalid for nil
+func (s *span) context() spanContext {
+	if s == nil {
+		return spanContext{}
+	}
+	return s.ctx
+}
+
+// inject sets the traceparent header of a request to a peer
+func (s *span) inject(h http.Header) {
+	if s != nil {
+		h.Set(traceparentHeader, s.ctx.traceparent())
+	}
+}
+
+// end logs the span
+func (s *span) end() {
+	if s == nil {
+		return
+	}
+	fields := append(s.fields,
+		zap.String("trace.id", hex.EncodeToString(s.ctx.traceID[:])),
+		zap.String("span.id", hex.EncodeToString(s.ctx.spanID[:])),
+		zap.String("span.name", s.name),
+		zap.Time("span.start", s.start),
+		zap.Duration("event.duration", time.Since(s.start)),
+	)
+	if s.parent != [8]byte{} {
+		fields = append(fields, zap.String("parent.id", hex.EncodeToString(s.parent[:])))
+	}
+	s.t.l.Info("span", fields...)
+}